@@ -28,6 +28,8 @@
 
 #  include "vfunc.h"
 #  include <threads.h>
+#  include <stdatomic.h>
+#  include <stdint.h>
 #  include <errno.h>
 #  include <stdio.h>
 
@@ -38,9 +40,138 @@
 #  define DEFAULT      UNBUFFERED
                                 /* Default is unbuffered (à la Go) */
 
+#  ifndef BOTTLE_CACHE_LINE
+#    define BOTTLE_CACHE_LINE 64        /* Size of a cache line (0 to pack the bottle without regard to cache lines) */
+#  endif
+#  if BOTTLE_CACHE_LINE
+#    define BOTTLE_CACHE_ALIGNED _Alignas (BOTTLE_CACHE_LINE)
+#  else
+#    define BOTTLE_CACHE_ALIGNED
+#  endif
+
+#  ifndef BOTTLE_HEAP_ARITY
+#    define BOTTLE_HEAP_ARITY 4         /* Number of children of each node of the heap of a priority bottle */
+#  endif
+
+#  ifndef BOTTLE_MPMC_CLAIMS
+#    define BOTTLE_MPMC_CLAIMS 8        /* Number of MPMC bottles of a type a thread can reserve (or acquire) in at once (beyond, errno is set to EBUSY) */
+#  endif
+
+/* Engines implementing the bottle */
+typedef enum
+{
+  BOTTLE_MUTEX = 0,             /* Any capacity, any number of senders and receivers (default) */
+  BOTTLE_SPSC,                  /* Lock-free ring, buffered (limited capacity), one sender and one receiver only */
+  BOTTLE_MPMC,                  /* Lock-free ring, buffered (limited capacity), any number of senders and receivers */
+  BOTTLE_TWO_LOCK,              /* Ring with separate locks for senders and receivers, buffered (limited capacity) */
+  BOTTLE_BROADCAST,             /* Ring read by every subscriber at its own cursor, buffered (limited capacity) */
+  BOTTLE_PRIORITY,              /* Heap of messages ordered by a comparison function, buffered (limited capacity) */
+  BOTTLE_SHARED,                /* Ring in memory shared between processes, buffered (limited capacity), see BOTTLE_CREATE_SHARED */
+  BOTTLE_TOKEN,                 /* Lock-free count of messages without payload (as a counting semaphore), buffered (limited capacity) */
+} bottle_engine;
+
+/* Allocation hooks of a bottle. Both functions must be set (or none, for the heap). */
+typedef struct bottle_allocator
+{
+  void *(*allocate) (void *context, size_t size, size_t alignment);   /* Returns size bytes aligned on alignment, or 0 */
+  void  (*release) (void *context, void *memory, size_t size);        /* Frees memory returned by allocate for size bytes */
+  void   *context;              /* Passed to the hooks */
+} bottle_allocator;
+
+/* Options at creation of a bottle. All fields default to 0. */
+typedef struct bottle_options
+{
+  bottle_engine engine;
+  size_t        spin;           /* Number of iterations a blocked thread spins (with a pause instruction) before parking */
+  int           padded_slots;   /* Pad each slot of the ring to a cache line (BOTTLE_MPMC engine) */
+  size_t        segment;        /* Number of messages per block of an UNLIMITED bottle stored as linked blocks (0 for a contiguous array) */
+  size_t        growth;         /* Factor by which the contiguous array of a full UNLIMITED bottle grows (0 for 2) */
+  size_t        shrink;         /* The array of an UNLIMITED bottle shrinks once it is filled to 1/shrink of its capacity or less (0 for 2) */
+  size_t        shrink_delay;   /* Number of consecutive receptions below that low-water mark before the array shrinks */
+  size_t        floor;          /* Capacity of an UNLIMITED bottle allocated at creation, below which it never shrinks */
+  int           power_of_two;   /* Round the capacity of a buffered bottle up to a power of two (ring positions are then masked rather than divided) */
+  const bottle_allocator *allocator;  /* Allocation hooks for the bottle and its buffer (0 for the heap) ; copied at creation */
+  int         (*compare) (const void *a, const void *b);  /* Order of the messages of a BOTTLE_PRIORITY bottle: negative if a is received before b (as for qsort) */
+  size_t        wake_batch;     /* Number of messages in the bottle before parked receivers are woken up (0 or 1 for every message) */
+  struct timespec wake_delay;   /* Longest delay a wake batch waits to be complete, from its first message (0 for 1 millisecond) */
+  int           pollable;       /* Expose descriptors of readiness for poll or epoll (see BOTTLE_RECV_FD, mutex or priority engine only, not broadcast, requires BOTTLE_POLL) */
+  const char   *spill_directory; /* Directory where an UNLIMITED bottle spills its blocks of messages past spill_watermark, as files (requires BOTTLE_MMAP) */
+  size_t        spill_watermark; /* Number of messages an UNLIMITED bottle spilling to disk keeps in memory */
+} bottle_options;
+
+/* Statistics of a bottle (see bottle_stats). Counters are only kept if BOTTLE_STATISTICS is defined. */
+typedef struct bottle_statistics
+{
+  uint64_t sent;                /* Number of messages sent */
+  uint64_t received;            /* Number of messages received */
+  uint64_t blocked_sends;       /* Number of times a sender blocked (bottle full or plugged) */
+  uint64_t blocked_receives;    /* Number of times a receiver blocked (bottle empty) */
+  uint64_t send_wait;           /* Time senders spent blocked, in nanoseconds */
+  uint64_t receive_wait;        /* Time receivers spent blocked, in nanoseconds */
+  size_t   max_size;            /* Largest number of messages in the bottle */
+  double   mean_size;           /* Average number of messages in the bottle (sampled after each exchange) */
+  uint64_t contentions;         /* Number of times a thread found the mutex of the bottle locked */
+  size_t   size;                /* Number of messages in the bottle (kept anyway) */
+  size_t   resizes;             /* Number of times the buffer of an UNLIMITED bottle was reallocated, or a block allocated or freed (kept anyway) */
+} bottle_statistics;
+
+#  ifdef BOTTLE_STATISTICS
+typedef struct bottle_counters
+{
+  atomic_uint_least64_t sent, received;
+  atomic_uint_least64_t blocked_sends, blocked_receives;
+  atomic_uint_least64_t send_wait, receive_wait;
+  atomic_uint_least64_t samples, occupancy, max_size;   /* Number of samples, sum and maximum of the sampled sizes */
+  atomic_uint_least64_t contentions;
+} bottle_counters;
+#    define BOTTLE_COUNTERS  bottle_counters counters;  /* Statistics of the bottle */
+#  else
+#    define BOTTLE_COUNTERS
+#  endif
+
+/* A case of bottle_select: a non-blocking send or receive on a bottle of any type.
+   Build it with bottle_case_send or bottle_case_recv. */
+typedef struct bottle_case
+{
+  void                   *bottle;     /* Bottle of any type */
+  void                   *message;    /* Message to send, or where to receive it */
+  int                     send;       /* 1 to send, 0 to receive */
+  int                   (*operation) (struct bottle_case *c);         /* Non-blocking send or receive */
+  void                  (*watch) (void *bottle, struct bottle_case *c, int on);
+  struct bottle_selector *selector;   /* Private: thread waiting in bottle_select */
+  struct bottle_case     *next;       /* Private: next case watching the same bottle */
+} bottle_case;
+
+/* A thread blocked in bottle_select, notified by the bottles it watches.
+   Its cases of unbuffered bottles are offers, which a peer at the meeting point can take while it watches them. */
+typedef struct bottle_selector
+{
+  mtx_t mutex;
+  cnd_t cond;
+  int   ready;                  /* Set by a bottle whose state changed */
+  int   polling;                /* Set by a bottle which can't notify its changes (shared): check the cases periodically */
+  struct bottle_case *done;     /* Case performed, by the thread itself or by a peer which took its offer (0 as long as none) */
+} bottle_selector;
+
 #  define DECLARE_BOTTLE( TYPE )     \
 \
   struct _BOTTLE_##TYPE;           \
+\
+  typedef struct _BOTTLE_VIEW_##TYPE      \
+  {                                       \
+    struct                                \
+    {                                     \
+      const TYPE *messages;               \
+      size_t      size;                   \
+    } span[2];  /* Contiguous messages in order (the second span is only used if the messages wrap around the buffer) */ \
+  } BOTTLE_VIEW_##TYPE;                   \
+\
+  typedef struct _BOTTLE_SUBSCRIBER_##TYPE \
+  {                                       \
+    struct _BOTTLE_##TYPE            *bottle; /* Broadcast bottle the subscriber joined */ \
+    uint64_t                          cursor; /* Number of messages sent to the bottle and seen by the subscriber */ \
+    struct _BOTTLE_SUBSCRIBER_##TYPE *next;   \
+  } BOTTLE_SUBSCRIBER_##TYPE;             \
 \
   typedef struct _BOTTLE_VTABLE_##TYPE                            \
   {                                                               \
@@ -48,52 +179,251 @@
     int  (*TryFill) (struct _BOTTLE_##TYPE *self, TYPE message);  \
     int (*Drain) (struct _BOTTLE_##TYPE *self, TYPE *message);    \
     int (*TryDrain) (struct _BOTTLE_##TYPE *self, TYPE *message); \
+    int (*FillUntil) (struct _BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline);    \
+    int (*DrainUntil) (struct _BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline);  \
+    size_t (*FillN) (struct _BOTTLE_##TYPE *self, const TYPE *messages, size_t n);      \
+    size_t (*TryFillN) (struct _BOTTLE_##TYPE *self, const TYPE *messages, size_t n);   \
+    size_t (*DrainN) (struct _BOTTLE_##TYPE *self, TYPE *messages, size_t max);         \
+    size_t (*TryDrainN) (struct _BOTTLE_##TYPE *self, TYPE *messages, size_t max);      \
     void (*Plug) (struct _BOTTLE_##TYPE *self);                   \
     void (*Unplug) (struct _BOTTLE_##TYPE *self);                 \
     void (*Close) (struct _BOTTLE_##TYPE *self);                  \
     void (*Destroy) (struct _BOTTLE_##TYPE *self);                \
+    int (*SelectFill) (struct bottle_case *c);                    \
+    int (*SelectDrain) (struct bottle_case *c);                   \
+    void (*Watch) (void *self, struct bottle_case *c, int on);    \
+    TYPE *(*Reserve) (struct _BOTTLE_##TYPE *self, int block);    \
+    void (*Commit) (struct _BOTTLE_##TYPE *self);                 \
+    const TYPE *(*Acquire) (struct _BOTTLE_##TYPE *self, int block);  \
+    size_t (*AcquireN) (struct _BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block); \
+    void (*Release) (struct _BOTTLE_##TYPE *self, size_t k);      \
+    int (*Subscribe) (struct _BOTTLE_##TYPE *self, BOTTLE_SUBSCRIBER_##TYPE *subscriber); \
+    void (*Unsubscribe) (BOTTLE_SUBSCRIBER_##TYPE *subscriber);   \
+    int (*Read) (BOTTLE_SUBSCRIBER_##TYPE *subscriber, TYPE *message, int block, const struct timespec *deadline); \
+    int (*Stats) (struct _BOTTLE_##TYPE *self, bottle_statistics *stats); \
+    int (*Fd) (struct _BOTTLE_##TYPE *self, int send);           \
   } _BOTTLE_VTABLE_##TYPE;                                        \
 \
   typedef struct _BOTTLE_##TYPE             \
   {                                         \
     struct _queue_##TYPE {                  \
       TYPE*  buffer;      /* Array containing the messages */           \
-      TYPE*  reader_head; /* Position where to read the next value */   \
-      TYPE*  writer_head; /* Position where to write the next value */  \
-      size_t size;        /* Number of messages currently in the queue (<= capacity) */ \
+      uint64_t read;      /* Number of messages read so far */          \
+      uint64_t write;     /* Number of messages written so far (write - read is the size of the queue) */ \
+      size_t head;        /* Index of the next message to read in the array */ \
+      size_t tail;        /* Index of the next message to write in the array */ \
+      size_t mask;        /* capacity - 1 if the capacity of the array is a power of two (positions are masked), 0 otherwise (divided) */ \
+      TYPE*  reader_head; /* Position where to read the next value (segmented queue) */ \
+      TYPE*  writer_head; /* Position where to write the next value (segmented queue) */ \
       size_t capacity;    /* Maximum number of elements in the queue (size of the array) */ \
+      size_t limit;       /* Maximum number of elements the queue can ever contain */ \
       int    unlimited;   /* Indicates that the capacity can be extended automatically as required */ \
+      int    fixed;       /* Indicates that the array is stored inline, in a fixed bottle (it is neither allocated nor freed) */ \
+      bottle_allocator allocator; /* Allocation hooks of the bottle */ \
+      struct _segment_##TYPE                \
+      {                                     \
+        struct _segment_##TYPE *next;       \
+        int                     spilled;  /* The block is mapped from a segment file */ \
+        TYPE                    messages[]; \
+      } *first, *last;    /* Linked blocks of messages of a segmented queue, from reader to writer */ \
+      struct _segment_##TYPE *spare; /* Free blocks kept for reuse */ \
+      size_t spares;      /* Number of free blocks */ \
+      size_t segment;     /* Number of messages per block (0 for a contiguous array) */ \
+      char  *spill;       /* Directory where blocks are spilled as files past the watermark (0 if the queue never spills) */ \
+      size_t watermark;   /* Number of messages kept in memory blocks before blocks are spilled */ \
+      size_t spilled;     /* Number of spilled blocks */ \
+      size_t growth;      /* Factor by which the capacity of an unlimited queue grows */ \
+      size_t shrink;      /* An unlimited queue shrinks when size <= capacity / shrink (low-water mark)... */ \
+      size_t delay;       /* ... for more than delay consecutive receptions */ \
+      size_t below;       /* Number of consecutive receptions below the low-water mark */ \
+      size_t floor;       /* Capacity below which an unlimited queue never shrinks */ \
+      size_t resizes;     /* Number of times the array was reallocated, or a block allocated or freed */ \
     } queue;                                \
     size_t                       capacity; /* Declared capacity of the bottle at creation.
                                               Can be > 0 (and not -1) : buffered ;
                                               can be equal to 0, see https://users.rust-lang.org/t/0-capacity-bounded-channel/68357/20 : unbuffered ;
                                               can be -1 : unbounded */ \
-    int                          closed;    \
-    int                          frozen;    \
+    atomic_int                   closed;    \
+    atomic_int                   frozen;    \
+    size_t                       spin;      /* Number of spinning iterations before parking */ \
+    struct                                  \
+    {                                       \
+      size_t          size;     /* Number of messages before parked receivers are woken up */ \
+      struct timespec delay;    /* Longest delay a batch waits to be complete, from its first message */ \
+      int             pending;  /* Set from the first message of a batch until it is complete or its delay has elapsed */ \
+      struct timespec end;      /* End of the delay of the pending batch */ \
+    } batch;                                \
     mtx_t                        mutex;     \
     cnd_t                        not_empty; \
     cnd_t                        not_full;  \
-    int                          not_reading;\
-    cnd_t                        reading;   \
-    int                          not_writing;\
-    cnd_t                        writing;   \
+    struct                                  \
+    {                                       \
+      struct _waiters_##TYPE                \
+      {                                     \
+        struct _waiter_##TYPE               \
+        {                                   \
+          TYPE                  *message; /* Message to send, or where to receive it */ \
+          int                    done;    /* Set by the peer once the message has been handed off */ \
+          cnd_t                  cond;    /* Signalled by the peer to wake up this waiter only */ \
+          struct _waiter_##TYPE *next;      \
+        } *first, *last;                    \
+      } senders, receivers;                 \
+    } rendezvous;   /* Threads waiting for each other at the meeting point of an unbuffered bottle */ \
+    union                                   \
+    {                                       \
+      struct                                \
+      {                                     \
+        BOTTLE_CACHE_ALIGNED            \
+        atomic_size_t head;       /* Number of messages received so far (written by the receiver only) */ \
+        size_t        head_index; /* Position of head in the ring (private to the receiver) */ \
+        BOTTLE_CACHE_ALIGNED            \
+        atomic_size_t tail;       /* Number of messages sent so far (written by the sender only) */ \
+        size_t        tail_index; /* Position of tail in the ring (private to the sender) */ \
+      } spsc;                     /* Receiver and sender sides lie on separate cache lines */ \
+      struct                                \
+      {                                     \
+        struct _cell_##TYPE                 \
+        {                                   \
+          atomic_size_t sequence; /* Twice the ticket allowed to write the cell, plus one once written */ \
+          TYPE          message;            \
+        }            *cells;      /* Ring of capacity cells */ \
+        size_t        stride;     /* Distance in bytes between two cells (padded to a cache line, or not) */ \
+        size_t        mask;       /* capacity - 1 if the capacity is a power of two, 0 otherwise */ \
+        BOTTLE_CACHE_ALIGNED            \
+        atomic_size_t enqueue_pos; /* Ticket of the next message to send (the highest bit is set once closed) */ \
+        BOTTLE_CACHE_ALIGNED            \
+        atomic_size_t dequeue_pos; /* Ticket of the next message to receive */ \
+      } mpmc;                     /* Sender and receiver tickets lie on separate cache lines */ \
+      struct                                \
+      {                                     \
+        BOTTLE_CACHE_ALIGNED            \
+        mtx_t         head_lock;  /* Serialises receivers (senders serialise on mutex) */ \
+        size_t        head_index; /* Position of the next message to receive (under head_lock) */ \
+        BOTTLE_CACHE_ALIGNED            \
+        atomic_size_t size;       /* Number of messages in the ring */ \
+        size_t        tail_index; /* Position of the next message to send (under mutex) */ \
+      } two_lock;                           \
+      struct                                \
+      {                                     \
+        BOTTLE_CACHE_ALIGNED            \
+        atomic_size_t count;      /* Number of messages in the bottle (the highest bit is set once closed) */ \
+      } token;                    /* Count of a token bottle, whose messages carry no payload */ \
+      struct                                \
+      {                                     \
+        int         (*compare) (const void *a, const void *b); /* Order of the messages */ \
+        uint64_t     *ranks;      /* Rank of arrival of each message of the heap (parallel to the array of the queue) */ \
+        uint64_t      next;       /* Rank of arrival of the next message */ \
+      } priority;                 /* Heap of a priority bottle */ \
+      struct                                \
+      {                                     \
+        struct _shared_##TYPE *block; /* Control block and ring, mapped in the memory of the process */ \
+        size_t                 size;  /* Size of the mapping */ \
+        char                  *name;  /* Name of the shared memory object, unlinked at destruction (only in the process which created it) */ \
+      } shared;                   /* Ring of a bottle shared between processes */ \
+    };                          /* State private to the engine of the bottle: only the member of engine is used */ \
+    BOTTLE_CACHE_ALIGNED                    \
+    atomic_int                   receivers_waiting; /* Number of receivers parked on an empty bottle */ \
+    atomic_int                   senders_waiting;   /* Number of senders parked on a full (or plugged) bottle */ \
+    atomic_size_t                changes;   /* Number of changes of the state of the bottle, watched by spinning threads */ \
+    bottle_case                 *watchers;  /* Cases of threads waiting in bottle_select on this bottle */ \
+    struct                                  \
+    {                                       \
+      int fd[2];    /* Descriptors of readiness to receive and to send (-1 if the bottle is not pollable) */ \
+      int ready[2]; /* Whether each descriptor is currently readable */ \
+    } poll;                                 \
+    BOTTLE_SUBSCRIBER_##TYPE    *subscribers; /* Subscribers of a broadcast bottle */ \
+    BOTTLE_COUNTERS                         \
+    bottle_engine                engine;    \
     const _BOTTLE_VTABLE_##TYPE *vtable;    \
     TYPE __dummy__;                         \
   } BOTTLE_##TYPE;                          \
 \
-  BOTTLE_##TYPE *BOTTLE_CREATE_##TYPE( size_t capacity );  \
-  void BOTTLE_INIT_##TYPE (BOTTLE_##TYPE *self, size_t capacity);  \
+  BOTTLE_##TYPE *BOTTLE_CREATE_##TYPE( size_t capacity, const bottle_options *options );  \
+  BOTTLE_##TYPE *BOTTLE_CREATE_SHARED_##TYPE( const char *name, size_t capacity );  \
+  void BOTTLE_INIT_##TYPE (BOTTLE_##TYPE *self, size_t capacity, const bottle_options *options);  \
+  void BOTTLE_INIT_STORAGE_##TYPE (BOTTLE_##TYPE *self, size_t capacity, const bottle_options *options, void *storage);  \
+  struct __useless_struct_to_allow_trailing_semicolon__
+
+/* Bottles of T of fixed capacity N, whose messages are stored inline (rather than in an allocated array).
+   Requires DECLARE_BOTTLE (T) first. N must be a positive integer constant, spelled the same way wherever the type is used. */
+#  define DECLARE_BOTTLE_FIXED( TYPE, N )      \
+\
+  typedef struct _BOTTLE_FIXED_##TYPE##_##N    \
+  {                                           \
+    BOTTLE_##TYPE bottle;                     \
+    union                                     \
+    {                                         \
+      TYPE                messages[N];        \
+      struct _cell_##TYPE cells[N];   /* BOTTLE_MPMC engine */ \
+      struct                                  \
+      {                                       \
+        TYPE              messages[N];        \
+        uint64_t          ranks[N];           \
+      } priority;                     /* BOTTLE_PRIORITY engine */ \
+    } storage;                                \
+  } BOTTLE_FIXED_##TYPE##_##N;                \
+\
+  static inline BOTTLE_##TYPE *BOTTLE_FIXED_INIT_##TYPE##_##N (BOTTLE_FIXED_##TYPE##_##N *self, const bottle_options *options) \
+  {                                           \
+    BOTTLE_INIT_STORAGE_##TYPE (&self->bottle, (N), options, &self->storage); \
+    return &self->bottle;                     \
+  }                                           \
+\
+  static inline void BOTTLE_FIXED_CLEANUP_##TYPE##_##N (BOTTLE_FIXED_##TYPE##_##N *self) \
+  {                                           \
+    self->bottle.vtable->Destroy (&self->bottle); \
+  }                                           \
   struct __useless_struct_to_allow_trailing_semicolon__
 
 #  define BOTTLE( TYPE )  BOTTLE_##TYPE
+#  define BOTTLE_VIEW( TYPE )  BOTTLE_VIEW_##TYPE
+#  define BOTTLE_SUBSCRIBER( TYPE )  BOTTLE_SUBSCRIBER_##TYPE
+#  define BOTTLE_FIXED( TYPE, N )  BOTTLE_FIXED_##TYPE##_##N
 
-/// BOTTLE (T) * BOTTLE_CREATE ([T], [size_t capacity = DEFAULT])
+/// BOTTLE (T) * BOTTLE_CREATE ([T], [size_t capacity = DEFAULT], [const bottle_options *options = 0])
 #  define BOTTLE_CREATE1( TYPE ) \
-  BOTTLE_CREATE_##TYPE(DEFAULT)
+  BOTTLE_CREATE_##TYPE(DEFAULT, 0)
 #  define BOTTLE_CREATE2( TYPE, capacity ) \
-  BOTTLE_CREATE_##TYPE(capacity)
+  BOTTLE_CREATE_##TYPE(capacity, 0)
+#  define BOTTLE_CREATE3( TYPE, capacity, options ) \
+  BOTTLE_CREATE_##TYPE(capacity, options)
 #  define BOTTLE_CREATE(...) VFUNC(BOTTLE_CREATE, __VA_ARGS__)
 
+/// BOTTLE (T) * BOTTLE_CREATE_BROADCAST (T, size_t capacity)
+#  define BOTTLE_CREATE_BROADCAST( TYPE, capacity ) \
+  BOTTLE_CREATE_##TYPE(capacity, &(const bottle_options) { .engine = BOTTLE_BROADCAST })
+
+/// BOTTLE (T) * BOTTLE_FIXED_INIT (T, N, BOTTLE_FIXED (T, N) *fixed, [const bottle_options *options = 0])
+#  define BOTTLE_FIXED_INIT3( TYPE, N, fixed ) \
+  BOTTLE_FIXED_INIT_##TYPE##_##N(fixed, 0)
+#  define BOTTLE_FIXED_INIT4( TYPE, N, fixed, options ) \
+  BOTTLE_FIXED_INIT_##TYPE##_##N(fixed, options)
+#  define BOTTLE_FIXED_INIT(...) VFUNC(BOTTLE_FIXED_INIT, __VA_ARGS__)
+
+/// BOTTLE (T) * BOTTLE_CREATE_SPSC (T, size_t capacity)
+#  define BOTTLE_CREATE_SPSC( TYPE, capacity ) \
+  BOTTLE_CREATE_##TYPE(capacity, &(const bottle_options) { .engine = BOTTLE_SPSC })
+
+/// BOTTLE (T) * BOTTLE_CREATE_MPMC (T, size_t capacity)
+#  define BOTTLE_CREATE_MPMC( TYPE, capacity ) \
+  BOTTLE_CREATE_##TYPE(capacity, &(const bottle_options) { .engine = BOTTLE_MPMC })
+
+/// BOTTLE (T) * BOTTLE_CREATE_TWO_LOCK (T, size_t capacity)
+#  define BOTTLE_CREATE_TWO_LOCK( TYPE, capacity ) \
+  BOTTLE_CREATE_##TYPE(capacity, &(const bottle_options) { .engine = BOTTLE_TWO_LOCK })
+
+/// BOTTLE (T) * BOTTLE_CREATE_PRIORITY (T, size_t capacity, int (*compare) (const void *a, const void *b))
+#  define BOTTLE_CREATE_PRIORITY( TYPE, capacity, comparator ) \
+  BOTTLE_CREATE_##TYPE(capacity, &(const bottle_options) { .engine = BOTTLE_PRIORITY, .compare = (comparator) })
+
+/// BOTTLE (T) * BOTTLE_CREATE_TOKEN (T, size_t capacity)
+#  define BOTTLE_CREATE_TOKEN( TYPE, capacity ) \
+  BOTTLE_CREATE_##TYPE(capacity, &(const bottle_options) { .engine = BOTTLE_TOKEN })
+
+/// BOTTLE (T) * BOTTLE_CREATE_SHARED (T, const char *name, size_t capacity)
+#  define BOTTLE_CREATE_SHARED( TYPE, name, capacity ) \
+  BOTTLE_CREATE_SHARED_##TYPE(name, capacity)
+
 /// int BOTTLE_FILL (BOTTLE (T) *bottle, [T message])
 #  define BOTTLE_FILL2(self, message)  \
   ((self)->vtable->Fill ((self), (message)))
@@ -122,6 +452,85 @@
   ((self)->vtable->TryDrain ((self), &((self)->__dummy__)))
 #  define BOTTLE_TRY_DRAIN(...) VFUNC(BOTTLE_TRY_DRAIN, __VA_ARGS__)
 
+/// int BOTTLE_FILL_UNTIL (BOTTLE (T) *bottle, [T message], const struct timespec *deadline)
+#  define BOTTLE_FILL_UNTIL3(self, message, deadline)  \
+  ((self)->vtable->FillUntil ((self), (message), (deadline)))
+#  define BOTTLE_FILL_UNTIL2(self, deadline)  \
+  ((self)->vtable->FillUntil ((self), ((self)->__dummy__), (deadline)))
+#  define BOTTLE_FILL_UNTIL(...) VFUNC(BOTTLE_FILL_UNTIL, __VA_ARGS__)
+
+/// int BOTTLE_DRAIN_UNTIL (BOTTLE (T) *bottle, [T *message], const struct timespec *deadline)
+#  define BOTTLE_DRAIN_UNTIL3(self, message, deadline)  \
+  ((self)->vtable->DrainUntil ((self), (message), (deadline)))
+#  define BOTTLE_DRAIN_UNTIL2(self, deadline)  \
+  ((self)->vtable->DrainUntil ((self), &((self)->__dummy__), (deadline)))
+#  define BOTTLE_DRAIN_UNTIL(...) VFUNC(BOTTLE_DRAIN_UNTIL, __VA_ARGS__)
+
+/// int BOTTLE_FILL_FOR (BOTTLE (T) *bottle, [T message], const struct timespec *timeout)
+#  define BOTTLE_FILL_FOR3(self, message, timeout)  \
+  BOTTLE_FILL_UNTIL3 (self, message, BOTTLE_DEADLINE (&(struct timespec) { 0 }, (timeout)))
+#  define BOTTLE_FILL_FOR2(self, timeout)  \
+  BOTTLE_FILL_UNTIL2 (self, BOTTLE_DEADLINE (&(struct timespec) { 0 }, (timeout)))
+#  define BOTTLE_FILL_FOR(...) VFUNC(BOTTLE_FILL_FOR, __VA_ARGS__)
+
+/// int BOTTLE_DRAIN_FOR (BOTTLE (T) *bottle, [T *message], const struct timespec *timeout)
+#  define BOTTLE_DRAIN_FOR3(self, message, timeout)  \
+  BOTTLE_DRAIN_UNTIL3 (self, message, BOTTLE_DEADLINE (&(struct timespec) { 0 }, (timeout)))
+#  define BOTTLE_DRAIN_FOR2(self, timeout)  \
+  BOTTLE_DRAIN_UNTIL2 (self, BOTTLE_DEADLINE (&(struct timespec) { 0 }, (timeout)))
+#  define BOTTLE_DRAIN_FOR(...) VFUNC(BOTTLE_DRAIN_FOR, __VA_ARGS__)
+
+/// size_t BOTTLE_FILL_N (BOTTLE (T) *bottle, const T *messages, size_t n)
+#  define BOTTLE_FILL_N(self, messages, n)  \
+  ((self)->vtable->FillN ((self), (messages), (n)))
+
+/// size_t BOTTLE_TRY_FILL_N (BOTTLE (T) *bottle, const T *messages, size_t n)
+#  define BOTTLE_TRY_FILL_N(self, messages, n)  \
+  ((self)->vtable->TryFillN ((self), (messages), (n)))
+
+/// size_t BOTTLE_DRAIN_N (BOTTLE (T) *bottle, T *messages, size_t max)
+#  define BOTTLE_DRAIN_N(self, messages, max)  \
+  ((self)->vtable->DrainN ((self), (messages), (max)))
+
+/// size_t BOTTLE_TRY_DRAIN_N (BOTTLE (T) *bottle, T *messages, size_t max)
+#  define BOTTLE_TRY_DRAIN_N(self, messages, max)  \
+  ((self)->vtable->TryDrainN ((self), (messages), (max)))
+
+/// T *BOTTLE_RESERVE (BOTTLE (T) *bottle)
+#  define BOTTLE_RESERVE(self)  \
+  ((self)->vtable->Reserve ((self), 1))
+
+/// T *BOTTLE_TRY_RESERVE (BOTTLE (T) *bottle)
+#  define BOTTLE_TRY_RESERVE(self)  \
+  ((self)->vtable->Reserve ((self), 0))
+
+/// void BOTTLE_COMMIT (BOTTLE (T) *bottle)
+#  define BOTTLE_COMMIT(self)  \
+  do { (self)->vtable->Commit ((self)); } while (0)
+
+/// const T *BOTTLE_ACQUIRE (BOTTLE (T) *bottle)
+#  define BOTTLE_ACQUIRE(self)  \
+  ((self)->vtable->Acquire ((self), 1))
+
+/// const T *BOTTLE_TRY_ACQUIRE (BOTTLE (T) *bottle)
+#  define BOTTLE_TRY_ACQUIRE(self)  \
+  ((self)->vtable->Acquire ((self), 0))
+
+/// size_t BOTTLE_ACQUIRE_N (BOTTLE (T) *bottle, size_t max, BOTTLE_VIEW (T) *view)
+#  define BOTTLE_ACQUIRE_N(self, max, view)  \
+  ((self)->vtable->AcquireN ((self), (max), (view), 1))
+
+/// size_t BOTTLE_TRY_ACQUIRE_N (BOTTLE (T) *bottle, size_t max, BOTTLE_VIEW (T) *view)
+#  define BOTTLE_TRY_ACQUIRE_N(self, max, view)  \
+  ((self)->vtable->AcquireN ((self), (max), (view), 0))
+
+/// void BOTTLE_RELEASE (BOTTLE (T) *bottle, [size_t k = 1])
+#  define BOTTLE_RELEASE2(self, k)  \
+  do { (self)->vtable->Release ((self), (k)); } while (0)
+#  define BOTTLE_RELEASE1(self)  \
+  BOTTLE_RELEASE2(self, 1)
+#  define BOTTLE_RELEASE(...) VFUNC(BOTTLE_RELEASE, __VA_ARGS__)
+
 /// void BOTTLE_PLUG (BOTTLE (T) *bottle)
 #  define BOTTLE_PLUG(self)  \
   do { (self)->vtable->Plug ((self)); } while (0)
@@ -138,26 +547,148 @@
 #  define BOTTLE_DESTROY(self)  \
   do { (self)->vtable->Destroy ((self)); } while (0)
 
-/// BOTTLE (T) * BOTTLE_DECL (variable_name, [T], [size_t capacity = DEFAULT])
+/// bottle_case BOTTLE_CASE_SEND (BOTTLE (T) *bottle, const T *message)
+#  define BOTTLE_CASE_SEND(self, msg)  \
+  ((bottle_case) { .bottle = (self), .message = (void *) (1 ? (msg) : &(self)->__dummy__), .send = 1, \
+                   .operation = (self)->vtable->SelectFill, .watch = (self)->vtable->Watch })
+
+/// bottle_case BOTTLE_CASE_RECV (BOTTLE (T) *bottle, [T *message])
+#  define BOTTLE_CASE_RECV2(self, msg)  \
+  ((bottle_case) { .bottle = (self), .message = (1 ? (msg) : &(self)->__dummy__), .send = 0, \
+                   .operation = (self)->vtable->SelectDrain, .watch = (self)->vtable->Watch })
+#  define BOTTLE_CASE_RECV1(self)  \
+  BOTTLE_CASE_RECV2(self, &(self)->__dummy__)
+#  define BOTTLE_CASE_RECV(...) VFUNC(BOTTLE_CASE_RECV, __VA_ARGS__)
+
+/// int BOTTLE_SELECT (bottle_case case, ...)
+#  define BOTTLE_SELECT(...)  \
+  BOTTLE_SELECT_CASES ((bottle_case []) { __VA_ARGS__ }, sizeof ((bottle_case []) { __VA_ARGS__ }) / sizeof (bottle_case), 1)
+
+/// int BOTTLE_TRY_SELECT (bottle_case case, ...)
+#  define BOTTLE_TRY_SELECT(...)  \
+  BOTTLE_SELECT_CASES ((bottle_case []) { __VA_ARGS__ }, sizeof ((bottle_case []) { __VA_ARGS__ }) / sizeof (bottle_case), 0)
+
+/// int BOTTLE_SELECT_N (bottle_case *cases, size_t n)
+#  define BOTTLE_SELECT_N(cases, n)  \
+  BOTTLE_SELECT_CASES ((cases), (n), 1)
+
+/// int BOTTLE_TRY_SELECT_N (bottle_case *cases, size_t n)
+#  define BOTTLE_TRY_SELECT_N(cases, n)  \
+  BOTTLE_SELECT_CASES ((cases), (n), 0)
+
+/// int BOTTLE_SUBSCRIBE (BOTTLE (T) *bottle, BOTTLE_SUBSCRIBER (T) *subscriber)
+#  define BOTTLE_SUBSCRIBE(self, subscriber)  \
+  ((self)->vtable->Subscribe ((self), (subscriber)))
+
+/// void BOTTLE_UNSUBSCRIBE (BOTTLE_SUBSCRIBER (T) *subscriber)
+#  define BOTTLE_UNSUBSCRIBE(subscriber)  \
+  ((subscriber)->bottle->vtable->Unsubscribe ((subscriber)))
+
+/// int BOTTLE_READ (BOTTLE_SUBSCRIBER (T) *subscriber, T *message)
+#  define BOTTLE_READ(subscriber, message)  \
+  ((subscriber)->bottle->vtable->Read ((subscriber), (message), 1, 0))
+
+/// int BOTTLE_TRY_READ (BOTTLE_SUBSCRIBER (T) *subscriber, T *message)
+#  define BOTTLE_TRY_READ(subscriber, message)  \
+  ((subscriber)->bottle->vtable->Read ((subscriber), (message), 0, 0))
+
+/// int BOTTLE_READ_UNTIL (BOTTLE_SUBSCRIBER (T) *subscriber, T *message, const struct timespec *deadline)
+#  define BOTTLE_READ_UNTIL(subscriber, message, deadline)  \
+  ((subscriber)->bottle->vtable->Read ((subscriber), (message), 1, (deadline)))
+
+/// int BOTTLE_READ_FOR (BOTTLE_SUBSCRIBER (T) *subscriber, T *message, const struct timespec *timeout)
+#  define BOTTLE_READ_FOR(subscriber, message, timeout)  \
+  BOTTLE_READ_UNTIL (subscriber, message, BOTTLE_DEADLINE (&(struct timespec) { 0 }, (timeout)))
+
+/// int BOTTLE_STATS (BOTTLE (T) *bottle, bottle_statistics *stats)
+#  define BOTTLE_STATS(self, stats)  \
+  ((self)->vtable->Stats ((self), (stats)))
+
+/// int BOTTLE_RECV_FD (BOTTLE (T) *bottle)
+#  define BOTTLE_RECV_FD(self)  \
+  ((self)->vtable->Fd ((self), 0))
+
+/// int BOTTLE_SEND_FD (BOTTLE (T) *bottle)
+#  define BOTTLE_SEND_FD(self)  \
+  ((self)->vtable->Fd ((self), 1))
+
+/// BOTTLE (T) * BOTTLE_DECL (variable_name, [T], [size_t capacity = DEFAULT], [const bottle_options *options = 0])
 #  if defined(__GNUC__) || defined (__clang__)
-#    define BOTTLE_DECL3(var, TYPE, capacity)  \
-__attribute__ ((cleanup (BOTTLE_CLEANUP_##TYPE))) BOTTLE_##TYPE var; BOTTLE_INIT_##TYPE (&var, capacity)
+#    define BOTTLE_DECL4(var, TYPE, capacity, options)  \
+__attribute__ ((cleanup (BOTTLE_CLEANUP_##TYPE))) BOTTLE_##TYPE var; BOTTLE_INIT_##TYPE (&var, capacity, options)
+#    define BOTTLE_DECL3(var, TYPE, capacity) BOTTLE_DECL4(var, TYPE, capacity, 0)
 #    define BOTTLE_DECL2(var, TYPE) BOTTLE_DECL3(var, TYPE, DEFAULT)
 #    define BOTTLE_DECL(...) VFUNC(BOTTLE_DECL, __VA_ARGS__)
+
+/// BOTTLE_FIXED (T, N) BOTTLE_DECL_FIXED (variable_name, T, N, [const bottle_options *options = 0])
+#    define BOTTLE_DECL_FIXED4(var, TYPE, N, options)  \
+__attribute__ ((cleanup (BOTTLE_FIXED_CLEANUP_##TYPE##_##N))) BOTTLE_FIXED_##TYPE##_##N var; BOTTLE_FIXED_INIT_##TYPE##_##N (&var, options)
+#    define BOTTLE_DECL_FIXED3(var, TYPE, N) BOTTLE_DECL_FIXED4(var, TYPE, N, 0)
+#    define BOTTLE_DECL_FIXED(...) VFUNC(BOTTLE_DECL_FIXED, __VA_ARGS__)
 #  endif
 
 /// A more C like syntax
 #  define bottle_type_declare(...)  DECLARE_BOTTLE(__VA_ARGS__)
 #  define bottle_type_define(...)   DEFINE_BOTTLE(__VA_ARGS__)
+#  define bottle_fixed_type_declare(type, n)  DECLARE_BOTTLE_FIXED(type, n)
 
 #  define bottle_t(type)            BOTTLE(type)
+#  define bottle_view_t(type)       BOTTLE_VIEW(type)
+#  define bottle_subscriber_t(type) BOTTLE_SUBSCRIBER(type)
 #  define bottle_create(...)        BOTTLE_CREATE(__VA_ARGS__)
+#  define bottle_create_spsc(...)   BOTTLE_CREATE_SPSC(__VA_ARGS__)
+#  define bottle_create_mpmc(...)   BOTTLE_CREATE_MPMC(__VA_ARGS__)
+#  define bottle_create_two_lock(...)   BOTTLE_CREATE_TWO_LOCK(__VA_ARGS__)
+#  define bottle_create_broadcast(...)  BOTTLE_CREATE_BROADCAST(__VA_ARGS__)
+#  define bottle_create_priority(...)   BOTTLE_CREATE_PRIORITY(__VA_ARGS__)
+#  define bottle_create_token(...)      BOTTLE_CREATE_TOKEN(__VA_ARGS__)
+#  define bottle_create_shared(...)     BOTTLE_CREATE_SHARED(__VA_ARGS__)
 #  define bottle_auto(...)          BOTTLE_DECL(__VA_ARGS__)
+#  define bottle_fixed_t(type, n)   BOTTLE_FIXED(type, n)
+#  define bottle_fixed_init(...)    BOTTLE_FIXED_INIT(__VA_ARGS__)
+#  define bottle_fixed(...)         BOTTLE_DECL_FIXED(__VA_ARGS__)
+#  define bottle_huge_pages(numa_node)  BOTTLE_HUGE_PAGES(numa_node)
 
 #  define bottle_send(...)          BOTTLE_FILL(__VA_ARGS__)
 #  define bottle_try_send(...)      BOTTLE_TRY_FILL(__VA_ARGS__)
 #  define bottle_recv(...)          BOTTLE_DRAIN(__VA_ARGS__)
 #  define bottle_try_recv(...)      BOTTLE_TRY_DRAIN(__VA_ARGS__)
+#  define bottle_send_until(...)    BOTTLE_FILL_UNTIL(__VA_ARGS__)
+#  define bottle_recv_until(...)    BOTTLE_DRAIN_UNTIL(__VA_ARGS__)
+#  define bottle_send_for(...)      BOTTLE_FILL_FOR(__VA_ARGS__)
+#  define bottle_recv_for(...)      BOTTLE_DRAIN_FOR(__VA_ARGS__)
+
+#  define bottle_send_n(self, messages, n)       BOTTLE_FILL_N(self, messages, n)
+#  define bottle_try_send_n(self, messages, n)   BOTTLE_TRY_FILL_N(self, messages, n)
+#  define bottle_recv_n(self, messages, max)     BOTTLE_DRAIN_N(self, messages, max)
+#  define bottle_try_recv_n(self, messages, max) BOTTLE_TRY_DRAIN_N(self, messages, max)
+
+#  define bottle_reserve(self)      BOTTLE_RESERVE(self)
+#  define bottle_try_reserve(self)  BOTTLE_TRY_RESERVE(self)
+#  define bottle_commit(self)       BOTTLE_COMMIT(self)
+#  define bottle_acquire(self)      BOTTLE_ACQUIRE(self)
+#  define bottle_try_acquire(self)  BOTTLE_TRY_ACQUIRE(self)
+#  define bottle_acquire_n(self, max, view)     BOTTLE_ACQUIRE_N(self, max, view)
+#  define bottle_try_acquire_n(self, max, view) BOTTLE_TRY_ACQUIRE_N(self, max, view)
+#  define bottle_release(...)       BOTTLE_RELEASE(__VA_ARGS__)
+
+#  define bottle_subscribe(self, subscriber)  BOTTLE_SUBSCRIBE(self, subscriber)
+#  define bottle_unsubscribe(subscriber)      BOTTLE_UNSUBSCRIBE(subscriber)
+#  define bottle_read(subscriber, message)    BOTTLE_READ(subscriber, message)
+#  define bottle_try_read(subscriber, message)    BOTTLE_TRY_READ(subscriber, message)
+#  define bottle_read_until(subscriber, message, deadline)  BOTTLE_READ_UNTIL(subscriber, message, deadline)
+#  define bottle_read_for(subscriber, message, timeout)     BOTTLE_READ_FOR(subscriber, message, timeout)
+
+#  define bottle_stats(self, stats) BOTTLE_STATS(self, stats)
+#  define bottle_recv_fd(self)      BOTTLE_RECV_FD(self)
+#  define bottle_send_fd(self)      BOTTLE_SEND_FD(self)
+
+#  define bottle_case_send(self, message)   BOTTLE_CASE_SEND(self, message)
+#  define bottle_case_recv(...)     BOTTLE_CASE_RECV(__VA_ARGS__)
+#  define bottle_select(...)        BOTTLE_SELECT(__VA_ARGS__)
+#  define bottle_try_select(...)    BOTTLE_TRY_SELECT(__VA_ARGS__)
+#  define bottle_select_n(cases, n)     BOTTLE_SELECT_N(cases, n)
+#  define bottle_try_select_n(cases, n) BOTTLE_TRY_SELECT_N(cases, n)
 
 #  define bottle_close(self)        BOTTLE_CLOSE(self)
 #  define bottle_destroy(self)      BOTTLE_DESTROY(self)
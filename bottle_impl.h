@@ -26,7 +26,33 @@
 #  include "bottle.h"
 #  include <stdlib.h>
 #  include <stddef.h>
+#  include <string.h>
 #  include <errno.h>
+#  ifdef BOTTLE_MMAP
+#    include <fcntl.h>
+#    include <limits.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    include <unistd.h>
+#    if !defined(MAP_ANONYMOUS) || !defined(MADV_HUGEPAGE) || !defined(SYS_mbind)
+#      error "BOTTLE_MMAP requires Linux (and _DEFAULT_SOURCE or _GNU_SOURCE)."
+#    endif
+#  endif
+#  ifdef BOTTLE_POLL
+#    include <stdint.h>
+#    include <sys/eventfd.h>
+#    include <unistd.h>
+#  endif
+#  ifdef BOTTLE_SHM
+#    include <fcntl.h>
+#    include <pthread.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#    if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#      error "BOTTLE_SHM requires POSIX.1-2008 (_POSIX_C_SOURCE 200809L, _DEFAULT_SOURCE or _GNU_SOURCE)."
+#    endif
+#  endif
 
 #  ifdef LIMITED_BUFFER
 #    undef LIMITED_BUFFER
@@ -56,22 +82,746 @@
     }\
   } while(0)
 
-#  define QUEUE_IS_EXHAUSTED(queue) ((queue).reader_head == (queue).writer_head)
-#  define QUEUE_IS_FULL(queue) (!((queue).unlimited && (queue).capacity < (size_t) -1) && QUEUE_IS_EXHAUSTED(queue))    // An unbounded queue can't be full (almost)
-#  define QUEUE_IS_EMPTY(queue) ((queue).reader_head == 0)
+#  define QUEUE_SIZE(queue) ((size_t) ((queue).write - (queue).read))
+#  define QUEUE_IS_EXHAUSTED(queue) (QUEUE_SIZE(queue) == (queue).capacity)
+#  define QUEUE_IS_FULL(queue) (QUEUE_SIZE(queue) >= (queue).limit)     // An unbounded queue is full only once it can't grow any more
+#  define QUEUE_IS_EMPTY(queue) ((queue).write == (queue).read)
 #  define QUEUE_CAPACITY(queue) ((queue).capacity)
-#  define QUEUE_SIZE(queue) ((queue).size)
-#  define QUEUE_UNLIMITED_CAPACITY_GROWTH_RULE(capacity) ((capacity) * 2)
+#  define QUEUE_MAX_CAPACITY(queue) ((size_t) -1 / sizeof (*(queue).buffer))   // Largest array that can be allocated
+#  define QUEUE_MASK(capacity) (((capacity) & ((capacity) - 1)) ? 0 : (capacity) - 1)     // Mask of a power of two capacity, 0 otherwise
+#  define RING_INDEX(position, capacity, mask) ((mask) ? (position) & (mask) : (position) % (capacity))
+#  define QUEUE_INDEX(queue, position) ((size_t) RING_INDEX((position), (queue).capacity, (queue).mask))
+#  define QUEUE_WRAP(queue, index) ((index) >= (queue).capacity ? (index) - (queue).capacity : (index))  // Wraps an index below twice the capacity, without dividing
+#  define QUEUE_UNLIMITED_GROWTH 2      // Default growth factor of unlimited queues
+#  define QUEUE_UNLIMITED_SHRINK 2      // Default low-water mark of unlimited queues (a half)
+#  define QUEUE_SEGMENT_SPARES 2        // Number of free blocks a segmented queue keeps for reuse
+#  define QUEUE_SPILL_BLOCK ((size_t) 1 << 20)  // Default size in bytes of the blocks of a queue spilling to disk
+
+#  if defined(__x86_64__) || defined(__i386__)
+#    define BOTTLE_PAUSE() __builtin_ia32_pause ()
+#  elif defined(__aarch64__) || defined(__arm__)
+#    define BOTTLE_PAUSE() __asm__ __volatile__ ("yield")
+#  else
+#    define BOTTLE_PAUSE() do { } while (0)
+#  endif
+
+#  ifdef BOTTLE_STATISTICS
+static inline uint64_t
+BOTTLE_STATS_NOW (void)
+{
+  struct timespec now;
+  BOTTLE_ASSERT (timespec_get (&now, TIME_UTC) == TIME_UTC);
+  return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/* Counts k messages sent (or received), after which the bottle holds size messages. */
+static inline void
+BOTTLE_STATS_COUNT (bottle_counters *counters, int send, size_t k, size_t size)
+{
+  if (!k)
+    return;
+  atomic_fetch_add_explicit (send ? &counters->sent : &counters->received, k, memory_order_relaxed);
+  atomic_fetch_add_explicit (&counters->samples, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&counters->occupancy, size, memory_order_relaxed);
+  uint_least64_t max = atomic_load_explicit (&counters->max_size, memory_order_relaxed);
+  while (size > max && !atomic_compare_exchange_weak_explicit (&counters->max_size, &max, size, memory_order_relaxed, memory_order_relaxed))
+    /* */ ;
+}
+
+/* Counts a sender (side 1) or a receiver (side 0) which blocked since start (side -1: neither). */
+static inline void
+BOTTLE_STATS_BLOCKED (bottle_counters *counters, int side, uint64_t start)
+{
+  if (side < 0 || !start)
+    return;
+  uint64_t elapsed = BOTTLE_STATS_NOW () - start;
+  atomic_fetch_add_explicit (side ? &counters->blocked_sends : &counters->blocked_receives, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (side ? &counters->send_wait : &counters->receive_wait, elapsed, memory_order_relaxed);
+}
+
+static inline void
+BOTTLE_STATS_LOAD (bottle_counters *counters, bottle_statistics *stats)
+{
+  stats->sent = atomic_load_explicit (&counters->sent, memory_order_relaxed);
+  stats->received = atomic_load_explicit (&counters->received, memory_order_relaxed);
+  stats->blocked_sends = atomic_load_explicit (&counters->blocked_sends, memory_order_relaxed);
+  stats->blocked_receives = atomic_load_explicit (&counters->blocked_receives, memory_order_relaxed);
+  stats->send_wait = atomic_load_explicit (&counters->send_wait, memory_order_relaxed);
+  stats->receive_wait = atomic_load_explicit (&counters->receive_wait, memory_order_relaxed);
+  stats->max_size = (size_t) atomic_load_explicit (&counters->max_size, memory_order_relaxed);
+  uint64_t samples = atomic_load_explicit (&counters->samples, memory_order_relaxed);
+  stats->mean_size = samples ? (double) atomic_load_explicit (&counters->occupancy, memory_order_relaxed) / (double) samples : 0.;
+  stats->contentions = atomic_load_explicit (&counters->contentions, memory_order_relaxed);
+}
+
+// Locks mutex, counting the contention if it is already locked.
+#    define BOTTLE_LOCK(self, mutex) \
+  do {\
+    int _ret;\
+    BOTTLE_ASSERT ((_ret = mtx_trylock (mutex)) != thrd_error);\
+    if (_ret == thrd_busy)\
+    {\
+      BOTTLE_ASSERT (mtx_lock (mutex) == thrd_success);\
+      atomic_fetch_add_explicit (&(self)->counters.contentions, 1, memory_order_relaxed);\
+    }\
+  } while(0)
+// Counts k messages sent (send is 1) or received (send is 0), the bottle then holding size messages.
+#    define BOTTLE_COUNT(self, send, k, size) BOTTLE_STATS_COUNT (&(self)->counters, (send), (k), (size))
+// Records in start when a thread is about to block (if condition holds), and accounts for it once it has stopped blocking.
+#    define BOTTLE_STATS_START(start, condition) uint64_t start = ((condition) ? BOTTLE_STATS_NOW () : 0)
+#    define BOTTLE_STATS_STOP(self, start, side) BOTTLE_STATS_BLOCKED (&(self)->counters, (side), (start))
+#    define BOTTLE_STATS_SNAPSHOT(self, stats) (BOTTLE_STATS_LOAD (&(self)->counters, (stats)), 1)
+#    define BOTTLE_STATS_INIT(self) memset (&(self)->counters, 0, sizeof ((self)->counters))
+#  else
+#    define BOTTLE_LOCK(self, mutex) BOTTLE_ASSERT (mtx_lock (mutex) == thrd_success)
+#    define BOTTLE_COUNT(self, send, k, size) do { } while (0)
+#    define BOTTLE_STATS_START(start, condition) do { } while (0)
+#    define BOTTLE_STATS_STOP(self, start, side) do { } while (0)
+#    define BOTTLE_STATS_SNAPSHOT(self, stats) (errno = EPERM, 0)
+#    define BOTTLE_STATS_INIT(self) do { } while (0)
+#  endif
+
+// Parks on cond, the mutex being locked, as long as condition holds and the deadline (if not null) is not reached.
+// Parking on not_full (or not_empty) is accounted for as a blocked sender (or receiver) in the statistics of the bottle.
+// With a wake batch, receivers parked on not_empty are not woken up for every message: the first message of a batch wakes one of them up
+// (see BOTTLE_BATCH_READY), which then keeps waiting, even though the bottle is not empty, until the batch is complete or its delay has elapsed.
+// Idle receivers never wake up: the delay only runs while a batch is pending.
+#  define BOTTLE_PARK(self, mutex, cond, condition, deadline) \
+  do {\
+    int _ret = thrd_success;\
+    int _batch = ((cond) == &(self)->not_empty && (self)->batch.size > 1);\
+    BOTTLE_STATS_START (_parked, condition);\
+    while (_ret == thrd_success)\
+    {\
+      int _pending = _batch && BOTTLE_BATCH_PENDING (self);\
+      if (!_pending && !(condition))\
+        break;\
+      const struct timespec *_until = _pending ? BOTTLE_EARLIEST (&(self)->batch.end, (deadline)) : (deadline);\
+      BOTTLE_ASSERT ((_ret = _until ? cnd_timedwait ((cond), (mutex), _until) \
+                                    : cnd_wait ((cond), (mutex))) != thrd_error);\
+      if (_ret == thrd_timedout && _until == &(self)->batch.end) /* only the delay of the batch has elapsed */ \
+        _ret = thrd_success;\
+    }\
+    BOTTLE_STATS_STOP ((self), _parked, (cond) == &(self)->not_full ? 1 : (cond) == &(self)->not_empty ? 0 : -1);\
+  } while(0)
+
+// Tells if a wake batch is pending, the mutex being locked: it is over once the bottle is closed or its delay has elapsed.
+#  define BOTTLE_BATCH_PENDING(self) \
+  ((self)->batch.pending && ((self)->batch.pending = !(self)->closed && !BOTTLE_DEADLINE_REACHED (&(self)->batch.end)))
+
+// Waits, the mutex being locked, as long as condition holds and the deadline (if not null) is not reached.
+// The thread first spins for up to self->spin iterations without the mutex, as long as the state of the bottle does not change
+// (condition only reads it under the mutex, hence the atomic count of changes), then locks the mutex again once, and only then parks on cond.
+// Parked senders (on not_full) and receivers (on not_empty) are counted, so that they are only signaled if there are any.
+#  define BOTTLE_WAIT(self, cond, condition, deadline) \
+  do {\
+    if ((self)->spin && (condition))\
+    {\
+      size_t _changes = atomic_load_explicit (&(self)->changes, memory_order_relaxed);\
+      BOTTLE_ASSERT (mtx_unlock (&(self)->mutex) == thrd_success);\
+      for (size_t _spin = 0 ; _spin < (self)->spin && atomic_load_explicit (&(self)->changes, memory_order_relaxed) == _changes ; _spin++) \
+        BOTTLE_PAUSE ();\
+      BOTTLE_ASSERT (mtx_lock (&(self)->mutex) == thrd_success);\
+    }\
+    if (condition)\
+    {\
+      atomic_int *_waiting = BOTTLE_WAITING ((self), (cond));\
+      if (_waiting)\
+        atomic_fetch_add_explicit (_waiting, 1, memory_order_relaxed);\
+      BOTTLE_PARK ((self), &(self)->mutex, (cond), (condition), (deadline));\
+      if (_waiting)\
+        atomic_fetch_sub_explicit (_waiting, 1, memory_order_relaxed);\
+    }\
+  } while(0)
+
+// Counter of the threads parked on cond, if it is not_empty or not_full.
+#  define BOTTLE_WAITING(self, cond) \
+  ((cond) == &(self)->not_empty ? &(self)->receivers_waiting : (cond) == &(self)->not_full ? &(self)->senders_waiting : 0)
+#  if BOTTLE_CACHE_LINE
+#    define BOTTLE_CACHE_PAD(size) (((size) + BOTTLE_CACHE_LINE - 1) / BOTTLE_CACHE_LINE * BOTTLE_CACHE_LINE)
+#  else
+#    define BOTTLE_CACHE_PAD(size) (size)
+#  endif
+
+#  define MPMC_CLOSED (~((size_t) -1 >> 1))    // Highest bit of the enqueue ticket, set once the bottle is closed
+
+/* Converts a relative timeout into an absolute deadline (based on TIME_UTC, as for cnd_timedwait). */
+static inline const struct timespec *
+BOTTLE_DEADLINE (struct timespec *deadline, const struct timespec *timeout)
+{
+  BOTTLE_ASSERT (timespec_get (deadline, TIME_UTC) == TIME_UTC);
+  deadline->tv_sec += timeout->tv_sec;
+  deadline->tv_nsec += timeout->tv_nsec;
+  if (deadline->tv_nsec >= 1000000000L)
+  {
+    deadline->tv_sec += deadline->tv_nsec / 1000000000L;
+    deadline->tv_nsec %= 1000000000L;
+  }
+  return deadline;
+}
+
+/* Allocates size bytes aligned on alignment (a power of two), with the allocate hook of the allocator if any, or from the heap. */
+static inline void *
+BOTTLE_ALLOC (const bottle_allocator *allocator, size_t size, size_t alignment)
+{
+  if (allocator && allocator->allocate)
+    return allocator->allocate (allocator->context, size, alignment);
+  if (alignment <= _Alignof (max_align_t))
+    return malloc (size);
+  return aligned_alloc (alignment, (size + alignment - 1) / alignment * alignment);     // The size must be a multiple of the alignment
+}
+
+/* Frees memory of size bytes allocated by BOTTLE_ALLOC with the same allocator. */
+static inline void
+BOTTLE_FREE (const bottle_allocator *allocator, void *memory, size_t size)
+{
+  if (!memory)
+    return;
+  if (allocator && allocator->allocate)
+    allocator->release (allocator->context, memory, size);
+  else
+    free (memory);
+}
+
+/* Resizes memory allocated by BOTTLE_ALLOC with the same allocator, preserving its content. Returns 0 on failure. */
+static inline void *
+BOTTLE_REALLOC (const bottle_allocator *allocator, void *memory, size_t old_size, size_t size, size_t alignment)
+{
+  if (!(allocator && allocator->allocate) && alignment <= _Alignof (max_align_t))
+    return realloc (memory, size);
+  void *new_memory = BOTTLE_ALLOC (allocator, size, alignment);
+  if (!new_memory)
+    return 0;
+  memcpy (new_memory, memory, old_size < size ? old_size : size);
+  BOTTLE_FREE (allocator, memory, old_size);
+  return new_memory;
+}
+
+#  ifdef BOTTLE_MMAP
+#    define BOTTLE_HUGE_PAGE_SIZE ((size_t) 2 << 20)      // Smaller blocks are allocated from the heap
+#    define BOTTLE_NUMA_NODES 1024      // Number of NUMA nodes a ring can be bound to
+#    define BOTTLE_MPOL_BIND 2          // MPOL_BIND of <linux/mempolicy.h>
+
+/* Allocates large blocks as anonymous mappings backed by transparent huge pages,
+   bound to the NUMA node context - 1 if context is not null (see BOTTLE_HUGE_PAGES). */
+static inline void *
+BOTTLE_HUGE_PAGES_ALLOC (void *context, size_t size, size_t alignment)
+{
+  if (size < BOTTLE_HUGE_PAGE_SIZE)
+    return BOTTLE_ALLOC (0, size, alignment);
+  void *memory = mmap (0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);   // Page aligned
+  if (memory == MAP_FAILED)
+    return 0;
+  (void) madvise (memory, size, MADV_HUGEPAGE); // Advice only: ignored if transparent huge pages are disabled
+  intptr_t node = (intptr_t) context - 1;
+  if (node >= 0)
+  {
+    unsigned long nodes[BOTTLE_NUMA_NODES / (CHAR_BIT * sizeof (unsigned long))] = { 0 };
+    if (node < BOTTLE_NUMA_NODES)
+      nodes[(size_t) node / (CHAR_BIT * sizeof (*nodes))] |= 1UL << ((size_t) node % (CHAR_BIT * sizeof (*nodes)));
+    BOTTLE_ASSERT3 (node < BOTTLE_NUMA_NODES &&
+                    syscall (SYS_mbind, memory, size, BOTTLE_MPOL_BIND, nodes, (unsigned long) BOTTLE_NUMA_NODES + 1, 0UL) == 0,
+                    "The buffer could not be bound to the requested NUMA node.\n", 0);
+  }
+  return memory;
+}
+
+static inline void
+BOTTLE_HUGE_PAGES_FREE (void *context, void *memory, size_t size)
+{
+  (void) context;
+  if (size < BOTTLE_HUGE_PAGE_SIZE)
+    free (memory);
+  else
+    munmap (memory, size);
+}
+
+/* Allocator of rings in transparent huge pages, bound to a NUMA node (or not bound if numa_node is -1). */
+#    define BOTTLE_HUGE_PAGES(numa_node) \
+  ((bottle_allocator) { BOTTLE_HUGE_PAGES_ALLOC, BOTTLE_HUGE_PAGES_FREE, (void *) (intptr_t) ((numa_node) + 1) })
+
+#    define BOTTLE_CAN_SPILL 1
+
+/* Maps a new segment file of size bytes in the directory, for a block spilled to disk (each block has a file of its own).
+   Returns 0 if it can't be created, or if its space can't be reserved on disk: the block is then kept in memory,
+   rather than raising SIGBUS once a sparse page is first written on a full disk.
+   The file is unlinked at once: the space it takes on disk is freed as soon as it is unmapped (or if the process dies). */
+static inline void *
+BOTTLE_SPILL_MAP (const char *directory, size_t size)
+{
+  static const char pattern[] = "/bottle-XXXXXX";
+  char *path = malloc (strlen (directory) + sizeof (pattern));
+  if (!path)
+    return 0;
+  strcat (strcpy (path, directory), pattern);
+  int fd = mkstemp (path);
+  if (fd >= 0)
+    unlink (path);
+  free (path);
+  if (fd < 0)
+    return 0;
+  void *memory = (posix_fallocate (fd, 0, (off_t) size) == 0 ? mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED);
+  close (fd);
+  if (memory == MAP_FAILED)
+    return 0;
+  (void) madvise (memory, size, MADV_SEQUENTIAL);       // Written, then read back, in order
+  return memory;
+}
+
+/* Drops the pages of a spilled block from the memory of the process, once written (they are read back from the file when needed). */
+static inline void
+BOTTLE_SPILL_EVICT (void *memory, size_t size)
+{
+  (void) madvise (memory, size, MADV_DONTNEED);
+}
+
+/* Unmaps a spilled block once read (its file is deleted). */
+static inline void
+BOTTLE_SPILL_UNMAP (void *memory, size_t size)
+{
+  munmap (memory, size);
+}
+#  else
+// Queues don't spill to disk without BOTTLE_MMAP.
+#    define BOTTLE_CAN_SPILL 0
+#    define BOTTLE_SPILL_MAP(directory, size) ((void) (directory), (void) (size), (void *) 0)
+#    define BOTTLE_SPILL_EVICT(memory, size) do { } while (0)
+#    define BOTTLE_SPILL_UNMAP(memory, size) do { } while (0)
+#  endif
+
+/* Rounds a capacity up to a power of two. */
+static inline size_t
+BOTTLE_POWER_OF_TWO (size_t capacity)
+{
+  size_t p = 1;
+  while (p < capacity)
+  {
+    BOTTLE_ASSERT3 (p <= (size_t) -1 / 2, "Capacity too large.\n", 1);
+    p <<= 1;
+  }
+  return p;
+}
+
+#  ifdef BOTTLE_POLL
+#    define BOTTLE_CAN_POLL 1
+
+/* Opens the descriptors of readiness of a pollable bottle (two event file descriptors, not readable yet). */
+static inline void
+BOTTLE_POLL_OPEN (int fd[2])
+{
+  BOTTLE_ASSERT ((fd[0] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
+  BOTTLE_ASSERT ((fd[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
+}
+
+/* Makes a descriptor of readiness readable (ready) or not. */
+static inline void
+BOTTLE_POLL_SET (int fd, int ready)
+{
+  uint64_t value = 1;
+  if (ready)
+    BOTTLE_ASSERT (write (fd, &value, sizeof (value)) == sizeof (value));
+  else
+    BOTTLE_ASSERT (read (fd, &value, sizeof (value)) == sizeof (value));
+}
+
+static inline void
+BOTTLE_POLL_CLOSE (int fd[2])
+{
+  if (fd[0] >= 0)
+    close (fd[0]);
+  if (fd[1] >= 0)
+    close (fd[1]);
+}
+#  else
+// Bottles are not pollable without BOTTLE_POLL: their descriptors stay at -1.
+#    define BOTTLE_CAN_POLL 0
+#    define BOTTLE_POLL_OPEN(fd) do { } while (0)
+#    define BOTTLE_POLL_SET(fd, ready) do { } while (0)
+#    define BOTTLE_POLL_CLOSE(fd) do { } while (0)
+#  endif
+
+#  ifdef BOTTLE_SHM
+#    define BOTTLE_SHM_TRIES 1000       // Number of milliseconds an opener waits for the creator to initialise a shared bottle
+#    define SHM_SIZE(shared) ((size_t) ((shared)->write - (shared)->read))
+#    define SHM_IS_FULL(shared) (SHM_SIZE(shared) == (shared)->capacity)
+#    define SHM_IS_EMPTY(shared) ((shared)->write == (shared)->read)
+#    define SHM_INDEX(shared, position) ((size_t) RING_INDEX((position), (shared)->capacity, (shared)->mask))
+
+/* Maps the shared memory object name of size bytes, creating it (owner is then set) if it does not exist yet.
+   The object starts with an atomic_int, set by its creator once initialised, which openers wait for.
+   Returns 0 (with errno set) if the object can't be mapped, or if it has another size (EINVAL) or is never initialised (ETIMEDOUT). */
+static inline void *
+BOTTLE_SHM_MAP (const char *name, size_t size, int *owner)
+{
+  int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  *owner = (fd >= 0);
+  if (fd < 0 && errno == EEXIST)
+    fd = shm_open (name, O_RDWR, 0);
+  if (fd < 0)
+    return 0;
+  struct stat st = { 0 };
+  int ret = *owner ? ftruncate (fd, (off_t) size) : 0;
+  for (int tries = 0; !*owner && (ret = fstat (fd, &st)) == 0 && (size_t) st.st_size != size; tries++)
+  {
+    if (st.st_size || tries == BOTTLE_SHM_TRIES)        // sized for another bottle, or never sized
+    {
+      errno = st.st_size ? EINVAL : ETIMEDOUT;
+      ret = -1;
+      break;
+    }
+    thrd_sleep (&(struct timespec) { .tv_nsec = 1000000 }, 0);
+  }
+  void *block = (ret == 0 ? mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED);
+  int saved_errno = errno;
+  close (fd);
+  for (int tries = 0; block != MAP_FAILED && !*owner && !atomic_load ((atomic_int *) block); tries++)
+  {
+    if (tries == BOTTLE_SHM_TRIES)
+    {
+      munmap (block, size);
+      block = MAP_FAILED;
+      saved_errno = ETIMEDOUT;
+    }
+    else
+      thrd_sleep (&(struct timespec) { .tv_nsec = 1000000 }, 0);
+  }
+  if (block != MAP_FAILED)
+    return block;
+  if (*owner)
+    shm_unlink (name);
+  errno = saved_errno;
+  return 0;
+}
+
+/* Initialises the process-shared (and robust) mutex and conditions of a shared bottle. */
+static inline void
+BOTTLE_SHM_SYNC_INIT (pthread_mutex_t *mutex, pthread_cond_t *not_empty, pthread_cond_t *not_full)
+{
+  pthread_mutexattr_t mutex_attr;
+  BOTTLE_ASSERT (pthread_mutexattr_init (&mutex_attr) == 0);
+  BOTTLE_ASSERT (pthread_mutexattr_setpshared (&mutex_attr, PTHREAD_PROCESS_SHARED) == 0);
+  BOTTLE_ASSERT (pthread_mutexattr_setrobust (&mutex_attr, PTHREAD_MUTEX_ROBUST) == 0);
+  BOTTLE_ASSERT (pthread_mutex_init (mutex, &mutex_attr) == 0);
+  pthread_mutexattr_destroy (&mutex_attr);
+  pthread_condattr_t cond_attr; // The default clock (CLOCK_REALTIME) is the one of TIME_UTC deadlines
+  BOTTLE_ASSERT (pthread_condattr_init (&cond_attr) == 0);
+  BOTTLE_ASSERT (pthread_condattr_setpshared (&cond_attr, PTHREAD_PROCESS_SHARED) == 0);
+  BOTTLE_ASSERT (pthread_cond_init (not_empty, &cond_attr) == 0);
+  BOTTLE_ASSERT (pthread_cond_init (not_full, &cond_attr) == 0);
+  pthread_condattr_destroy (&cond_attr);
+}
+
+/* Locks the mutex of a shared bottle. If a process died while holding it, the lock is recovered:
+   the ring is still consistent, as positions are only moved once messages are copied. */
+static inline void
+BOTTLE_SHM_LOCK (pthread_mutex_t *mutex)
+{
+  int ret = pthread_mutex_lock (mutex);
+  if (ret == EOWNERDEAD)
+    ret = pthread_mutex_consistent (mutex);
+  BOTTLE_ASSERT (ret == 0);
+}
+
+/* Parks on cond, the mutex being locked, until signaled or the deadline (if not null) is reached. Returns 0 once the deadline is reached. */
+static inline int
+BOTTLE_SHM_PARK (pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *deadline)
+{
+  int ret = deadline ? pthread_cond_timedwait (cond, mutex, deadline) : pthread_cond_wait (cond, mutex);
+  if (ret == EOWNERDEAD)
+    ret = pthread_mutex_consistent (mutex);
+  BOTTLE_ASSERT (ret == 0 || ret == ETIMEDOUT);
+  return ret == 0;
+}
+
+/* Wakes up the threads (of any process) parked on cond, if any, after k messages (or slots) were made available. */
+static inline void
+BOTTLE_SHM_SIGNAL (pthread_cond_t *cond, int waiting, size_t k)
+{
+  if (waiting)
+    BOTTLE_ASSERT ((k > 1 && waiting > 1 ? pthread_cond_broadcast (cond) : pthread_cond_signal (cond)) == 0);
+}
+
+// Waits, the mutex of the shared bottle being locked, as long as condition holds and the deadline (if not null) is not reached.
+// Parked threads are counted in waiting, so that they are only signaled if there are any.
+#    define BOTTLE_SHM_WAIT(self, shared, cond, waiting, condition, deadline) \
+  do {\
+    BOTTLE_STATS_START (_parked, condition);\
+    if (condition)\
+    {\
+      (shared)->waiting++;\
+      while ((condition) && BOTTLE_SHM_PARK (&(shared)->cond, &(shared)->mutex, (deadline)))\
+        /* */ ;\
+      (shared)->waiting--;\
+    }\
+    BOTTLE_STATS_STOP ((self), _parked, &(shared)->cond == &(shared)->not_full);\
+  } while(0)
+#  endif
+
+/* Returns the earliest of two deadlines (b can be null, for no deadline). */
+static inline const struct timespec *
+BOTTLE_EARLIEST (const struct timespec *a, const struct timespec *b)
+{
+  if (!b || a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec))
+    return a;
+  return b;
+}
+
+/* Tells if the deadline is reached. */
+static inline int
+BOTTLE_DEADLINE_REACHED (const struct timespec *deadline)
+{
+  struct timespec now;
+  BOTTLE_ASSERT (timespec_get (&now, TIME_UTC) == TIME_UTC);
+  return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+#  define BOTTLE_SELECT_POLL 1000000L  // Nanoseconds between two checks of bottles which can't notify bottle_select (shared bottles)
+
+/* Claims the case c of a thread in bottle_select (once it watches its bottles, otherwise nothing is claimed),
+   and the offer of a case of another thread in bottle_select (if not null), before their operation is performed.
+   Returns 0 if either thread has already performed another case. The thread which made the offer is woken up.
+   Selectors are locked in address order, so that two threads taking each other's offers do not deadlock. */
+static inline int
+BOTTLE_SELECT_CLAIM (bottle_case *c, bottle_case *offer)
+{
+  bottle_selector *own = (c ? c->selector : 0), *other = (offer ? offer->selector : 0);
+  bottle_selector *lock[2] = { own, other };
+  if (!own || (other && (uintptr_t) other < (uintptr_t) own))
+  {
+    lock[0] = other;
+    lock[1] = own;
+  }
+  for (int i = 0 ; i < 2 ; i++)
+    if (lock[i])
+      BOTTLE_ASSERT (mtx_lock (&lock[i]->mutex) == thrd_success);
+  int claimed = (!own || !own->done) && (!other || !other->done);
+  if (claimed && own)
+    own->done = c;
+  if (claimed && other)
+  {
+    other->done = offer;
+    BOTTLE_ASSERT (cnd_signal (&other->cond) == thrd_success);
+  }
+  for (int i = 1 ; i >= 0 ; i--)
+    if (lock[i])
+      BOTTLE_ASSERT (mtx_unlock (&lock[i]->mutex) == thrd_success);
+  return claimed;
+}
+
+/* Gives up the claim of the case c, whose operation could not be performed after all. */
+static inline void
+BOTTLE_SELECT_UNCLAIM (bottle_case *c)
+{
+  if (!c->selector)
+    return;
+  BOTTLE_ASSERT (mtx_lock (&c->selector->mutex) == thrd_success);
+  c->selector->done = 0;
+  BOTTLE_ASSERT (mtx_unlock (&c->selector->mutex) == thrd_success);
+}
+
+/* Performs the operation of one of the cases which can proceed, and returns its index.
+   Cases are scanned from a rotating position so that none of them is starved.
+   If none can proceed, the thread watches all the bottles and waits (if block) until one of them changes
+   (or, if some of them are shared, for BOTTLE_SELECT_POLL at most before checking them again).
+   Meanwhile, its cases of unbuffered bottles are offers: a peer at the meeting point (blocked or in bottle_select itself)
+   can perform one of them on its behalf, as with the select statement of Go. Any other case is claimed before it is performed,
+   so that exactly one case proceeds.
+   Returns -1 if no operation could proceed without blocking, or if all the bottles are closed (errno is then set to ECONNABORTED).
+   Returns -1 at once if the operation of a case can never proceed (errno is then set by the operation, for instance to EPERM
+   to receive from a broadcast bottle), rather than waiting for it forever. */
+static inline int
+BOTTLE_SELECT_CASES (bottle_case *cases, size_t n, int block)
+{
+  static thread_local size_t rotation = 0;
+  int saved_errno = errno;
+  int ret = -1;
+  int watching = 0;
+  int failed = 0;
+  size_t closed;
+  bottle_selector selector;
+  for (size_t i = 0 ; i < n ; i++)
+    cases[i].selector = 0;      /* nothing to claim as long as the bottles are not watched */
+  for (;;)
+  {
+    closed = 0;
+    size_t start = rotation++;
+    for (size_t i = 0 ; i < n && ret < 0 && !failed ; i++)
+    {
+      size_t k = (start + i) % n;
+      errno = 0;
+      if (cases[k].operation (cases + k))
+        ret = (int) k;
+      else if (errno == ECONNABORTED)
+        closed++;
+      else if (errno) /* the case can never proceed */
+        failed = errno;
+    }
+    if (ret >= 0 || failed || closed == n || !block)
+      break;
+    if (!watching)
+    {
+      /* From now on, the bottles notify any change: check again before waiting */
+      BOTTLE_ASSERT (mtx_init (&selector.mutex, mtx_plain) == thrd_success);
+      BOTTLE_ASSERT (cnd_init (&selector.cond) == thrd_success);
+      selector.ready = selector.polling = 0;
+      selector.done = 0;
+      for (size_t i = 0 ; i < n ; i++)
+      {
+        cases[i].selector = &selector;
+        cases[i].watch (cases[i].bottle, cases + i, 1);
+      }
+      watching = 1;
+      continue;
+    }
+    BOTTLE_ASSERT (mtx_lock (&selector.mutex) == thrd_success);
+    while (!selector.ready && !selector.done)
+      if (!selector.polling)
+        BOTTLE_ASSERT (cnd_wait (&selector.cond, &selector.mutex) == thrd_success);
+      else
+      {
+        static const struct timespec interval = { 0, BOTTLE_SELECT_POLL };
+        struct timespec deadline;
+        int r = cnd_timedwait (&selector.cond, &selector.mutex, BOTTLE_DEADLINE (&deadline, &interval));
+        BOTTLE_ASSERT (r != thrd_error);
+        if (r == thrd_timedout)
+          break;
+      }
+    selector.ready = 0;
+    if (selector.done) /* a peer took an offer */
+      ret = (int) (selector.done - cases);
+    BOTTLE_ASSERT (mtx_unlock (&selector.mutex) == thrd_success);
+    if (ret >= 0)
+      break;
+  }
+  if (watching)
+  {
+    BOTTLE_ASSERT (mtx_lock (&selector.mutex) == thrd_success);
+    if (!selector.done) /* the offers are withdrawn */
+      selector.done = cases + n;
+    else if (ret < 0) /* a peer took an offer before the thread gave up */
+      ret = (int) (selector.done - cases);
+    BOTTLE_ASSERT (mtx_unlock (&selector.mutex) == thrd_success);
+    for (size_t i = 0 ; i < n ; i++)
+      cases[i].watch (cases[i].bottle, cases + i, 0);
+    mtx_destroy (&selector.mutex);
+    cnd_destroy (&selector.cond);
+  }
+  errno = (ret >= 0 ? saved_errno : failed ? failed : closed == n ? ECONNABORTED : saved_errno);
+  return ret;
+}
 
 #  define DEFINE_BOTTLE( TYPE )                                                 \
   static int  BOTTLE_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message);         \
   static int  BOTTLE_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message);     \
   static int  BOTTLE_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message);       \
   static int  BOTTLE_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message);   \
+  static int  BOTTLE_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline);   \
+  static int  BOTTLE_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline); \
+  static size_t BOTTLE_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n);     \
+  static size_t BOTTLE_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max);        \
+  static size_t BOTTLE_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max);    \
   static void BOTTLE_PLUG_##TYPE (BOTTLE_##TYPE *self);                       \
   static void BOTTLE_UNPLUG_##TYPE (BOTTLE_##TYPE *self);                     \
   static void BOTTLE_CLOSE_##TYPE (BOTTLE_##TYPE *self);                      \
   static void BOTTLE_DESTROY_##TYPE (BOTTLE_##TYPE *self);                    \
+  static int  BOTTLE_SPSC_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message);    \
+  static int  BOTTLE_SPSC_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message);\
+  static int  BOTTLE_SPSC_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message);  \
+  static int  BOTTLE_SPSC_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message); \
+  static int  BOTTLE_SPSC_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline);   \
+  static int  BOTTLE_SPSC_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline); \
+  static size_t BOTTLE_SPSC_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n);     \
+  static size_t BOTTLE_SPSC_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_SPSC_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max);        \
+  static size_t BOTTLE_SPSC_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max);    \
+  static int  BOTTLE_MPMC_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message);    \
+  static int  BOTTLE_MPMC_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message);\
+  static int  BOTTLE_MPMC_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message);  \
+  static int  BOTTLE_MPMC_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message); \
+  static int  BOTTLE_MPMC_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline);   \
+  static int  BOTTLE_MPMC_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline); \
+  static size_t BOTTLE_MPMC_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n);     \
+  static size_t BOTTLE_MPMC_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_MPMC_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max);        \
+  static size_t BOTTLE_MPMC_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max);    \
+  static void BOTTLE_MPMC_CLOSE_##TYPE (BOTTLE_##TYPE *self);                 \
+  static int  BOTTLE_TWO_LOCK_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message); \
+  static int  BOTTLE_TWO_LOCK_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message); \
+  static int  BOTTLE_TWO_LOCK_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message); \
+  static int  BOTTLE_TWO_LOCK_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message); \
+  static int  BOTTLE_TWO_LOCK_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline); \
+  static int  BOTTLE_TWO_LOCK_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline); \
+  static size_t BOTTLE_TWO_LOCK_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_TWO_LOCK_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_TWO_LOCK_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max); \
+  static size_t BOTTLE_TWO_LOCK_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max); \
+  static void BOTTLE_TWO_LOCK_CLOSE_##TYPE (BOTTLE_##TYPE *self);             \
+  static TYPE *BOTTLE_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block);        \
+  static void BOTTLE_COMMIT_##TYPE (BOTTLE_##TYPE *self);                     \
+  static size_t BOTTLE_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block); \
+  static void BOTTLE_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k);           \
+  static TYPE *BOTTLE_SPSC_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block);   \
+  static void BOTTLE_SPSC_COMMIT_##TYPE (BOTTLE_##TYPE *self);                \
+  static size_t BOTTLE_SPSC_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block); \
+  static void BOTTLE_SPSC_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k);      \
+  static TYPE *BOTTLE_MPMC_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block);   \
+  static void BOTTLE_MPMC_COMMIT_##TYPE (BOTTLE_##TYPE *self);                \
+  static size_t BOTTLE_MPMC_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block); \
+  static void BOTTLE_MPMC_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k);      \
+  static TYPE *BOTTLE_TWO_LOCK_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block); \
+  static void BOTTLE_TWO_LOCK_COMMIT_##TYPE (BOTTLE_##TYPE *self);            \
+  static size_t BOTTLE_TWO_LOCK_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block); \
+  static const TYPE *BOTTLE_ACQUIRE_##TYPE (BOTTLE_##TYPE *self, int block);  \
+  static void BOTTLE_TWO_LOCK_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k);  \
+  static int  BOTTLE_BROADCAST_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message); \
+  static int  BOTTLE_BROADCAST_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message); \
+  static int  BOTTLE_BROADCAST_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline); \
+  static size_t BOTTLE_BROADCAST_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_BROADCAST_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static int  BOTTLE_BROADCAST_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message); \
+  static int  BOTTLE_BROADCAST_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline); \
+  static size_t BOTTLE_BROADCAST_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max); \
+  static void BOTTLE_BROADCAST_COMMIT_##TYPE (BOTTLE_##TYPE *self);           \
+  static size_t BOTTLE_BROADCAST_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block); \
+  static void BOTTLE_BROADCAST_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k); \
+  static int  BOTTLE_PRIORITY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message); \
+  static int  BOTTLE_PRIORITY_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message); \
+  static int  BOTTLE_PRIORITY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message); \
+  static int  BOTTLE_PRIORITY_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message); \
+  static int  BOTTLE_PRIORITY_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline); \
+  static int  BOTTLE_PRIORITY_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline); \
+  static size_t BOTTLE_PRIORITY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_PRIORITY_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_PRIORITY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max); \
+  static size_t BOTTLE_PRIORITY_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max); \
+  static void BOTTLE_PRIORITY_COMMIT_##TYPE (BOTTLE_##TYPE *self); \
+  static size_t BOTTLE_PRIORITY_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block); \
+  static void BOTTLE_PRIORITY_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k); \
+  static int  BOTTLE_TOKEN_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message); \
+  static int  BOTTLE_TOKEN_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message); \
+  static int  BOTTLE_TOKEN_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message); \
+  static int  BOTTLE_TOKEN_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message); \
+  static int  BOTTLE_TOKEN_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline); \
+  static int  BOTTLE_TOKEN_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline); \
+  static size_t BOTTLE_TOKEN_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_TOKEN_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n); \
+  static size_t BOTTLE_TOKEN_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max); \
+  static size_t BOTTLE_TOKEN_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max); \
+  static void BOTTLE_TOKEN_CLOSE_##TYPE (BOTTLE_##TYPE *self); \
+  static TYPE *BOTTLE_TOKEN_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block); \
+  static void BOTTLE_TOKEN_COMMIT_##TYPE (BOTTLE_##TYPE *self); \
+  static size_t BOTTLE_TOKEN_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block); \
+  static void BOTTLE_TOKEN_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k); \
+  static int  BOTTLE_SUBSCRIBE_##TYPE (BOTTLE_##TYPE *self, BOTTLE_SUBSCRIBER_##TYPE *subscriber); \
+  static void BOTTLE_UNSUBSCRIBE_##TYPE (BOTTLE_SUBSCRIBER_##TYPE *subscriber); \
+  static int  BOTTLE_READ_##TYPE (BOTTLE_SUBSCRIBER_##TYPE *subscriber, TYPE *message, int block, const struct timespec *deadline); \
+  static int  BOTTLE_STATS_##TYPE (BOTTLE_##TYPE *self, bottle_statistics *stats); \
+  static int  BOTTLE_FD_##TYPE (BOTTLE_##TYPE *self, int send); \
+  static void BOTTLE_POLL_##TYPE (BOTTLE_##TYPE *self);        \
+  static int  BOTTLE_SELECT_FILL_##TYPE (bottle_case *c);                     \
+  static int  BOTTLE_SELECT_DRAIN_##TYPE (bottle_case *c);                    \
+  static void BOTTLE_WATCH_##TYPE (void *self, bottle_case *c, int on);       \
   static TYPE __dummy__##TYPE;                                                \
 \
   static const _BOTTLE_VTABLE_##TYPE BOTTLE_VTABLE_##TYPE =  \
@@ -80,318 +830,3243 @@
     BOTTLE_TRY_FILL_##TYPE,                              \
     BOTTLE_DRAIN_##TYPE,                                 \
     BOTTLE_TRY_DRAIN_##TYPE,                             \
+    BOTTLE_FILL_UNTIL_##TYPE,                            \
+    BOTTLE_DRAIN_UNTIL_##TYPE,                           \
+    BOTTLE_FILL_N_##TYPE,                                \
+    BOTTLE_TRY_FILL_N_##TYPE,                            \
+    BOTTLE_DRAIN_N_##TYPE,                               \
+    BOTTLE_TRY_DRAIN_N_##TYPE,                           \
+    BOTTLE_PLUG_##TYPE,                                  \
+    BOTTLE_UNPLUG_##TYPE,                                \
+    BOTTLE_CLOSE_##TYPE,                                 \
+    BOTTLE_DESTROY_##TYPE,                               \
+    BOTTLE_SELECT_FILL_##TYPE,                           \
+    BOTTLE_SELECT_DRAIN_##TYPE,                          \
+    BOTTLE_WATCH_##TYPE,                                 \
+    BOTTLE_RESERVE_##TYPE,                               \
+    BOTTLE_COMMIT_##TYPE,                                \
+    BOTTLE_ACQUIRE_##TYPE,                               \
+    BOTTLE_ACQUIRE_N_##TYPE,                             \
+    BOTTLE_RELEASE_##TYPE,                               \
+    BOTTLE_SUBSCRIBE_##TYPE,                             \
+    BOTTLE_UNSUBSCRIBE_##TYPE,                           \
+    BOTTLE_READ_##TYPE,                                  \
+    BOTTLE_STATS_##TYPE,                                 \
+    BOTTLE_FD_##TYPE,                                    \
+  };                                                     \
+\
+  static const _BOTTLE_VTABLE_##TYPE BOTTLE_SPSC_VTABLE_##TYPE =  \
+  {                                                      \
+    BOTTLE_SPSC_FILL_##TYPE,                             \
+    BOTTLE_SPSC_TRY_FILL_##TYPE,                         \
+    BOTTLE_SPSC_DRAIN_##TYPE,                            \
+    BOTTLE_SPSC_TRY_DRAIN_##TYPE,                        \
+    BOTTLE_SPSC_FILL_UNTIL_##TYPE,                       \
+    BOTTLE_SPSC_DRAIN_UNTIL_##TYPE,                      \
+    BOTTLE_SPSC_FILL_N_##TYPE,                           \
+    BOTTLE_SPSC_TRY_FILL_N_##TYPE,                       \
+    BOTTLE_SPSC_DRAIN_N_##TYPE,                          \
+    BOTTLE_SPSC_TRY_DRAIN_N_##TYPE,                      \
+    BOTTLE_PLUG_##TYPE,                                  \
+    BOTTLE_UNPLUG_##TYPE,                                \
+    BOTTLE_CLOSE_##TYPE,                                 \
+    BOTTLE_DESTROY_##TYPE,                               \
+    BOTTLE_SELECT_FILL_##TYPE,                           \
+    BOTTLE_SELECT_DRAIN_##TYPE,                          \
+    BOTTLE_WATCH_##TYPE,                                 \
+    BOTTLE_SPSC_RESERVE_##TYPE,                          \
+    BOTTLE_SPSC_COMMIT_##TYPE,                           \
+    BOTTLE_ACQUIRE_##TYPE,                               \
+    BOTTLE_SPSC_ACQUIRE_N_##TYPE,                        \
+    BOTTLE_SPSC_RELEASE_##TYPE,                          \
+    BOTTLE_SUBSCRIBE_##TYPE,                             \
+    BOTTLE_UNSUBSCRIBE_##TYPE,                           \
+    BOTTLE_READ_##TYPE,                                  \
+    BOTTLE_STATS_##TYPE,                                 \
+    BOTTLE_FD_##TYPE,                                    \
+  };                                                     \
+\
+  static const _BOTTLE_VTABLE_##TYPE BOTTLE_MPMC_VTABLE_##TYPE =  \
+  {                                                      \
+    BOTTLE_MPMC_FILL_##TYPE,                             \
+    BOTTLE_MPMC_TRY_FILL_##TYPE,                         \
+    BOTTLE_MPMC_DRAIN_##TYPE,                            \
+    BOTTLE_MPMC_TRY_DRAIN_##TYPE,                        \
+    BOTTLE_MPMC_FILL_UNTIL_##TYPE,                       \
+    BOTTLE_MPMC_DRAIN_UNTIL_##TYPE,                      \
+    BOTTLE_MPMC_FILL_N_##TYPE,                           \
+    BOTTLE_MPMC_TRY_FILL_N_##TYPE,                       \
+    BOTTLE_MPMC_DRAIN_N_##TYPE,                          \
+    BOTTLE_MPMC_TRY_DRAIN_N_##TYPE,                      \
+    BOTTLE_PLUG_##TYPE,                                  \
+    BOTTLE_UNPLUG_##TYPE,                                \
+    BOTTLE_MPMC_CLOSE_##TYPE,                            \
+    BOTTLE_DESTROY_##TYPE,                               \
+    BOTTLE_SELECT_FILL_##TYPE,                           \
+    BOTTLE_SELECT_DRAIN_##TYPE,                          \
+    BOTTLE_WATCH_##TYPE,                                 \
+    BOTTLE_MPMC_RESERVE_##TYPE,                          \
+    BOTTLE_MPMC_COMMIT_##TYPE,                           \
+    BOTTLE_ACQUIRE_##TYPE,                               \
+    BOTTLE_MPMC_ACQUIRE_N_##TYPE,                        \
+    BOTTLE_MPMC_RELEASE_##TYPE,                          \
+    BOTTLE_SUBSCRIBE_##TYPE,                             \
+    BOTTLE_UNSUBSCRIBE_##TYPE,                           \
+    BOTTLE_READ_##TYPE,                                  \
+    BOTTLE_STATS_##TYPE,                                 \
+    BOTTLE_FD_##TYPE,                                    \
+  };                                                     \
+\
+  static const _BOTTLE_VTABLE_##TYPE BOTTLE_TWO_LOCK_VTABLE_##TYPE = \
+  {                                                      \
+    BOTTLE_TWO_LOCK_FILL_##TYPE,                         \
+    BOTTLE_TWO_LOCK_TRY_FILL_##TYPE,                     \
+    BOTTLE_TWO_LOCK_DRAIN_##TYPE,                        \
+    BOTTLE_TWO_LOCK_TRY_DRAIN_##TYPE,                    \
+    BOTTLE_TWO_LOCK_FILL_UNTIL_##TYPE,                   \
+    BOTTLE_TWO_LOCK_DRAIN_UNTIL_##TYPE,                  \
+    BOTTLE_TWO_LOCK_FILL_N_##TYPE,                       \
+    BOTTLE_TWO_LOCK_TRY_FILL_N_##TYPE,                   \
+    BOTTLE_TWO_LOCK_DRAIN_N_##TYPE,                      \
+    BOTTLE_TWO_LOCK_TRY_DRAIN_N_##TYPE,                  \
+    BOTTLE_PLUG_##TYPE,                                  \
+    BOTTLE_UNPLUG_##TYPE,                                \
+    BOTTLE_TWO_LOCK_CLOSE_##TYPE,                        \
+    BOTTLE_DESTROY_##TYPE,                               \
+    BOTTLE_SELECT_FILL_##TYPE,                           \
+    BOTTLE_SELECT_DRAIN_##TYPE,                          \
+    BOTTLE_WATCH_##TYPE,                                 \
+    BOTTLE_TWO_LOCK_RESERVE_##TYPE,                      \
+    BOTTLE_TWO_LOCK_COMMIT_##TYPE,                       \
+    BOTTLE_ACQUIRE_##TYPE,                               \
+    BOTTLE_TWO_LOCK_ACQUIRE_N_##TYPE,                    \
+    BOTTLE_TWO_LOCK_RELEASE_##TYPE,                      \
+    BOTTLE_SUBSCRIBE_##TYPE,                             \
+    BOTTLE_UNSUBSCRIBE_##TYPE,                           \
+    BOTTLE_READ_##TYPE,                                  \
+    BOTTLE_STATS_##TYPE,                                 \
+    BOTTLE_FD_##TYPE,                                    \
+  };                                                     \
+\
+  static const _BOTTLE_VTABLE_##TYPE BOTTLE_BROADCAST_VTABLE_##TYPE = \
+  {                                                      \
+    BOTTLE_BROADCAST_FILL_##TYPE,                        \
+    BOTTLE_BROADCAST_TRY_FILL_##TYPE,                    \
+    BOTTLE_BROADCAST_DRAIN_##TYPE,                       \
+    BOTTLE_BROADCAST_DRAIN_##TYPE,                       \
+    BOTTLE_BROADCAST_FILL_UNTIL_##TYPE,                  \
+    BOTTLE_BROADCAST_DRAIN_UNTIL_##TYPE,                 \
+    BOTTLE_BROADCAST_FILL_N_##TYPE,                      \
+    BOTTLE_BROADCAST_TRY_FILL_N_##TYPE,                  \
+    BOTTLE_BROADCAST_DRAIN_N_##TYPE,                     \
+    BOTTLE_BROADCAST_DRAIN_N_##TYPE,                     \
+    BOTTLE_PLUG_##TYPE,                                  \
+    BOTTLE_UNPLUG_##TYPE,                                \
+    BOTTLE_CLOSE_##TYPE,                                 \
+    BOTTLE_DESTROY_##TYPE,                               \
+    BOTTLE_SELECT_FILL_##TYPE,                           \
+    BOTTLE_SELECT_DRAIN_##TYPE,                          \
+    BOTTLE_WATCH_##TYPE,                                 \
+    BOTTLE_RESERVE_##TYPE,                               \
+    BOTTLE_BROADCAST_COMMIT_##TYPE,                      \
+    BOTTLE_ACQUIRE_##TYPE,                               \
+    BOTTLE_BROADCAST_ACQUIRE_N_##TYPE,                   \
+    BOTTLE_BROADCAST_RELEASE_##TYPE,                     \
+    BOTTLE_SUBSCRIBE_##TYPE,                             \
+    BOTTLE_UNSUBSCRIBE_##TYPE,                           \
+    BOTTLE_READ_##TYPE,                                  \
+    BOTTLE_STATS_##TYPE,                                 \
+    BOTTLE_FD_##TYPE,                                    \
+  };                                                     \
+\
+  static const _BOTTLE_VTABLE_##TYPE BOTTLE_PRIORITY_VTABLE_##TYPE = \
+  {                                                      \
+    BOTTLE_PRIORITY_FILL_##TYPE,                         \
+    BOTTLE_PRIORITY_TRY_FILL_##TYPE,                     \
+    BOTTLE_PRIORITY_DRAIN_##TYPE,                        \
+    BOTTLE_PRIORITY_TRY_DRAIN_##TYPE,                    \
+    BOTTLE_PRIORITY_FILL_UNTIL_##TYPE,                   \
+    BOTTLE_PRIORITY_DRAIN_UNTIL_##TYPE,                  \
+    BOTTLE_PRIORITY_FILL_N_##TYPE,                       \
+    BOTTLE_PRIORITY_TRY_FILL_N_##TYPE,                   \
+    BOTTLE_PRIORITY_DRAIN_N_##TYPE,                      \
+    BOTTLE_PRIORITY_TRY_DRAIN_N_##TYPE,                  \
     BOTTLE_PLUG_##TYPE,                                  \
     BOTTLE_UNPLUG_##TYPE,                                \
     BOTTLE_CLOSE_##TYPE,                                 \
     BOTTLE_DESTROY_##TYPE,                               \
+    BOTTLE_SELECT_FILL_##TYPE,                           \
+    BOTTLE_SELECT_DRAIN_##TYPE,                          \
+    BOTTLE_WATCH_##TYPE,                                 \
+    BOTTLE_RESERVE_##TYPE,                               \
+    BOTTLE_PRIORITY_COMMIT_##TYPE,                       \
+    BOTTLE_ACQUIRE_##TYPE,                               \
+    BOTTLE_PRIORITY_ACQUIRE_N_##TYPE,                    \
+    BOTTLE_PRIORITY_RELEASE_##TYPE,                      \
+    BOTTLE_SUBSCRIBE_##TYPE,                             \
+    BOTTLE_UNSUBSCRIBE_##TYPE,                           \
+    BOTTLE_READ_##TYPE,                                  \
+    BOTTLE_STATS_##TYPE,                                 \
+    BOTTLE_FD_##TYPE,                                    \
+  };                                                     \
+\
+  static const _BOTTLE_VTABLE_##TYPE BOTTLE_TOKEN_VTABLE_##TYPE = \
+  {                                                      \
+    BOTTLE_TOKEN_FILL_##TYPE,                            \
+    BOTTLE_TOKEN_TRY_FILL_##TYPE,                        \
+    BOTTLE_TOKEN_DRAIN_##TYPE,                           \
+    BOTTLE_TOKEN_TRY_DRAIN_##TYPE,                       \
+    BOTTLE_TOKEN_FILL_UNTIL_##TYPE,                      \
+    BOTTLE_TOKEN_DRAIN_UNTIL_##TYPE,                     \
+    BOTTLE_TOKEN_FILL_N_##TYPE,                          \
+    BOTTLE_TOKEN_TRY_FILL_N_##TYPE,                      \
+    BOTTLE_TOKEN_DRAIN_N_##TYPE,                         \
+    BOTTLE_TOKEN_TRY_DRAIN_N_##TYPE,                     \
+    BOTTLE_PLUG_##TYPE,                                  \
+    BOTTLE_UNPLUG_##TYPE,                                \
+    BOTTLE_TOKEN_CLOSE_##TYPE,                           \
+    BOTTLE_DESTROY_##TYPE,                               \
+    BOTTLE_SELECT_FILL_##TYPE,                           \
+    BOTTLE_SELECT_DRAIN_##TYPE,                          \
+    BOTTLE_WATCH_##TYPE,                                 \
+    BOTTLE_TOKEN_RESERVE_##TYPE,                         \
+    BOTTLE_TOKEN_COMMIT_##TYPE,                          \
+    BOTTLE_ACQUIRE_##TYPE,                               \
+    BOTTLE_TOKEN_ACQUIRE_N_##TYPE,                       \
+    BOTTLE_TOKEN_RELEASE_##TYPE,                         \
+    BOTTLE_SUBSCRIBE_##TYPE,                             \
+    BOTTLE_UNSUBSCRIBE_##TYPE,                           \
+    BOTTLE_READ_##TYPE,                                  \
+    BOTTLE_STATS_##TYPE,                                 \
+    BOTTLE_FD_##TYPE,                                    \
   };                                                     \
 \
-  static void QUEUE_INIT_##TYPE (struct _queue_##TYPE *q, size_t capacity) \
+  /* Cell of the MPMC ring for the ticket pos (cells are stride bytes apart) */ \
+  static struct _cell_##TYPE *MPMC_CELL_##TYPE (BOTTLE_##TYPE *self, size_t pos) \
   {                                                            \
-    q->unlimited = (capacity == (size_t) -1);                        \
-    BOTTLE_ASSERT3 (!q->unlimited || !LIMITED_BUFFER, "Unauthorised use of UNLIMITED buffer.\n", 1); \
-    q->capacity = ((q->unlimited || capacity == 0) ? 1 : capacity);  \
-    q->size = 0;                                                     \
-    BOTTLE_ASSERT (q->buffer = malloc (q->capacity * sizeof (*q->buffer))); \
-    q->reader_head = 0;                                              \
-    q->writer_head = q->buffer;                                      \
-  }                                                                  \
+    return (struct _cell_##TYPE *) ((char *) self->mpmc.cells + RING_INDEX (pos, self->capacity, self->mpmc.mask) * self->mpmc.stride); \
+  }                                                            \
 \
-  static void QUEUE_DISPOSE_##TYPE (struct _queue_##TYPE *q)   \
+  /* Allocates a block of a segmented queue, mapped from a segment file if spill is set (or from memory if that fails). */ \
+  static struct _segment_##TYPE *QUEUE_SEGMENT_ALLOC_##TYPE (struct _queue_##TYPE *q, int spill) \
   {                                                            \
-    free (q->buffer);                                          \
+    size_t size = sizeof (struct _segment_##TYPE) + q->segment * sizeof (TYPE); \
+    struct _segment_##TYPE *s = (spill ? BOTTLE_SPILL_MAP (q->spill, size) : 0); \
+    BOTTLE_ASSERT3 (s || !spill, "A block could not be spilled to disk (it is kept in memory).\n", 0); \
+    if (s)                                                     \
+    {                                                          \
+      s->spilled = 1;                                          \
+      q->spilled++;                                            \
+    }                                                          \
+    else                                                       \
+    {                                                          \
+      BOTTLE_ASSERT (s = BOTTLE_ALLOC (&q->allocator, size, _Alignof (struct _segment_##TYPE))); \
+      s->spilled = 0;                                          \
+    }                                                          \
+    q->capacity += q->segment;                                 \
+    return s;                                                  \
   }                                                            \
 \
-  static int QUEUE_PUSH_##TYPE (struct _queue_##TYPE *q, TYPE message) \
+  static void QUEUE_SEGMENT_FREE_##TYPE (struct _queue_##TYPE *q, struct _segment_##TYPE *s) \
   {                                                            \
-    if (QUEUE_IS_EXHAUSTED (*q) && q->unlimited && q->capacity < (size_t) -1) \
+    size_t size = sizeof (*s) + q->segment * sizeof (*s->messages); \
+    if (s->spilled)                                            \
     {                                                          \
-      size_t oldc = q->capacity;                               \
-      q->capacity = QUEUE_UNLIMITED_CAPACITY_GROWTH_RULE (q->capacity); \
-      if (q->capacity <= oldc) /* overflow ? */                \
-        q->capacity = (size_t) -1;                             \
-      ptrdiff_t reader_offset = q->reader_head - q->buffer;    \
-      ptrdiff_t writer_offset = q->writer_head - q->buffer;    \
-      BOTTLE_ASSERT (q->buffer = realloc (q->buffer, q->capacity * sizeof (*q->buffer))); \
-      q->reader_head = q->buffer + reader_offset + (q->capacity - oldc); \
-      q->writer_head = q->buffer + writer_offset;             \
-      for (TYPE* p = q->buffer + q->capacity - 1 ; p >= q->reader_head ; p--) \
-        *p = *(p - (q->capacity - oldc));                      \
+      BOTTLE_SPILL_UNMAP (s, size);                            \
+      q->spilled--;                                            \
     }                                                          \
-    if (QUEUE_IS_EXHAUSTED (*q))                               \
+    else                                                       \
+      BOTTLE_FREE (&q->allocator, s, size);                    \
+    q->capacity -= q->segment;                                 \
+  }                                                            \
+\
+  /* Initialises the queue, in the array storage (of at least capacity messages) if not null, or in an allocated one. */ \
+  /* A queue of capacity 0 stores no message, and has no array (for engines which keep their messages elsewhere). */ \
+  static void QUEUE_INIT_##TYPE (struct _queue_##TYPE *q, size_t capacity, const bottle_options *options, TYPE *storage) \
+  {                                                            \
+    static const bottle_options defaults = { 0 };              \
+    if (!options)                                              \
+      options = &defaults;                                     \
+    q->unlimited = (capacity == (size_t) -1);                  \
+    BOTTLE_ASSERT3 (!q->unlimited || !LIMITED_BUFFER, "Unauthorised use of UNLIMITED buffer.\n", 1); \
+    q->first = q->last = q->spare = 0;                         \
+    q->spares = 0;                                             \
+    BOTTLE_ASSERT3 (!options->spill_directory || BOTTLE_CAN_SPILL, "Spilling to disk requires BOTTLE_MMAP.\n", 1); \
+    q->spill = 0;                                              \
+    q->watermark = options->spill_watermark;                   \
+    q->spilled = 0;                                            \
+    if (q->unlimited && options->spill_directory) /* the directory is copied */ \
     {                                                          \
-      errno = EPERM;                                           \
-      return 0;                                                \
+      BOTTLE_ASSERT (q->spill = malloc (strlen (options->spill_directory) + 1)); \
+      strcpy (q->spill, options->spill_directory);             \
     }                                                          \
-    *q->writer_head = message; /* copy */                      \
-    if (!q->reader_head)                                       \
-      q->reader_head = q->writer_head;                         \
-    q->writer_head++;                                          \
-    if (q->writer_head == q->buffer + q->capacity)             \
-      q->writer_head = q->buffer;                              \
-    q->size++;                                                 \
-    return 1;                                                  \
+    q->segment = (q->unlimited ? options->segment : 0);        \
+    if (q->spill && !q->segment) /* spilled messages are stored in blocks */ \
+      q->segment = (sizeof (TYPE) < QUEUE_SPILL_BLOCK ? QUEUE_SPILL_BLOCK / sizeof (TYPE) : 1); \
+    q->growth = (options->growth >= 2 ? options->growth : QUEUE_UNLIMITED_GROWTH); \
+    q->shrink = (options->shrink ? options->shrink : QUEUE_UNLIMITED_SHRINK); \
+    q->delay = options->shrink_delay;                          \
+    q->below = 0;                                              \
+    q->resizes = 0;                                            \
+    q->floor = (q->unlimited ? options->floor : 0);            \
+    q->read = q->write = 0;                                    \
+    q->head = q->tail = 0;                                     \
+    q->limit = (q->unlimited ? QUEUE_MAX_CAPACITY (*q) : capacity); \
+    BOTTLE_ASSERT3 (q->limit <= QUEUE_MAX_CAPACITY (*q) && q->floor <= q->limit, "Capacity too large.\n", 1); \
+    q->reader_head = q->writer_head = 0;                       \
+    q->mask = 0;                                               \
+    q->fixed = (storage != 0);                                 \
+    q->allocator = (options->allocator ? *options->allocator : (bottle_allocator) { 0 }); \
+    if (!capacity)                                             \
+    {                                                          \
+      q->capacity = 0;                                         \
+      q->buffer = 0;                                           \
+      return;                                                  \
+    }                                                          \
+    if (q->segment) /* blocks are allocated on demand, or kept free up to the floor */ \
+    {                                                          \
+      q->capacity = 0;                                         \
+      q->buffer = 0;                                           \
+      while (q->capacity < q->floor)                           \
+      {                                                        \
+        struct _segment_##TYPE *s = QUEUE_SEGMENT_ALLOC_##TYPE (q, 0); \
+        s->next = q->spare;                                    \
+        q->spare = s;                                          \
+        q->spares++;                                           \
+      }                                                        \
+      return;                                                  \
+    }                                                          \
+    q->capacity = (q->unlimited ? (q->floor ? q->floor : 1) : q->limit); \
+    q->mask = QUEUE_MASK (q->capacity);                        \
+    if (q->fixed)                                              \
+      q->buffer = storage;                                     \
+    else                                                       \
+      BOTTLE_ASSERT (q->buffer = BOTTLE_ALLOC (&q->allocator, q->capacity * sizeof (*q->buffer), _Alignof (TYPE))); \
   }                                                            \
 \
-  static int QUEUE_POP_##TYPE (struct _queue_##TYPE *q, TYPE *message) \
+  static void QUEUE_DISPOSE_##TYPE (struct _queue_##TYPE *q)   \
   {                                                            \
-    if (QUEUE_IS_EMPTY (*q))                                   \
+    if (!q->fixed && q->buffer) /* a queue of capacity 0 has no array */ \
+      BOTTLE_FREE (&q->allocator, q->buffer, q->capacity * sizeof (*q->buffer)); \
+    if (q->last) /* the used blocks are chained before the free ones */ \
+      q->last->next = q->spare;                                \
+    else                                                       \
+      q->first = q->spare;                                     \
+    for (struct _segment_##TYPE *s = q->first, *next ; s ; s = next) \
     {                                                          \
-      errno = EPERM;                                           \
-      return 0;                                                \
+      next = s->next;                                          \
+      QUEUE_SEGMENT_FREE_##TYPE (q, s);                        \
     }                                                          \
-    *message = *q->reader_head; /* copy */                     \
-    q->reader_head++;                                          \
-    if (q->reader_head == q->buffer + q->capacity)             \
-      q->reader_head = q->buffer;                              \
-    if (q->reader_head == q->writer_head) /* empty queue */    \
-      q->reader_head = 0;                                      \
-    q->size--;                                                 \
-    if (q->unlimited && q->size && q->reader_head &&           \
-        QUEUE_UNLIMITED_CAPACITY_GROWTH_RULE (q->size) <= q->capacity) \
+    free (q->spill);                                           \
+  }                                                            \
+\
+  /* Returns the number of messages that can be written contiguously in the last block of a segmented queue, */ \
+  /* after linking a new block (taken from the free blocks if any) if the last one is full. */ \
+  /* Past the watermark of a spilling queue, new blocks are spilled to disk, and their pages dropped from memory once written. */ \
+  static size_t QUEUE_SEGMENT_ROOM_##TYPE (struct _queue_##TYPE *q) \
+  {                                                            \
+    if (!q->last || q->writer_head == q->last->messages + q->segment) \
     {                                                          \
-      size_t oldc = q->capacity;                               \
-      q->capacity = q->size;                                   \
-      if (q->reader_head >= q->writer_head + (oldc - q->capacity)) \
+      struct _segment_##TYPE *s = q->spare;                    \
+      if (s)                                                   \
       {                                                        \
-        q->reader_head = q->reader_head - (oldc - q->capacity);\
-        for (TYPE* p = q->reader_head ; p < q->buffer + q->capacity ; p++) \
-          *p = *(p + (oldc - q->capacity));                    \
+        q->spare = s->next;                                    \
+        q->spares--;                                           \
       }                                                        \
-      else if (q->reader_head < q->writer_head)                \
+      else                                                     \
       {                                                        \
-        for (TYPE* p = q->reader_head ; p < q->writer_head ; p++) \
-          *(q->buffer + (p - q->reader_head)) = *p;            \
-        q->writer_head = q->buffer + (q->writer_head - q->reader_head); \
-        q->reader_head = q->buffer;                            \
+        s = QUEUE_SEGMENT_ALLOC_##TYPE (q, q->spill && q->capacity - q->spilled * q->segment >= q->watermark); \
+        q->resizes++;                                          \
       }                                                        \
+      if (q->last && q->last->spilled)                         \
+        BOTTLE_SPILL_EVICT (q->last, sizeof (*s) + q->segment * sizeof (*s->messages)); \
+      s->next = 0;                                             \
+      if (q->last)                                             \
+        q->last->next = s;                                     \
       else                                                     \
-        BOTTLE_ASSERT3 (0, "Unexpected.\n", 1);                \
-      if (q->writer_head == q->buffer + q->capacity)           \
-        q->writer_head = q->buffer;                            \
-      ptrdiff_t reader_offset = q->reader_head - q->buffer;    \
-      ptrdiff_t writer_offset = q->writer_head - q->buffer;    \
-      BOTTLE_ASSERT (q->buffer = realloc (q->buffer, q->capacity * sizeof (*q->buffer))); \
-      q->reader_head = q->buffer + reader_offset;              \
-      q->writer_head = q->buffer + writer_offset;              \
+        q->first = s;                                          \
+      q->last = s;                                             \
+      q->writer_head = s->messages;                            \
     }                                                          \
-    return 1;                                                  \
+    return (size_t) (q->last->messages + q->segment - q->writer_head); \
   }                                                            \
 \
-  void BOTTLE_INIT_##TYPE (BOTTLE_##TYPE *self, size_t capacity) \
+  /* Accounts for n messages just written at the writer head of a segmented queue. */ \
+  static void QUEUE_SEGMENT_WRITTEN_##TYPE (struct _queue_##TYPE *q, size_t n) \
   {                                                            \
-    self->vtable = &BOTTLE_VTABLE_##TYPE;                      \
-    self->closed = 0;                                          \
-    self->frozen = 0;                                          \
-    self->__dummy__ = __dummy__##TYPE;                         \
-    BOTTLE_ASSERT (mtx_init (&self->mutex, mtx_plain) == thrd_success); \
-    BOTTLE_ASSERT (cnd_init (&self->not_empty) == thrd_success); \
-    BOTTLE_ASSERT (cnd_init (&self->not_full) == thrd_success);  \
-    self->not_reading = self->not_writing = 1;                 \
-    BOTTLE_ASSERT (cnd_init (&self->reading) == thrd_success); \
-    BOTTLE_ASSERT (cnd_init (&self->writing) == thrd_success); \
-    self->capacity = capacity;                                 \
-    QUEUE_INIT_##TYPE (&self->queue, capacity);                \
+    if (QUEUE_IS_EMPTY (*q))                                   \
+      q->reader_head = q->writer_head;                         \
+    q->writer_head += n;                                       \
+    q->write += n;                                             \
   }                                                            \
 \
-  BOTTLE_##TYPE *BOTTLE_CREATE_##TYPE (size_t capacity)  \
-  {                                                      \
-    BOTTLE_##TYPE *b = malloc( sizeof( *b ) );           \
-    BOTTLE_ASSERT (b);                                   \
-                                                         \
-    BOTTLE_INIT_##TYPE (b, capacity);                    \
-                                                         \
-    return b;                                            \
-  }                                                      \
+  /* Returns the number of messages that can be read contiguously from the first block of a non-empty segmented queue. */ \
+  static size_t QUEUE_SEGMENT_SPAN_##TYPE (struct _queue_##TYPE *q) \
+  {                                                            \
+    return (size_t) ((q->first == q->last ? q->writer_head : q->first->messages + q->segment) - q->reader_head); \
+  }                                                            \
 \
-  static int BOTTLE_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  /* Accounts for n messages just read at the reader head of a segmented queue. */ \
+  /* The first block is unlinked once read (and kept for reuse, or freed), without moving any other message. */ \
+  static void QUEUE_SEGMENT_READ_##TYPE (struct _queue_##TYPE *q, size_t n) \
   {                                                            \
-    int ret = 0;                                               \
-    BOTTLE_ASSERT (mtx_lock (&self->mutex) == thrd_success);   \
-    if (!self->closed && self->capacity == 0) /* unbuffered */ \
-    /* Barrier to synchronise the sender and the receiver */   \
-    {                                                          \
-      /* The thread declares it is attempting to write */      \
-      self->not_writing = 0;                                   \
-      BOTTLE_ASSERT (cnd_signal (&self->writing) == thrd_success); \
-      /* blocks until there is another thread attempting to receive a message ... */ \
-      while (!self->closed && self->not_reading)               \
-        BOTTLE_ASSERT (cnd_wait (&self->reading, &self->mutex) == thrd_success); \
-      self->not_reading = 1; /* The writer declares the end of reading (asap to avoid writing twice) */ \
-    }                                                          \
-    while (!self->closed &&                                    \
-           (self->frozen || QUEUE_IS_FULL (self->queue)))      \
-      BOTTLE_ASSERT (cnd_wait (&self->not_full, &self->mutex) == thrd_success); \
-    if (self->closed)                                          \
-    {                                                          \
-      BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-      return self->not_writing = 1, errno = ECONNABORTED, ret; \
-    }                                                          \
-    else if (!self->frozen && !QUEUE_IS_FULL (self->queue))    \
+    q->reader_head += n;                                       \
+    q->read += n;                                              \
+    if (QUEUE_IS_EMPTY (*q)) /* the only block left is reused from its start */ \
+      q->reader_head = q->writer_head = q->first->messages;    \
+    else if (q->reader_head == q->first->messages + q->segment) \
     {                                                          \
-      QUEUE_PUSH_##TYPE (&self->queue, message);               \
-      BOTTLE_ASSERT (cnd_signal (&self->not_empty) == thrd_success); \
-      if (self->capacity == 0) /* unbuffered */                \
-        /* ... at which point the receiving thread gets the message and both threads continue execution */ \
-        while (QUEUE_IS_FULL (self->queue))                    \
-          BOTTLE_ASSERT (cnd_wait (&self->not_full, &self->mutex) == thrd_success); \
-      ret = 1;                                                 \
+      struct _segment_##TYPE *s = q->first;                    \
+      q->first = s->next;                                      \
+      q->reader_head = q->first->messages;                     \
+      if (!s->spilled && (q->spares < QUEUE_SEGMENT_SPARES || q->capacity - q->segment < q->floor)) /* spilled blocks are not reused */ \
+      {                                                        \
+        s->next = q->spare;                                    \
+        q->spare = s;                                          \
+        q->spares++;                                           \
+      }                                                        \
+      else                                                     \
+      {                                                        \
+        QUEUE_SEGMENT_FREE_##TYPE (q, s);                      \
+        q->resizes++;                                          \
+      }                                                        \
     }                                                          \
-    else                                                       \
-      BOTTLE_ASSERT3 (0, "Unexpected.\n", 1);                  \
-    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-    return ret;                                                \
   }                                                            \
 \
-  static int BOTTLE_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  /* Extends the array of a full unlimited queue by the growth factor (up to its limit). */ \
+  static void QUEUE_GROW_##TYPE (struct _queue_##TYPE *q)      \
   {                                                            \
-    int ret = 0;                                               \
-    BOTTLE_ASSERT (mtx_lock (&self->mutex) == thrd_success);   \
-    if (self->closed)                                          \
+    size_t oldc = q->capacity;                                 \
+    size_t head = q->head;                                     \
+    q->capacity = (oldc <= q->limit / q->growth ? oldc * q->growth : q->limit); /* no overflow */ \
+    q->mask = QUEUE_MASK (q->capacity);                        \
+    BOTTLE_ASSERT (q->buffer = BOTTLE_REALLOC (&q->allocator, q->buffer, oldc * sizeof (*q->buffer), q->capacity * sizeof (*q->buffer), _Alignof (TYPE))); \
+    /* The messages wrapped around the end of the old array are moved right after it, */ \
+    /* or, if they do not fit there, the others are moved to the end of the new array. */ \
+    if (head <= q->capacity - oldc)                            \
+      memcpy (q->buffer + oldc, q->buffer, head * sizeof (*q->buffer)); \
+    else                                                       \
     {                                                          \
-      BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-      return self->not_writing = 1, errno = ECONNABORTED, ret; \
+      memmove (q->buffer + q->capacity - (oldc - head), q->buffer + head, (oldc - head) * sizeof (*q->buffer)); \
+      head += q->capacity - oldc;                              \
     }                                                          \
-    if (self->frozen || (self->capacity == 0 /* unbuffered */ && self->not_reading)) \
+    q->read = head;                                            \
+    q->write = head + oldc;                                    \
+    q->head = head;                                            \
+    q->tail = QUEUE_WRAP (*q, head + oldc);                    \
+    q->resizes++;                                              \
+  }                                                            \
+\
+  /* Returns the slot where to write the next message (after extending an unlimited queue if needed), or 0 if the queue is full. */ \
+  static TYPE *QUEUE_SLOT_##TYPE (struct _queue_##TYPE *q)     \
+  {                                                            \
+    if (q->segment)                                            \
     {                                                          \
-      BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-      return ret;                                              \
+      QUEUE_SEGMENT_ROOM_##TYPE (q);                           \
+      return q->writer_head;                                   \
     }                                                          \
-    if (!QUEUE_IS_FULL (self->queue))                          \
+    if (QUEUE_IS_EXHAUSTED (*q) && q->capacity < q->limit)     \
+      QUEUE_GROW_##TYPE (q);                                   \
+    if (QUEUE_IS_EXHAUSTED (*q))                               \
     {                                                          \
-      QUEUE_PUSH_##TYPE (&self->queue, message);               \
-      BOTTLE_ASSERT (cnd_signal (&self->not_empty) == thrd_success); \
-      if (self->capacity == 0 /* unbuffered */ && !self->not_reading)\
-      {                                                        \
-        /* The thread declares it is attempting to write */    \
-        self->not_writing = 0;                                 \
-        BOTTLE_ASSERT (cnd_signal (&self->writing) == thrd_success); \
-        self->not_reading = 1;                                 \
-        /* Wait for the receiving (reading) thread to get the message */ \
-        while (QUEUE_IS_FULL (self->queue))                    \
-          BOTTLE_ASSERT (cnd_wait (&self->not_full, &self->mutex) == thrd_success); \
-      }                                                        \
-      ret = 1;                                                 \
+      errno = EPERM;                                           \
+      return 0;                                                \
     }                                                          \
-    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-    return ret;                                                \
+    return q->buffer + q->tail;                                \
   }                                                            \
 \
-  static int BOTTLE_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  /* Appends the message written in the slot to the queue. */  \
+  static void QUEUE_WRITTEN_##TYPE (struct _queue_##TYPE *q)   \
   {                                                            \
-    int ret = 0;                                               \
-    BOTTLE_ASSERT (mtx_lock (&self->mutex) == thrd_success);   \
-    /* Barrier to synchronise the sender and the receiver */   \
-    if (!self->closed && self->capacity == 0) /* unbuffered */ \
-    {                                                          \
-      /* The thread declares it is attempting to read */       \
-      self->not_reading = 0;                                   \
-      BOTTLE_ASSERT (cnd_signal (&self->reading) == thrd_success); \
-      /* blocks until there is another thread attempting to send a message,
-         at which point both threads continue execution. */    \
-      while (!self->closed && self->not_writing)               \
-        BOTTLE_ASSERT (cnd_wait (&self->writing, &self->mutex) == thrd_success); \
-      self->not_writing = 1; /* The reader declares the end of writing (at once to avoid reading twice) */ \
-    }                                                          \
-    while (!self->closed && QUEUE_IS_EMPTY (self->queue))      \
-      BOTTLE_ASSERT (cnd_wait (&self->not_empty, &self->mutex) == thrd_success); \
-    if (!QUEUE_IS_EMPTY (self->queue))                         \
+    if (q->segment)                                            \
+      QUEUE_SEGMENT_WRITTEN_##TYPE (q, 1);                     \
+    else                                                       \
     {                                                          \
-      QUEUE_POP_##TYPE (&self->queue, message);                \
-      BOTTLE_ASSERT (cnd_signal (&self->not_full) == thrd_success); \
-      ret = 1;                                                 \
+      q->write++;                                              \
+      q->tail = (q->tail + 1 == q->capacity ? 0 : q->tail + 1); \
     }                                                          \
-    else if (self->closed)                                     \
-      self->not_reading = 1, errno = ECONNABORTED;             \
-    else                                                       \
-      BOTTLE_ASSERT3 (0, "Unexpected.\n", 1);                  \
-    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-    return ret;                                                \
   }                                                            \
 \
-  static int BOTTLE_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  static int QUEUE_PUSH_##TYPE (struct _queue_##TYPE *q, TYPE message) \
   {                                                            \
-    int ret = 0;                                               \
-    BOTTLE_ASSERT (mtx_lock (&self->mutex) == thrd_success);   \
-    if (self->closed && QUEUE_IS_EMPTY (self->queue))          \
-    {                                                          \
-      BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-      return self->not_reading = 1, errno = ECONNABORTED, ret; \
-    }                                                          \
-    if (self->capacity == 0 /* unbuffered */ && self->not_writing) \
+    TYPE *slot = QUEUE_SLOT_##TYPE (q);                        \
+    if (!slot)                                                 \
+      return 0;                                                \
+    *slot = message; /* copy */                                \
+    QUEUE_WRITTEN_##TYPE (q);                                  \
+    return 1;                                                  \
+  }                                                            \
+\
+  /* Views at most max of the first messages of the queue, as (at most two) contiguous spans. Returns the number of messages viewed. */ \
+  static size_t QUEUE_VIEW_##TYPE (struct _queue_##TYPE *q, size_t max, BOTTLE_VIEW_##TYPE *view) \
+  {                                                            \
+    *view = (BOTTLE_VIEW_##TYPE) { 0 };                        \
+    size_t size = QUEUE_SIZE (*q);                             \
+    if (size > max)                                            \
+      size = max;                                              \
+    if (!size)                                                 \
+      return 0;                                                \
+    if (q->segment)                                            \
     {                                                          \
-      BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-      return ret;                                              \
+      view->span[0].messages = q->reader_head;                 \
+      view->span[0].size = QUEUE_SEGMENT_SPAN_##TYPE (q);      \
+      if (view->span[0].size < size) /* continued in the next block */ \
+        view->span[1].messages = q->first->next->messages;     \
     }                                                          \
-    if (self->capacity == 0 /* unbuffered */ && !self->not_writing) \
+    else                                                       \
     {                                                          \
-      /* The thread declares it is attempting to read */       \
-      self->not_reading = 0;                                   \
-      BOTTLE_ASSERT (cnd_signal (&self->reading) == thrd_success); \
-      while (!self->closed && QUEUE_IS_EMPTY (self->queue))    \
-        BOTTLE_ASSERT (cnd_wait (&self->not_empty, &self->mutex) == thrd_success); \
-      self->not_writing = 1;                                   \
+      view->span[0].messages = q->buffer + q->head;            \
+      view->span[0].size = q->capacity - q->head;              \
+      if (view->span[0].size < size) /* wraps around */        \
+        view->span[1].messages = q->buffer;                    \
     }                                                          \
-    if (!QUEUE_IS_EMPTY (self->queue))                         \
+    if (view->span[0].size >= size)                            \
+      view->span[0].size = size;                               \
+    else                                                       \
+      view->span[1].size = size - view->span[0].size;          \
+    if (q->segment && view->span[1].size > q->segment)         \
+      view->span[1].size = q->segment;                         \
+    return view->span[0].size + view->span[1].size;            \
+  }                                                            \
+\
+  static void QUEUE_SHRINK_##TYPE (struct _queue_##TYPE *q)    \
+  {                                                            \
+    if (!q->unlimited || q->segment)                           \
+      return;                                                  \
+    size_t size = QUEUE_SIZE (*q);                             \
+    if (size > q->capacity / q->shrink || q->capacity <= q->floor) \
     {                                                          \
-      QUEUE_POP_##TYPE (&self->queue, message);                \
-      BOTTLE_ASSERT (cnd_signal (&self->not_full) == thrd_success); \
-      ret = 1;                                                 \
+      q->below = 0;                                            \
+      return;                                                  \
     }                                                          \
-    else if (self->closed)                                     \
+    if (q->below++ < q->delay) /* hysteresis */                \
+      return;                                                  \
+    q->below = 0;                                              \
+    size_t capacity = q->capacity / q->growth; /* one step back */ \
+    if (capacity < size)                                       \
+      capacity = size;                                         \
+    if (capacity < q->floor)                                   \
+      capacity = q->floor;                                     \
+    if (capacity < 1)                                          \
+      capacity = 1;                                            \
+    if (capacity >= q->capacity)                               \
+      return;                                                  \
+    /* The messages are gathered at the start of a smaller array */ \
+    TYPE *buffer;                                              \
+    BOTTLE_ASSERT (buffer = BOTTLE_ALLOC (&q->allocator, capacity * sizeof (*buffer), _Alignof (TYPE))); \
+    BOTTLE_VIEW_##TYPE view;                                   \
+    if (QUEUE_VIEW_##TYPE (q, size, &view))                    \
     {                                                          \
-      BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-      return self->not_reading = 1, errno = ECONNABORTED, ret; \
+      memcpy (buffer, view.span[0].messages, view.span[0].size * sizeof (*buffer)); \
+      if (view.span[1].size)                                   \
+        memcpy (buffer + view.span[0].size, view.span[1].messages, view.span[1].size * sizeof (*buffer)); \
     }                                                          \
-    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-    return ret;                                                \
+    BOTTLE_FREE (&q->allocator, q->buffer, q->capacity * sizeof (*q->buffer)); \
+    q->buffer = buffer;                                        \
+    q->capacity = capacity;                                    \
+    q->mask = QUEUE_MASK (capacity);                           \
+    q->read = 0;                                               \
+    q->write = size;                                           \
+    q->head = 0;                                               \
+    q->tail = QUEUE_WRAP (*q, size);                           \
+    q->resizes++;                                              \
   }                                                            \
 \
-  static void BOTTLE_PLUG_##TYPE (BOTTLE_##TYPE *self)         \
+  /* Removes the first n messages from the queue (once read). */ \
+  static void QUEUE_READ_##TYPE (struct _queue_##TYPE *q, size_t n) \
   {                                                            \
-    BOTTLE_ASSERT (mtx_lock (&self->mutex) == thrd_success);   \
-    self->frozen = 1;                                          \
-    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    if (!n)                                                    \
+      return;                                                  \
+    if (q->segment)                                            \
+    {                                                          \
+      while (n)                                                \
+      {                                                        \
+        size_t span = QUEUE_SEGMENT_SPAN_##TYPE (q);           \
+        if (span > n)                                          \
+          span = n;                                            \
+        QUEUE_SEGMENT_READ_##TYPE (q, span);                   \
+        n -= span;                                             \
+      }                                                        \
+      return;                                                  \
+    }                                                          \
+    q->read += n;                                              \
+    q->head = QUEUE_WRAP (*q, q->head + n);                    \
+    QUEUE_SHRINK_##TYPE (q);                                   \
   }                                                            \
 \
-  static void BOTTLE_UNPLUG_##TYPE (BOTTLE_##TYPE *self)       \
+  static int QUEUE_POP_##TYPE (struct _queue_##TYPE *q, TYPE *message) \
   {                                                            \
-    BOTTLE_ASSERT (mtx_lock (&self->mutex) == thrd_success);   \
-    self->frozen = 0;                                          \
-    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-    BOTTLE_ASSERT (cnd_signal (&self->not_full) == thrd_success); \
+    if (QUEUE_IS_EMPTY (*q))                                   \
+    {                                                          \
+      errno = EPERM;                                           \
+      return 0;                                                \
+    }                                                          \
+    *message = (q->segment ? *q->reader_head : q->buffer[q->head]); /* copy */ \
+    QUEUE_READ_##TYPE (q, 1);                                  \
+    return 1;                                                  \
+  }                                                            \
+\
+  /* Pushes as many of the n messages as fit, copied as (at most two) contiguous spans of the ring. */ \
+  static size_t QUEUE_PUSH_N_##TYPE (struct _queue_##TYPE *q, const TYPE *messages, size_t n) \
+  {                                                            \
+    size_t done = 0;                                           \
+    while (q->segment && done < n) /* one span per block */    \
+    {                                                          \
+      size_t span = QUEUE_SEGMENT_ROOM_##TYPE (q);             \
+      if (span > n - done)                                     \
+        span = n - done;                                       \
+      memcpy (q->writer_head, messages + done, span * sizeof (*q->writer_head)); /* copy */ \
+      QUEUE_SEGMENT_WRITTEN_##TYPE (q, span);                  \
+      done += span;                                            \
+    }                                                          \
+    while (done < n)                                           \
+    {                                                          \
+      if (QUEUE_IS_EXHAUSTED (*q))                             \
+      {                                                        \
+        if (q->capacity >= q->limit)                           \
+          break;                                               \
+        QUEUE_GROW_##TYPE (q);                                 \
+      }                                                        \
+      size_t tail = q->tail;                                   \
+      size_t span = q->capacity - QUEUE_SIZE (*q); /* free slots... */ \
+      if (span > q->capacity - tail) /* ... up to the end of the array */ \
+        span = q->capacity - tail;                             \
+      if (span > n - done)                                     \
+        span = n - done;                                       \
+      memcpy (q->buffer + tail, messages + done, span * sizeof (*q->buffer)); /* copy */ \
+      q->write += span;                                        \
+      q->tail = QUEUE_WRAP (*q, tail + span);                  \
+      done += span;                                            \
+    }                                                          \
+    return done;                                               \
+  }                                                            \
+\
+  /* Pops at most max messages, copied as contiguous spans of the queue. */ \
+  static size_t QUEUE_POP_N_##TYPE (struct _queue_##TYPE *q, TYPE *messages, size_t max) \
+  {                                                            \
+    size_t done = 0, k;                                        \
+    BOTTLE_VIEW_##TYPE view;                                   \
+    while (done < max && (k = QUEUE_VIEW_##TYPE (q, max - done, &view))) \
+    {                                                          \
+      memcpy (messages + done, view.span[0].messages, view.span[0].size * sizeof (*messages)); /* copy */ \
+      if (view.span[1].size)                                   \
+        memcpy (messages + done + view.span[0].size, view.span[1].messages, view.span[1].size * sizeof (*messages)); /* copy */ \
+      QUEUE_READ_##TYPE (q, k);                                \
+      done += k;                                               \
+    }                                                          \
+    return done;                                               \
+  }                                                            \
+\
+  void BOTTLE_INIT_STORAGE_##TYPE (BOTTLE_##TYPE *self, size_t capacity, const bottle_options *options, void *storage) \
+  {                                                            \
+    BOTTLE_ASSERT3 (!storage || (capacity != 0 && capacity != (size_t) -1), "A fixed bottle requires a limited capacity.\n", 1); \
+    if (options && options->power_of_two && capacity != 0 && capacity != (size_t) -1 && !storage) /* the storage can't be extended */ \
+      capacity = BOTTLE_POWER_OF_TWO (capacity);               \
+    BOTTLE_ASSERT3 (!options || options->engine != BOTTLE_BROADCAST || (capacity != 0 && capacity != (size_t) -1), \
+                    "A broadcast bottle requires a limited buffered capacity.\n", 1); \
+    BOTTLE_ASSERT3 (!options || options->engine != BOTTLE_PRIORITY || (capacity != 0 && capacity != (size_t) -1 && options->compare), \
+                    "A priority bottle requires a limited buffered capacity and a comparison function.\n", 1); \
+    BOTTLE_ASSERT3 (!options || !options->pollable || BOTTLE_CAN_POLL, "A pollable bottle requires BOTTLE_POLL.\n", 1); \
+    BOTTLE_ASSERT3 (!options || !options->pollable || options->engine == BOTTLE_MUTEX || options->engine == BOTTLE_PRIORITY, \
+                    "A pollable bottle requires the mutex or priority engine.\n", 1); \
+    self->vtable = &BOTTLE_VTABLE_##TYPE;                      \
+    self->engine = BOTTLE_MUTEX;                               \
+    /* The lock-free rings require a limited capacity */       \
+    if (options && capacity != 0 && capacity != (size_t) -1)   \
+      switch (options->engine)                                 \
+      {                                                        \
+        case BOTTLE_SPSC:                                      \
+          self->vtable = &BOTTLE_SPSC_VTABLE_##TYPE;           \
+          self->engine = BOTTLE_SPSC;                          \
+          break;                                               \
+        case BOTTLE_MPMC:                                      \
+          self->vtable = &BOTTLE_MPMC_VTABLE_##TYPE;           \
+          self->engine = BOTTLE_MPMC;                          \
+          break;                                               \
+        case BOTTLE_TWO_LOCK:                                  \
+          self->vtable = &BOTTLE_TWO_LOCK_VTABLE_##TYPE;       \
+          self->engine = BOTTLE_TWO_LOCK;                      \
+          break;                                               \
+        case BOTTLE_BROADCAST:                                 \
+          self->vtable = &BOTTLE_BROADCAST_VTABLE_##TYPE;      \
+          self->engine = BOTTLE_BROADCAST;                     \
+          break;                                               \
+        case BOTTLE_PRIORITY:                                  \
+          self->vtable = &BOTTLE_PRIORITY_VTABLE_##TYPE;       \
+          self->engine = BOTTLE_PRIORITY;                      \
+          break;                                               \
+        case BOTTLE_TOKEN:                                     \
+          self->vtable = &BOTTLE_TOKEN_VTABLE_##TYPE;          \
+          self->engine = BOTTLE_TOKEN;                         \
+          break;                                               \
+        default:                                               \
+          break;                                               \
+      }                                                        \
+    self->closed = 0;                                          \
+    self->frozen = 0;                                          \
+    self->spin = options ? options->spin : 0;                  \
+    self->batch.size = options ? options->wake_batch : 0;      \
+    self->batch.delay = options ? options->wake_delay : (struct timespec) { 0 }; \
+    if (!self->batch.delay.tv_sec && !self->batch.delay.tv_nsec) \
+      self->batch.delay.tv_nsec = 1000000; /* 1 millisecond */ \
+    self->batch.pending = 0;                                   \
+    self->__dummy__ = __dummy__##TYPE;                         \
+    BOTTLE_ASSERT (mtx_init (&self->mutex, mtx_plain) == thrd_success); \
+    BOTTLE_ASSERT (cnd_init (&self->not_empty) == thrd_success); \
+    BOTTLE_ASSERT (cnd_init (&self->not_full) == thrd_success);  \
+    self->rendezvous.senders.first = self->rendezvous.senders.last = 0; \
+    self->rendezvous.receivers.first = self->rendezvous.receivers.last = 0; \
+    atomic_init (&self->receivers_waiting, 0);                 \
+    atomic_init (&self->senders_waiting, 0);                   \
+    atomic_init (&self->changes, 0);                           \
+    self->watchers = 0;                                        \
+    self->subscribers = 0;                                     \
+    BOTTLE_STATS_INIT (self);                                  \
+    self->capacity = capacity;                                 \
+    /* MPMC uses cells instead, and a token bottle stores no message: their queue has no array */ \
+    QUEUE_INIT_##TYPE (&self->queue, self->engine == BOTTLE_MPMC || self->engine == BOTTLE_TOKEN ? 0 : capacity ? capacity : 1, options, \
+                       self->engine == BOTTLE_MPMC || self->engine == BOTTLE_TOKEN ? 0 : storage); \
+    self->queue.fixed = (storage != 0);                        \
+    self->poll.fd[0] = self->poll.fd[1] = -1;                  \
+    self->poll.ready[0] = self->poll.ready[1] = 0;             \
+    if (options && options->pollable && capacity != 0 && (self->engine == BOTTLE_MUTEX || self->engine == BOTTLE_PRIORITY)) \
+      BOTTLE_POLL_OPEN (self->poll.fd);                        \
+    BOTTLE_POLL_##TYPE (self); /* an empty bottle has room */  \
+    switch (self->engine) /* only the state private to the engine is initialised */ \
+    {                                                          \
+      case BOTTLE_SPSC:                                        \
+        atomic_init (&self->spsc.head, 0);                     \
+        atomic_init (&self->spsc.tail, 0);                     \
+        self->spsc.head_index = self->spsc.tail_index = 0;     \
+        break;                                                 \
+      case BOTTLE_MPMC:                                        \
+        self->mpmc.stride = sizeof (*self->mpmc.cells);        \
+        self->mpmc.mask = QUEUE_MASK (capacity);               \
+        atomic_init (&self->mpmc.enqueue_pos, 0);              \
+        atomic_init (&self->mpmc.dequeue_pos, 0);              \
+        if (storage) /* cells are packed in the storage of a fixed bottle */ \
+          self->mpmc.cells = storage;                          \
+        else if (BOTTLE_CACHE_LINE && options->padded_slots) /* one cell per cache line */ \
+        {                                                      \
+          self->mpmc.stride = BOTTLE_CACHE_PAD (self->mpmc.stride); \
+          BOTTLE_ASSERT (self->mpmc.cells = BOTTLE_ALLOC (&self->queue.allocator, capacity * self->mpmc.stride, BOTTLE_CACHE_LINE)); \
+        }                                                      \
+        else                                                   \
+          BOTTLE_ASSERT (self->mpmc.cells = BOTTLE_ALLOC (&self->queue.allocator, capacity * self->mpmc.stride, _Alignof (struct _cell_##TYPE))); \
+        for (size_t i = 0 ; i < capacity ; i++)                \
+          atomic_init (&MPMC_CELL_##TYPE (self, i)->sequence, 2 * i); \
+        break;                                                 \
+      case BOTTLE_TWO_LOCK:                                    \
+        BOTTLE_ASSERT (mtx_init (&self->two_lock.head_lock, mtx_plain) == thrd_success); \
+        atomic_init (&self->two_lock.size, 0);                 \
+        self->two_lock.head_index = self->two_lock.tail_index = 0; \
+        break;                                                 \
+      case BOTTLE_TOKEN:                                       \
+        atomic_init (&self->token.count, 0);                   \
+        break;                                                 \
+      case BOTTLE_PRIORITY:                                    \
+        self->priority.compare = options->compare;             \
+        self->priority.next = 0;                               \
+        if (storage) /* ranks follow the messages in the storage of a fixed bottle (as laid out by DECLARE_BOTTLE_FIXED) */ \
+          self->priority.ranks = (uint64_t *) ((char *) storage + \
+                                               (capacity * sizeof (TYPE) + _Alignof (uint64_t) - 1) / _Alignof (uint64_t) * _Alignof (uint64_t)); \
+        else                                                   \
+          BOTTLE_ASSERT (self->priority.ranks = BOTTLE_ALLOC (&self->queue.allocator, capacity * sizeof (*self->priority.ranks), _Alignof (uint64_t))); \
+        break;                                                 \
+      default: /* the mutex and broadcast engines keep their state in the queue */ \
+        break;                                                 \
+    }                                                          \
+  }                                                            \
+\
+  void BOTTLE_INIT_##TYPE (BOTTLE_##TYPE *self, size_t capacity, const bottle_options *options) \
+  {                                                            \
+    BOTTLE_INIT_STORAGE_##TYPE (self, capacity, options, 0);   \
+  }                                                            \
+\
+  BOTTLE_##TYPE *BOTTLE_CREATE_##TYPE (size_t capacity, const bottle_options *options) \
+  {                                                      \
+    BOTTLE_##TYPE *b = BOTTLE_ALLOC (options ? options->allocator : 0, sizeof (*b), _Alignof (BOTTLE_##TYPE)); \
+    BOTTLE_ASSERT (b);                                   \
+                                                         \
+    BOTTLE_INIT_##TYPE (b, capacity, options);           \
+                                                         \
+    return b;                                            \
+  }                                                      \
+\
+  /* Number of messages in the bottle (exact if the mutex is locked, or for the lock-free engines, a snapshot). */ \
+  static size_t BOTTLE_SIZE_##TYPE (BOTTLE_##TYPE *self)       \
+  {                                                            \
+    switch (self->engine)                                      \
+    {                                                          \
+      case BOTTLE_SPSC:                                        \
+      {                                                        \
+        size_t head = atomic_load (&self->spsc.head);  /* Before tail, which is never behind it */ \
+        return atomic_load (&self->spsc.tail) - head;          \
+      }                                                        \
+      case BOTTLE_MPMC:                                        \
+      {                                                        \
+        /* The receivers' ticket first, so that the senders' ticket can't be seen behind it; \
+           the senders may still have moved on meanwhile, hence the clamping. */ \
+        size_t dequeue = atomic_load (&self->mpmc.dequeue_pos); \
+        size_t enqueue = atomic_load (&self->mpmc.enqueue_pos) & ~MPMC_CLOSED; \
+        return enqueue < dequeue ? 0 : enqueue - dequeue > self->capacity ? self->capacity : enqueue - dequeue; \
+      }                                                        \
+      case BOTTLE_TWO_LOCK:                                    \
+        return atomic_load (&self->two_lock.size);             \
+      case BOTTLE_TOKEN:                                       \
+        return atomic_load (&self->token.count) & ~MPMC_CLOSED; \
+      default:                                                 \
+        return QUEUE_SIZE (self->queue);                       \
+    }                                                          \
+  }                                                            \
+\
+  /* Notifies the threads spinning on the bottle, and those waiting in bottle_select on it, that its state changed (the mutex being locked). */ \
+  static void BOTTLE_NOTIFY_##TYPE (BOTTLE_##TYPE *self)       \
+  {                                                            \
+    atomic_fetch_add_explicit (&self->changes, 1, memory_order_relaxed); \
+    for (bottle_case *c = self->watchers ; c ; c = c->next)    \
+    {                                                          \
+      BOTTLE_ASSERT (mtx_lock (&c->selector->mutex) == thrd_success); \
+      c->selector->ready = 1;                                  \
+      BOTTLE_ASSERT (cnd_signal (&c->selector->cond) == thrd_success); \
+      BOTTLE_ASSERT (mtx_unlock (&c->selector->mutex) == thrd_success); \
+    }                                                          \
+  }                                                            \
+\
+  /* Unbuffered bottles: rendez-vous with direct hand-off.
+     A thread which arrives first at the meeting point queues a waiter (on its stack) holding the address
+     of the message to send, or where to receive it, and waits on its own condition.
+     The peer copies the message straight from the sender to the receiver, and wakes up that waiter only. */ \
+  static void RENDEZVOUS_PUSH_##TYPE (struct _waiters_##TYPE *waiters, struct _waiter_##TYPE *waiter) \
+  {                                                            \
+    waiter->next = 0;                                          \
+    if (waiters->last)                                         \
+      waiters->last->next = waiter;                            \
+    else                                                       \
+      waiters->first = waiter;                                 \
+    waiters->last = waiter;                                    \
+  }                                                            \
+\
+  static void RENDEZVOUS_REMOVE_##TYPE (struct _waiters_##TYPE *waiters, struct _waiter_##TYPE *waiter) \
+  {                                                            \
+    struct _waiter_##TYPE *previous = 0;                       \
+    for (struct _waiter_##TYPE *w = waiters->first ; w ; previous = w, w = w->next) \
+      if (w == waiter)                                         \
+      {                                                        \
+        if (previous)                                          \
+          previous->next = w->next;                            \
+        else                                                   \
+          waiters->first = w->next;                            \
+        if (waiters->last == w)                                \
+          waiters->last = previous;                            \
+        break;                                                 \
+      }                                                        \
+  }                                                            \
+\
+  /* Releases the first waiter and returns the address of its message.
+     The message can still be copied as long as the mutex is locked, since the waiter can't leave before. */ \
+  static TYPE *RENDEZVOUS_RELEASE_##TYPE (BOTTLE_##TYPE *self, struct _waiters_##TYPE *waiters) \
+  {                                                            \
+    atomic_fetch_add_explicit (&self->changes, 1, memory_order_relaxed); /* the waiter may be spinning */ \
+    struct _waiter_##TYPE *waiter = waiters->first;            \
+    waiters->first = waiter->next;                             \
+    if (!waiters->first)                                       \
+      waiters->last = 0;                                       \
+    waiter->done = 1;                                          \
+    BOTTLE_ASSERT (cnd_signal (&waiter->cond) == thrd_success); \
+    return waiter->message;                                    \
+  }                                                            \
+\
+  /* Waits (the mutex being locked) for a peer to hand the message off. */ \
+  static int RENDEZVOUS_WAIT_##TYPE (BOTTLE_##TYPE *self, struct _waiters_##TYPE *waiters, TYPE *message, \
+                                     const struct timespec *deadline) \
+  {                                                            \
+    struct _waiter_##TYPE waiter = { .message = message, .done = 0 }; \
+    BOTTLE_ASSERT (cnd_init (&waiter.cond) == thrd_success);   \
+    RENDEZVOUS_PUSH_##TYPE (waiters, &waiter);                 \
+    BOTTLE_NOTIFY_##TYPE (self); /* a peer can now meet us */  \
+    BOTTLE_STATS_START (blocked, 1);                           \
+    BOTTLE_WAIT (self, &waiter.cond, !waiter.done && !self->closed, deadline); \
+    BOTTLE_STATS_STOP (self, blocked, waiters == &self->rendezvous.senders); \
+    if (!waiter.done)                                          \
+    {                                                          \
+      RENDEZVOUS_REMOVE_##TYPE (waiters, &waiter);             \
+      errno = self->closed ? ECONNABORTED : ETIMEDOUT;         \
+    }                                                          \
+    cnd_destroy (&waiter.cond);                                \
+    return waiter.done;                                        \
+  }                                                            \
+\
+  /* Takes the offer of a thread in bottle_select to receive (if send is set) or to send (otherwise), the mutex being locked, \
+     for the case c of the calling thread if it is in bottle_select itself (or 0). Returns the offer taken, or 0 if none. \
+     The thread which made the offer can't leave bottle_select before the mutex is unlocked (it stops watching the bottle first): \
+     the message can still be copied until then. */ \
+  static bottle_case *RENDEZVOUS_OFFER_##TYPE (BOTTLE_##TYPE *self, int send, bottle_case *c) \
+  {                                                            \
+    for (bottle_case *offer = self->watchers ; offer ; offer = offer->next) \
+      if (offer->send != send && (!c || offer->selector != c->selector) && BOTTLE_SELECT_CLAIM (c, offer)) \
+        return offer;                                          \
+    return 0;                                                  \
+  }                                                            \
+\
+  /* Meets a receiver, waiting at the meeting point or in bottle_select, or waits for one if block is set. \
+     c is the case of the calling thread if it is in bottle_select (or 0). */ \
+  static int RENDEZVOUS_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, int block, const struct timespec *deadline, bottle_case *c) \
+  {                                                            \
+    int ret = 0;                                               \
+    bottle_case *offer;                                        \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    BOTTLE_WAIT (self, &self->not_full, block && !self->closed && self->frozen, deadline); \
+    if (self->closed)                                          \
+      errno = ECONNABORTED;                                    \
+    else if (self->frozen)                                     \
+    {                                                          \
+      if (block) /* the deadline was reached */                \
+        errno = ETIMEDOUT;                                     \
+    }                                                          \
+    else if (self->rendezvous.receivers.first) /* a receiver is waiting */ \
+    {                                                          \
+      if ((ret = BOTTLE_SELECT_CLAIM (c, 0)))                  \
+        *RENDEZVOUS_RELEASE_##TYPE (self, &self->rendezvous.receivers) = *message; /* copy */ \
+    }                                                          \
+    else if ((offer = RENDEZVOUS_OFFER_##TYPE (self, 1, c))) /* a receiver is waiting in bottle_select */ \
+    {                                                          \
+      *(TYPE *) offer->message = *message; /* copy */          \
+      BOTTLE_COUNT (self, 0, 1, 0);                            \
+      ret = 1;                                                 \
+    }                                                          \
+    else if (block) /* blocks until there is another thread attempting to receive the message */ \
+      ret = RENDEZVOUS_WAIT_##TYPE (self, &self->rendezvous.senders, message, deadline); \
+    BOTTLE_COUNT (self, 1, (size_t) ret, 0);                   \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  /* Meets a sender, waiting at the meeting point or in bottle_select, or waits for one if block is set. \
+     c is the case of the calling thread if it is in bottle_select (or 0). */ \
+  static int RENDEZVOUS_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message, int block, const struct timespec *deadline, bottle_case *c) \
+  {                                                            \
+    int ret = 0;                                               \
+    bottle_case *offer;                                        \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (!self->frozen && self->rendezvous.senders.first) /* a sender is waiting */ \
+    {                                                          \
+      if ((ret = BOTTLE_SELECT_CLAIM (c, 0)))                  \
+        *message = *RENDEZVOUS_RELEASE_##TYPE (self, &self->rendezvous.senders); /* copy */ \
+    }                                                          \
+    else if (self->closed)                                     \
+      errno = ECONNABORTED;                                    \
+    else if (!self->frozen && (offer = RENDEZVOUS_OFFER_##TYPE (self, 0, c))) /* a sender is waiting in bottle_select */ \
+    {                                                          \
+      *message = *(TYPE *) offer->message; /* copy */          \
+      BOTTLE_COUNT (self, 1, 1, 0);                            \
+      ret = 1;                                                 \
+    }                                                          \
+    else if (block) /* blocks until there is another thread attempting to send a message */ \
+      ret = RENDEZVOUS_WAIT_##TYPE (self, &self->rendezvous.receivers, message, deadline); \
+    BOTTLE_COUNT (self, 0, (size_t) ret, 0);                   \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  /* Makes the descriptors of readiness of a pollable bottle readable or not, on the edges of its state (the mutex being locked): \
+     to receive while the bottle is not empty, to send while it is not full nor plugged, and both once it is closed. */ \
+  static void BOTTLE_POLL_##TYPE (BOTTLE_##TYPE *self)         \
+  {                                                            \
+    if (self->poll.fd[0] < 0)                                  \
+      return;                                                  \
+    int ready[2] = { self->closed || !QUEUE_IS_EMPTY (self->queue), \
+                     self->closed || (!self->frozen && !QUEUE_IS_FULL (self->queue)) }; \
+    for (int i = 0 ; i < 2 ; i++)                              \
+      if (ready[i] != self->poll.ready[i])                     \
+        BOTTLE_POLL_SET (self->poll.fd[i], self->poll.ready[i] = ready[i]); \
+  }                                                            \
+\
+  /* Whether receivers parked on not_empty should be woken up (the mutex they park with being locked): \
+     always, unless the wake batch of the bottle is not complete yet. The first message of a batch starts its delay, \
+     and wakes a receiver up to wait for it (see BOTTLE_PARK). */ \
+  static int BOTTLE_BATCH_READY_##TYPE (BOTTLE_##TYPE *self)   \
+  {                                                            \
+    if (self->batch.size <= 1 || self->closed)                 \
+      return 1;                                                \
+    size_t size = BOTTLE_SIZE_##TYPE (self);                   \
+    if (size >= self->batch.size || size >= self->capacity)    \
+    {                                                          \
+      self->batch.pending = 0;                                 \
+      return 1;                                                \
+    }                                                          \
+    if (self->batch.pending)                                   \
+      return 0;                                                \
+    self->batch.pending = 1;                                   \
+    BOTTLE_DEADLINE (&self->batch.end, &self->batch.delay); \
+    return 1;                                                  \
+  }                                                            \
+\
+  /* Wakes up threads parked on cond (not_empty or not_full), the mutex being locked, after k messages (or slots) were made available. \
+     Nothing is signaled if no thread is parked. The descriptors of readiness are updated anyway. */ \
+  static void BOTTLE_SIGNAL_##TYPE (BOTTLE_##TYPE *self, cnd_t *cond, size_t k) \
+  {                                                            \
+    BOTTLE_POLL_##TYPE (self);                                 \
+    int waiting = atomic_load_explicit (BOTTLE_WAITING (self, cond), memory_order_relaxed); \
+    if (!waiting || !k || (cond == &self->not_empty && !BOTTLE_BATCH_READY_##TYPE (self))) \
+      return;                                                  \
+    if (k > 1 && waiting > 1)                                  \
+      BOTTLE_ASSERT (cnd_broadcast (cond) == thrd_success);    \
+    else                                                       \
+      BOTTLE_ASSERT (cnd_signal (cond) == thrd_success);       \
+  }                                                            \
+\
+  static int BOTTLE_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return BOTTLE_FILL_UNTIL_##TYPE (self, message, 0);        \
+  }                                                            \
+\
+  static int BOTTLE_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline) \
+  {                                                            \
+    if (self->capacity == 0) /* unbuffered */                  \
+      return RENDEZVOUS_FILL_##TYPE (self, &message, 1, deadline, 0); \
+    int ret = 0;                                               \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    BOTTLE_WAIT (self, &self->not_full,                        \
+                 !self->closed && (self->frozen || QUEUE_IS_FULL (self->queue)), deadline); \
+    if (self->closed)                                          \
+      errno = ECONNABORTED;                                    \
+    else if (!self->frozen && !QUEUE_IS_FULL (self->queue))    \
+    {                                                          \
+      QUEUE_PUSH_##TYPE (&self->queue, message);               \
+      BOTTLE_COUNT (self, 1, 1, QUEUE_SIZE (self->queue));     \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_empty, 1);        \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+      ret = 1;                                                 \
+    }                                                          \
+    else /* the deadline was reached */                        \
+      errno = ETIMEDOUT;                                       \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static int BOTTLE_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    if (self->capacity == 0) /* unbuffered */                  \
+      return RENDEZVOUS_FILL_##TYPE (self, &message, 0, 0, 0);    \
+    int ret = 0;                                               \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (self->closed)                                          \
+      errno = ECONNABORTED;                                    \
+    else if (!self->frozen && !QUEUE_IS_FULL (self->queue))    \
+    {                                                          \
+      QUEUE_PUSH_##TYPE (&self->queue, message);               \
+      BOTTLE_COUNT (self, 1, 1, QUEUE_SIZE (self->queue));     \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_empty, 1);        \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+      ret = 1;                                                 \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static int BOTTLE_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return BOTTLE_DRAIN_UNTIL_##TYPE (self, message, 0);       \
+  }                                                            \
+\
+  static int BOTTLE_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline) \
+  {                                                            \
+    if (self->capacity == 0) /* unbuffered */                  \
+      return RENDEZVOUS_DRAIN_##TYPE (self, message, 1, deadline, 0); \
+    int ret = 0;                                               \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    BOTTLE_WAIT (self, &self->not_empty, !self->closed && QUEUE_IS_EMPTY (self->queue), deadline); \
+    if (!QUEUE_IS_EMPTY (self->queue))                         \
+    {                                                          \
+      QUEUE_POP_##TYPE (&self->queue, message);                \
+      BOTTLE_COUNT (self, 0, 1, QUEUE_SIZE (self->queue));     \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_full, 1);         \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+      ret = 1;                                                 \
+    }                                                          \
+    else if (self->closed)                                     \
+      errno = ECONNABORTED;                                    \
+    else /* the deadline was reached */                        \
+      errno = ETIMEDOUT;                                       \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static int BOTTLE_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    if (self->capacity == 0) /* unbuffered */                  \
+      return RENDEZVOUS_DRAIN_##TYPE (self, message, 0, 0, 0);    \
+    int ret = 0;                                               \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (!QUEUE_IS_EMPTY (self->queue))                         \
+    {                                                          \
+      QUEUE_POP_##TYPE (&self->queue, message);                \
+      BOTTLE_COUNT (self, 0, 1, QUEUE_SIZE (self->queue));     \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_full, 1);         \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+      ret = 1;                                                 \
+    }                                                          \
+    else if (self->closed)                                     \
+      errno = ECONNABORTED;                                    \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static size_t BOTTLE_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    size_t ret = 0;                                            \
+    if (self->capacity == 0) /* unbuffered: one rendez-vous per message */ \
+    {                                                          \
+      while (ret < n && BOTTLE_FILL_##TYPE (self, messages[ret])) \
+        ret++;                                                 \
+      return ret;                                              \
+    }                                                          \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    while (ret < n)                                            \
+    {                                                          \
+      BOTTLE_WAIT (self, &self->not_full,                      \
+                   !self->closed && (self->frozen || QUEUE_IS_FULL (self->queue)), 0); \
+      if (self->closed)                                        \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        break;                                                 \
+      }                                                        \
+      size_t k = QUEUE_PUSH_N_##TYPE (&self->queue, messages + ret, n - ret); \
+      BOTTLE_COUNT (self, 1, k, QUEUE_SIZE (self->queue));     \
+      ret += k;                                                \
+      /* One wakeup for the whole batch */                     \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_empty, k);        \
+      if (k)                                                   \
+        BOTTLE_NOTIFY_##TYPE (self);                           \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static size_t BOTTLE_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    size_t ret = 0;                                            \
+    if (self->capacity == 0) /* unbuffered: one rendez-vous per message */ \
+    {                                                          \
+      while (ret < n && BOTTLE_TRY_FILL_##TYPE (self, messages[ret])) \
+        ret++;                                                 \
+      return ret;                                              \
+    }                                                          \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (self->closed)                                          \
+      errno = ECONNABORTED;                                    \
+    else if (!self->frozen)                                    \
+    {                                                          \
+      ret = QUEUE_PUSH_N_##TYPE (&self->queue, messages, n);   \
+      BOTTLE_COUNT (self, 1, ret, QUEUE_SIZE (self->queue));   \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_empty, ret);      \
+      if (ret)                                                 \
+        BOTTLE_NOTIFY_##TYPE (self);                           \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static size_t BOTTLE_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    size_t ret = 0;                                            \
+    if (!max)                                                  \
+      return ret;                                              \
+    if (self->capacity == 0) /* unbuffered: one rendez-vous, then whatever senders are waiting */ \
+    {                                                          \
+      if (BOTTLE_DRAIN_##TYPE (self, messages))                \
+        for (ret = 1 ; ret < max && BOTTLE_TRY_DRAIN_##TYPE (self, messages + ret) ; ret++) \
+          /* */ ;                                              \
+      return ret;                                              \
+    }                                                          \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    BOTTLE_WAIT (self, &self->not_empty, !self->closed && QUEUE_IS_EMPTY (self->queue), 0); \
+    if (!QUEUE_IS_EMPTY (self->queue))                         \
+    {                                                          \
+      ret = QUEUE_POP_N_##TYPE (&self->queue, messages, max);  \
+      BOTTLE_COUNT (self, 0, ret, QUEUE_SIZE (self->queue));   \
+      /* One wakeup for the whole batch */                     \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_full, ret);       \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+    }                                                          \
+    else if (self->closed)                                     \
+      errno = ECONNABORTED;                                    \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static size_t BOTTLE_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    size_t ret = 0;                                            \
+    if (self->capacity == 0) /* unbuffered: only senders already waiting can be met */ \
+    {                                                          \
+      while (ret < max && BOTTLE_TRY_DRAIN_##TYPE (self, messages + ret)) \
+        ret++;                                                 \
+      return ret;                                              \
+    }                                                          \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (!QUEUE_IS_EMPTY (self->queue))                         \
+    {                                                          \
+      ret = QUEUE_POP_N_##TYPE (&self->queue, messages, max);  \
+      BOTTLE_COUNT (self, 0, ret, QUEUE_SIZE (self->queue));   \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_full, ret);       \
+      if (ret)                                                 \
+        BOTTLE_NOTIFY_##TYPE (self);                           \
+    }                                                          \
+    else if (self->closed)                                     \
+      errno = ECONNABORTED;                                    \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  /* The mutex stays locked from a successful reservation until the message is committed (also for the broadcast and priority engines): \
+     every other sender and receiver of the bottle is blocked for as long as the message takes to be built. */ \
+  static TYPE *BOTTLE_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block) \
+  {                                                            \
+    if (self->capacity == 0) /* unbuffered: no slot to write in */ \
+    {                                                          \
+      errno = EPERM;                                           \
+      return 0;                                                \
+    }                                                          \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (block)                                                 \
+      BOTTLE_WAIT (self, &self->not_full,                      \
+                   !self->closed && (self->frozen || QUEUE_IS_FULL (self->queue)), 0); \
+    if (self->closed)                                          \
+      errno = ECONNABORTED;                                    \
+    else if (!self->frozen && !QUEUE_IS_FULL (self->queue))    \
+      return QUEUE_SLOT_##TYPE (&self->queue);                 \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return 0;                                                  \
+  }                                                            \
+\
+  static void BOTTLE_COMMIT_##TYPE (BOTTLE_##TYPE *self)       \
+  {                                                            \
+    QUEUE_WRITTEN_##TYPE (&self->queue);                       \
+    BOTTLE_COUNT (self, 1, 1, QUEUE_SIZE (self->queue));       \
+    BOTTLE_SIGNAL_##TYPE (self, &self->not_empty, 1);          \
+    BOTTLE_NOTIFY_##TYPE (self);                               \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+  }                                                            \
+\
+  /* The mutex stays locked from a successful acquisition until the messages are released: \
+     every other sender and receiver of the bottle is blocked for as long as the messages take to be read. */ \
+  static size_t BOTTLE_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block) \
+  {                                                            \
+    *view = (BOTTLE_VIEW_##TYPE) { 0 };                        \
+    if (self->capacity == 0) /* unbuffered: no slot to read from */ \
+    {                                                          \
+      errno = EPERM;                                           \
+      return 0;                                                \
+    }                                                          \
+    if (!max)                                                  \
+      return 0;                                                \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (block)                                                 \
+      BOTTLE_WAIT (self, &self->not_empty, !self->closed && QUEUE_IS_EMPTY (self->queue), 0); \
+    if (!QUEUE_IS_EMPTY (self->queue))                         \
+      return QUEUE_VIEW_##TYPE (&self->queue, max, view);      \
+    if (self->closed)                                          \
+      errno = ECONNABORTED;                                    \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return 0;                                                  \
+  }                                                            \
+\
+  static void BOTTLE_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    if (k)                                                     \
+    {                                                          \
+      QUEUE_READ_##TYPE (&self->queue, k);                     \
+      BOTTLE_COUNT (self, 0, k, QUEUE_SIZE (self->queue));     \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_full, k);         \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+  }                                                            \
+\
+  /* Lock-free single-producer/single-consumer engine.
+     The sender owns tail and the receiver owns head: both are published with release semantics
+     and read with acquire semantics. The mutex and conditions are only used to park a thread on a full or empty ring. */ \
+  /* Wakes up threads parked on a condition after k messages (or slots) were made available.
+     The fence pairs with the one of a parking thread: either it sees the new state of the ring or we see it waiting. */ \
+  static void BOTTLE_WAKE_##TYPE (BOTTLE_##TYPE *self, cnd_t *cond, atomic_int *waiting, size_t k) \
+  {                                                            \
+    atomic_thread_fence (memory_order_seq_cst);                \
+    if (!atomic_load_explicit (waiting, memory_order_relaxed)) \
+      return;                                                  \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (cond == &self->not_full || BOTTLE_BATCH_READY_##TYPE (self)) \
+    {                                                          \
+      if (k > 1)                                               \
+        BOTTLE_ASSERT (cnd_broadcast (cond) == thrd_success);  \
+      else                                                     \
+        BOTTLE_ASSERT (cnd_signal (cond) == thrd_success);     \
+    }                                                          \
+    BOTTLE_NOTIFY_##TYPE (self);                               \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+  }                                                            \
+\
+  static void RING_WRITE_##TYPE (struct _queue_##TYPE *q, size_t index, const TYPE *messages, size_t n) \
+  {                                                            \
+    size_t first = q->capacity - index;                        \
+    if (first > n)                                             \
+      first = n;                                               \
+    memcpy (q->buffer + index, messages, first * sizeof (*q->buffer)); /* copy */ \
+    memcpy (q->buffer, messages + first, (n - first) * sizeof (*q->buffer)); /* copy */ \
+  }                                                            \
+\
+  static void RING_READ_##TYPE (struct _queue_##TYPE *q, size_t index, TYPE *messages, size_t n) \
+  {                                                            \
+    size_t first = q->capacity - index;                        \
+    if (first > n)                                             \
+      first = n;                                               \
+    memcpy (messages, q->buffer + index, first * sizeof (*q->buffer)); /* copy */ \
+    memcpy (messages + first, q->buffer, (n - first) * sizeof (*q->buffer)); /* copy */ \
+  }                                                            \
+\
+  static size_t RING_VIEW_##TYPE (struct _queue_##TYPE *q, size_t index, size_t n, BOTTLE_VIEW_##TYPE *view) \
+  {                                                            \
+    size_t first = q->capacity - index;                        \
+    if (first > n)                                             \
+      first = n;                                               \
+    view->span[0].messages = q->buffer + index;                \
+    view->span[0].size = first;                                \
+    view->span[1].messages = q->buffer;                        \
+    view->span[1].size = n - first;                            \
+    return n;                                                  \
+  }                                                            \
+\
+  /* Returns the number of free slots of the ring (waiting for some if block is set), or 0 if none (errno is then set if closed or timed out). */ \
+  static size_t BOTTLE_SPSC_ROOM_##TYPE (BOTTLE_##TYPE *self, int block, const struct timespec *deadline) \
+  {                                                            \
+    size_t spins = 0;                                          \
+    for (;;)                                                   \
+    {                                                          \
+      if (self->closed)                                        \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        return 0;                                              \
+      }                                                        \
+      size_t tail = atomic_load_explicit (&self->spsc.tail, memory_order_relaxed); \
+      size_t room = self->queue.capacity - (tail - atomic_load_explicit (&self->spsc.head, memory_order_acquire)); \
+      if (room && !self->frozen)                               \
+        return room;                                           \
+      if (!block)                                              \
+        return 0;                                              \
+      if (spins < self->spin) /* spin before parking */        \
+      {                                                        \
+        spins++;                                               \
+        BOTTLE_PAUSE ();                                       \
+        continue;                                              \
+      }                                                        \
+      if (deadline && BOTTLE_DEADLINE_REACHED (deadline))      \
+      {                                                        \
+        errno = ETIMEDOUT;                                     \
+        return 0;                                              \
+      }                                                        \
+      /* The ring is full (or plugged): park */                \
+      BOTTLE_LOCK (self, &self->mutex);                        \
+      atomic_fetch_add (&self->senders_waiting, 1);            \
+      atomic_thread_fence (memory_order_seq_cst);              \
+      BOTTLE_PARK (self, &self->mutex, &self->not_full, !self->closed && \
+                   (self->frozen || tail - atomic_load (&self->spsc.head) == self->queue.capacity), deadline); \
+      atomic_fetch_sub (&self->senders_waiting, 1);            \
+      BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    }                                                          \
+  }                                                            \
+\
+  /* Publishes k messages written at the tail of the ring. */  \
+  static void BOTTLE_SPSC_WRITTEN_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    self->spsc.tail_index = QUEUE_WRAP (self->queue, self->spsc.tail_index + k); \
+    atomic_store_explicit (&self->spsc.tail, atomic_load_explicit (&self->spsc.tail, memory_order_relaxed) + k, \
+                           memory_order_release);              \
+    BOTTLE_COUNT (self, 1, k, BOTTLE_SIZE_##TYPE (self));      \
+    BOTTLE_WAKE_##TYPE (self, &self->not_empty, &self->receivers_waiting, k); \
+  }                                                            \
+\
+  static size_t BOTTLE_SPSC_PUSH_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n, int block, \
+                                        const struct timespec *deadline) \
+  {                                                            \
+    size_t done = 0;                                           \
+    size_t room;                                               \
+    while (done < n && (room = BOTTLE_SPSC_ROOM_##TYPE (self, block, deadline))) \
+    {                                                          \
+      size_t k = (room < n - done ? room : n - done);          \
+      RING_WRITE_##TYPE (&self->queue, self->spsc.tail_index, messages + done, k); \
+      BOTTLE_SPSC_WRITTEN_##TYPE (self, k);                    \
+      done += k;                                               \
+    }                                                          \
+    return done;                                               \
+  }                                                            \
+\
+  /* Returns the number of messages in the ring (waiting for some if block is set), or 0 if none (errno is then set if closed or timed out). */ \
+  static size_t BOTTLE_SPSC_AVAILABLE_##TYPE (BOTTLE_##TYPE *self, int block, const struct timespec *deadline) \
+  {                                                            \
+    size_t spins = 0;                                          \
+    for (;;)                                                   \
+    {                                                          \
+      size_t head = atomic_load_explicit (&self->spsc.head, memory_order_relaxed); \
+      size_t available = atomic_load_explicit (&self->spsc.tail, memory_order_acquire) - head; \
+      if (available)                                           \
+        return available;                                      \
+      if (self->closed)                                        \
+      {                                                        \
+        /* A message might have been sent just before closing */ \
+        if (atomic_load (&self->spsc.tail) != head)            \
+          continue;                                            \
+        errno = ECONNABORTED;                                  \
+        return 0;                                              \
+      }                                                        \
+      if (!block)                                              \
+        return 0;                                              \
+      if (spins < self->spin) /* spin before parking */        \
+      {                                                        \
+        spins++;                                               \
+        BOTTLE_PAUSE ();                                       \
+        continue;                                              \
+      }                                                        \
+      if (deadline && BOTTLE_DEADLINE_REACHED (deadline))      \
+      {                                                        \
+        errno = ETIMEDOUT;                                     \
+        return 0;                                              \
+      }                                                        \
+      /* The ring is empty: park */                            \
+      BOTTLE_LOCK (self, &self->mutex);                        \
+      atomic_fetch_add (&self->receivers_waiting, 1);          \
+      atomic_thread_fence (memory_order_seq_cst);              \
+      BOTTLE_PARK (self, &self->mutex, &self->not_empty, !self->closed && atomic_load (&self->spsc.tail) == head, deadline); \
+      atomic_fetch_sub (&self->receivers_waiting, 1);          \
+      BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    }                                                          \
+  }                                                            \
+\
+  /* Frees k messages read at the head of the ring. */         \
+  static void BOTTLE_SPSC_READ_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    self->spsc.head_index = QUEUE_WRAP (self->queue, self->spsc.head_index + k); \
+    atomic_store_explicit (&self->spsc.head, atomic_load_explicit (&self->spsc.head, memory_order_relaxed) + k, \
+                           memory_order_release);              \
+    BOTTLE_COUNT (self, 0, k, BOTTLE_SIZE_##TYPE (self));      \
+    BOTTLE_WAKE_##TYPE (self, &self->not_full, &self->senders_waiting, k); \
+  }                                                            \
+\
+  static size_t BOTTLE_SPSC_POP_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max, int block, \
+                                       const struct timespec *deadline) \
+  {                                                            \
+    size_t available;                                          \
+    if (!max || !(available = BOTTLE_SPSC_AVAILABLE_##TYPE (self, block, deadline))) \
+      return 0;                                                \
+    size_t k = (available < max ? available : max);            \
+    RING_READ_##TYPE (&self->queue, self->spsc.head_index, messages, k); \
+    BOTTLE_SPSC_READ_##TYPE (self, k);                         \
+    return k;                                                  \
+  }                                                            \
+\
+  static int BOTTLE_SPSC_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_SPSC_PUSH_##TYPE (self, &message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_SPSC_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_SPSC_PUSH_##TYPE (self, &message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_SPSC_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_SPSC_POP_##TYPE (self, message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_SPSC_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_SPSC_POP_##TYPE (self, message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_SPSC_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_SPSC_PUSH_##TYPE (self, &message, 1, 1, deadline); \
+  }                                                            \
+\
+  static int BOTTLE_SPSC_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_SPSC_POP_##TYPE (self, message, 1, 1, deadline); \
+  }                                                            \
+\
+  static size_t BOTTLE_SPSC_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_SPSC_PUSH_##TYPE (self, messages, n, 1, 0);  \
+  }                                                            \
+\
+  static size_t BOTTLE_SPSC_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_SPSC_PUSH_##TYPE (self, messages, n, 0, 0);  \
+  }                                                            \
+\
+  static size_t BOTTLE_SPSC_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_SPSC_POP_##TYPE (self, messages, max, 1, 0); \
+  }                                                            \
+\
+  static size_t BOTTLE_SPSC_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_SPSC_POP_##TYPE (self, messages, max, 0, 0); \
+  }                                                            \
+\
+  static TYPE *BOTTLE_SPSC_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block) \
+  {                                                            \
+    return BOTTLE_SPSC_ROOM_##TYPE (self, block, 0) ? self->queue.buffer + self->spsc.tail_index : 0; \
+  }                                                            \
+\
+  static void BOTTLE_SPSC_COMMIT_##TYPE (BOTTLE_##TYPE *self)  \
+  {                                                            \
+    BOTTLE_SPSC_WRITTEN_##TYPE (self, 1);                      \
+  }                                                            \
+\
+  static size_t BOTTLE_SPSC_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block) \
+  {                                                            \
+    *view = (BOTTLE_VIEW_##TYPE) { 0 };                        \
+    size_t available;                                          \
+    if (!max || !(available = BOTTLE_SPSC_AVAILABLE_##TYPE (self, block, 0))) \
+      return 0;                                                \
+    return RING_VIEW_##TYPE (&self->queue, self->spsc.head_index, available < max ? available : max, view); \
+  }                                                            \
+\
+  static void BOTTLE_SPSC_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    if (k)                                                     \
+      BOTTLE_SPSC_READ_##TYPE (self, k);                       \
+  }                                                            \
+\
+  /* Lock-free multi-producer/multi-consumer engine (bounded ring with per-cell sequence numbers, after D. Vyukov).
+     Senders and receivers claim tickets on enqueue_pos and dequeue_pos. The sequence of a cell is twice the ticket
+     allowed to write it, then twice the ticket plus one once the message can be read by the holder of the same ticket
+     (doubling keeps both states distinct even for a capacity of 1).
+     Closing sets the highest bit of enqueue_pos, so that no ticket can be claimed afterwards. */ \
+  static int MPMC_CLAIM_SEND_##TYPE (BOTTLE_##TYPE *self, struct _cell_##TYPE **cell) /* 1: claimed, 0: full or plugged, -1: closed */ \
+  {                                                            \
+    size_t pos = atomic_load_explicit (&self->mpmc.enqueue_pos, memory_order_relaxed); \
+    for (;;)                                                   \
+    {                                                          \
+      if (pos & MPMC_CLOSED)                                   \
+        return -1;                                             \
+      if (self->frozen)                                        \
+        return 0;                                              \
+      *cell = MPMC_CELL_##TYPE (self, pos);                    \
+      ptrdiff_t dif = (ptrdiff_t) (atomic_load_explicit (&(*cell)->sequence, memory_order_acquire) - 2 * pos); \
+      if (dif == 0)                                            \
+      {                                                        \
+        if (atomic_compare_exchange_weak_explicit (&self->mpmc.enqueue_pos, &pos, pos + 1, \
+                                                   memory_order_relaxed, memory_order_relaxed)) \
+          return 1;                                            \
+      }                                                        \
+      else if (dif < 0) /* not yet received */                 \
+        return 0;                                              \
+      else                                                     \
+        pos = atomic_load_explicit (&self->mpmc.enqueue_pos, memory_order_relaxed); \
+    }                                                          \
+  }                                                            \
+\
+  static int MPMC_ENQUEUE_##TYPE (BOTTLE_##TYPE *self, const TYPE *message) /* 1: sent, 0: full or plugged, -1: closed */ \
+  {                                                            \
+    struct _cell_##TYPE *cell;                                 \
+    int r = MPMC_CLAIM_SEND_##TYPE (self, &cell);              \
+    if (r > 0)                                                 \
+    {                                                          \
+      cell->message = *message; /* copy */                     \
+      atomic_store_explicit (&cell->sequence, atomic_load_explicit (&cell->sequence, memory_order_relaxed) + 1, \
+                             memory_order_release);            \
+      BOTTLE_COUNT (self, 1, 1, BOTTLE_SIZE_##TYPE (self));    \
+    }                                                          \
+    return r;                                                  \
+  }                                                            \
+\
+  static int MPMC_CLAIM_RECV_##TYPE (BOTTLE_##TYPE *self, struct _cell_##TYPE **cell) /* 1: claimed, 0: empty (or not yet sent), -1: empty and closed */ \
+  {                                                            \
+    size_t pos = atomic_load_explicit (&self->mpmc.dequeue_pos, memory_order_relaxed); \
+    for (;;)                                                   \
+    {                                                          \
+      *cell = MPMC_CELL_##TYPE (self, pos);                    \
+      ptrdiff_t dif = (ptrdiff_t) (atomic_load_explicit (&(*cell)->sequence, memory_order_acquire) - (2 * pos + 1)); \
+      if (dif == 0)                                            \
+      {                                                        \
+        if (atomic_compare_exchange_weak_explicit (&self->mpmc.dequeue_pos, &pos, pos + 1, \
+                                                   memory_order_relaxed, memory_order_relaxed)) \
+          return 1;                                            \
+      }                                                        \
+      else if (dif < 0) /* not yet sent */                     \
+      {                                                        \
+        size_t enqueue_pos = atomic_load (&self->mpmc.enqueue_pos); \
+        if ((enqueue_pos & ~MPMC_CLOSED) == pos)               \
+          return (enqueue_pos & MPMC_CLOSED) ? -1 : 0;         \
+        size_t head = atomic_load_explicit (&self->mpmc.dequeue_pos, memory_order_relaxed); \
+        if (head == pos) /* claimed by a sender still copying its message: never wait for it here (the blocking callers back off) */ \
+          return 0;                                            \
+        pos = head; /* claimed by another receiver meanwhile */ \
+      }                                                        \
+      else                                                     \
+        pos = atomic_load_explicit (&self->mpmc.dequeue_pos, memory_order_relaxed); \
+    }                                                          \
+  }                                                            \
+\
+  /* Hands the cell (read by the holder of the ticket pos) over to the sender of the ticket pos + capacity. */ \
+  static void MPMC_FREE_##TYPE (BOTTLE_##TYPE *self, struct _cell_##TYPE *cell) \
+  {                                                            \
+    atomic_store_explicit (&cell->sequence, atomic_load_explicit (&cell->sequence, memory_order_relaxed) - 1 + 2 * self->capacity, \
+                           memory_order_release);              \
+    BOTTLE_COUNT (self, 0, 1, BOTTLE_SIZE_##TYPE (self));      \
+  }                                                            \
+\
+  static int MPMC_DEQUEUE_##TYPE (BOTTLE_##TYPE *self, TYPE *message) /* 1: received, 0: empty, -1: empty and closed */ \
+  {                                                            \
+    struct _cell_##TYPE *cell;                                 \
+    int r = MPMC_CLAIM_RECV_##TYPE (self, &cell);              \
+    if (r > 0)                                                 \
+    {                                                          \
+      *message = cell->message; /* copy */                     \
+      MPMC_FREE_##TYPE (self, cell);                           \
+    }                                                          \
+    return r;                                                  \
+  }                                                            \
+\
+  static int MPMC_IS_FULL_##TYPE (BOTTLE_##TYPE *self)         \
+  {                                                            \
+    size_t pos = atomic_load (&self->mpmc.enqueue_pos) & ~MPMC_CLOSED; \
+    return (ptrdiff_t) (atomic_load (&MPMC_CELL_##TYPE (self, pos)->sequence) - 2 * pos) < 0; \
+  }                                                            \
+\
+  static int MPMC_IS_EMPTY_##TYPE (BOTTLE_##TYPE *self)        \
+  {                                                            \
+    size_t pos = atomic_load (&self->mpmc.dequeue_pos);        \
+    return (ptrdiff_t) (atomic_load (&MPMC_CELL_##TYPE (self, pos)->sequence) - (2 * pos + 1)) < 0; \
+  }                                                            \
+\
+  /* Spins, or parks until the ring is no longer full (send) or empty (!send). Returns 0 if the deadline was reached. */ \
+  static int BOTTLE_MPMC_BACKOFF_##TYPE (BOTTLE_##TYPE *self, int send, size_t *spins, const struct timespec *deadline) \
+  {                                                            \
+    if (*spins < self->spin) /* spin before parking */         \
+    {                                                          \
+      (*spins)++;                                              \
+      BOTTLE_PAUSE ();                                         \
+      return 1;                                                \
+    }                                                          \
+    if (deadline && BOTTLE_DEADLINE_REACHED (deadline))        \
+    {                                                          \
+      errno = ETIMEDOUT;                                       \
+      return 0;                                                \
+    }                                                          \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (send) /* the ring is full (or plugged): park */        \
+    {                                                          \
+      atomic_fetch_add (&self->senders_waiting, 1);            \
+      atomic_thread_fence (memory_order_seq_cst);              \
+      BOTTLE_PARK (self, &self->mutex, &self->not_full, !self->closed && (self->frozen || MPMC_IS_FULL_##TYPE (self)), deadline); \
+      atomic_fetch_sub (&self->senders_waiting, 1);            \
+    }                                                          \
+    else /* the ring is empty: park */                         \
+    {                                                          \
+      atomic_fetch_add (&self->receivers_waiting, 1);          \
+      atomic_thread_fence (memory_order_seq_cst);              \
+      BOTTLE_PARK (self, &self->mutex, &self->not_empty, !self->closed && MPMC_IS_EMPTY_##TYPE (self), deadline); \
+      atomic_fetch_sub (&self->receivers_waiting, 1);          \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return 1;                                                  \
+  }                                                            \
+\
+  static size_t BOTTLE_MPMC_PUSH_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n, int block, \
+                                        const struct timespec *deadline) \
+  {                                                            \
+    size_t done = 0;                                           \
+    size_t spins = 0;                                          \
+    while (done < n)                                           \
+    {                                                          \
+      size_t k = 0;                                            \
+      int r = 0;                                               \
+      while (done + k < n && (r = MPMC_ENQUEUE_##TYPE (self, messages + done + k)) > 0) \
+        k++;                                                   \
+      done += k;                                               \
+      if (k)                                                   \
+        BOTTLE_WAKE_##TYPE (self, &self->not_empty, &self->receivers_waiting, k); \
+      if (r < 0)                                               \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        break;                                                 \
+      }                                                        \
+      if (done == n || !block || !BOTTLE_MPMC_BACKOFF_##TYPE (self, 1, &spins, deadline)) \
+        break;                                                 \
+    }                                                          \
+    return done;                                               \
+  }                                                            \
+\
+  static size_t BOTTLE_MPMC_POP_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max, int block, \
+                                       const struct timespec *deadline) \
+  {                                                            \
+    size_t done = 0;                                           \
+    size_t spins = 0;                                          \
+    while (max)                                                \
+    {                                                          \
+      int r = 0;                                               \
+      while (done < max && (r = MPMC_DEQUEUE_##TYPE (self, messages + done)) > 0) \
+        done++;                                                \
+      if (done)                                                \
+      {                                                        \
+        BOTTLE_WAKE_##TYPE (self, &self->not_full, &self->senders_waiting, done); \
+        break;                                                 \
+      }                                                        \
+      if (r < 0)                                               \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        break;                                                 \
+      }                                                        \
+      if (!block || !BOTTLE_MPMC_BACKOFF_##TYPE (self, 0, &spins, deadline)) \
+        break;                                                 \
+    }                                                          \
+    return done;                                               \
+  }                                                            \
+\
+  static int BOTTLE_MPMC_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_MPMC_PUSH_##TYPE (self, &message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_MPMC_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_MPMC_PUSH_##TYPE (self, &message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_MPMC_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_MPMC_POP_##TYPE (self, message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_MPMC_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_MPMC_POP_##TYPE (self, message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_MPMC_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_MPMC_PUSH_##TYPE (self, &message, 1, 1, deadline); \
+  }                                                            \
+\
+  static int BOTTLE_MPMC_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_MPMC_POP_##TYPE (self, message, 1, 1, deadline); \
+  }                                                            \
+\
+  static size_t BOTTLE_MPMC_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_MPMC_PUSH_##TYPE (self, messages, n, 1, 0);  \
+  }                                                            \
+\
+  static size_t BOTTLE_MPMC_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_MPMC_PUSH_##TYPE (self, messages, n, 0, 0);  \
+  }                                                            \
+\
+  static size_t BOTTLE_MPMC_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_MPMC_POP_##TYPE (self, messages, max, 1, 0); \
+  }                                                            \
+\
+  static size_t BOTTLE_MPMC_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_MPMC_POP_##TYPE (self, messages, max, 0, 0); \
+  }                                                            \
+\
+  static void BOTTLE_MPMC_CLOSE_##TYPE (BOTTLE_##TYPE *self)   \
+  {                                                            \
+    atomic_fetch_or (&self->mpmc.enqueue_pos, MPMC_CLOSED);    \
+    BOTTLE_CLOSE_##TYPE (self);                                \
+  }                                                            \
+\
+  /* Cells claimed by the calling thread, from reservation to commit and from acquisition to release, by bottle \
+     (the thread can hold claims on BOTTLE_MPMC_CLAIMS bottles at once). Cells are not contiguous: a view holds a single message. */ \
+  struct _mpmc_claim_##TYPE                                    \
+  {                                                            \
+    BOTTLE_##TYPE *bottle;                                     \
+    struct _cell_##TYPE *cell;                                 \
+  };                                                           \
+  static thread_local struct _mpmc_claim_##TYPE MPMC_RESERVED_##TYPE[BOTTLE_MPMC_CLAIMS], MPMC_ACQUIRED_##TYPE[BOTTLE_MPMC_CLAIMS]; \
+\
+  /* Claim of the calling thread on the bottle, or 0 if none (an unused one if add is set, or 0 with errno set to EBUSY if none is left). */ \
+  static struct _mpmc_claim_##TYPE *MPMC_HELD_##TYPE (struct _mpmc_claim_##TYPE *claims, BOTTLE_##TYPE *self, int add) \
+  {                                                            \
+    struct _mpmc_claim_##TYPE *unused = 0;                     \
+    for (size_t i = 0 ; i < BOTTLE_MPMC_CLAIMS ; i++)          \
+      if (claims[i].bottle == self)                            \
+        return &claims[i];                                     \
+      else if (!claims[i].bottle && !unused)                   \
+        unused = &claims[i];                                   \
+    if (add && !unused) /* too many bottles claimed by the thread (see BOTTLE_MPMC_CLAIMS) */ \
+      errno = EBUSY;                                           \
+    return add ? unused : 0;                                   \
+  }                                                            \
+\
+  static TYPE *BOTTLE_MPMC_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block) \
+  {                                                            \
+    if (MPMC_HELD_##TYPE (MPMC_RESERVED_##TYPE, self, 0)) /* the slot reserved before is not committed yet */ \
+    {                                                          \
+      errno = EPERM;                                           \
+      return 0;                                                \
+    }                                                          \
+    struct _mpmc_claim_##TYPE *claim = MPMC_HELD_##TYPE (MPMC_RESERVED_##TYPE, self, 1); \
+    if (!claim)                                                \
+      return 0;                                                \
+    size_t spins = 0;                                          \
+    int r;                                                     \
+    while (!(r = MPMC_CLAIM_SEND_##TYPE (self, &claim->cell)) && block && \
+           BOTTLE_MPMC_BACKOFF_##TYPE (self, 1, &spins, 0))    \
+      /* retry */ ;                                            \
+    if (r > 0)                                                 \
+    {                                                          \
+      claim->bottle = self;                                    \
+      return &claim->cell->message;                            \
+    }                                                          \
+    if (r < 0)                                                 \
+      errno = ECONNABORTED;                                    \
+    return 0;                                                  \
+  }                                                            \
+\
+  static void BOTTLE_MPMC_COMMIT_##TYPE (BOTTLE_##TYPE *self)  \
+  {                                                            \
+    struct _mpmc_claim_##TYPE *claim = MPMC_HELD_##TYPE (MPMC_RESERVED_##TYPE, self, 0); \
+    if (!claim) /* nothing reserved */                         \
+    {                                                          \
+      errno = EPERM;                                           \
+      return;                                                  \
+    }                                                          \
+    struct _cell_##TYPE *cell = claim->cell;                   \
+    claim->bottle = 0;                                         \
+    atomic_store_explicit (&cell->sequence, atomic_load_explicit (&cell->sequence, memory_order_relaxed) + 1, \
+                           memory_order_release);              \
+    BOTTLE_COUNT (self, 1, 1, BOTTLE_SIZE_##TYPE (self));      \
+    BOTTLE_WAKE_##TYPE (self, &self->not_empty, &self->receivers_waiting, 1); \
+  }                                                            \
+\
+  static size_t BOTTLE_MPMC_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block) \
+  {                                                            \
+    *view = (BOTTLE_VIEW_##TYPE) { 0 };                        \
+    if (!max)                                                  \
+      return 0;                                                \
+    if (MPMC_HELD_##TYPE (MPMC_ACQUIRED_##TYPE, self, 0)) /* the message acquired before is not released yet */ \
+    {                                                          \
+      errno = EPERM;                                           \
+      return 0;                                                \
+    }                                                          \
+    struct _mpmc_claim_##TYPE *claim = MPMC_HELD_##TYPE (MPMC_ACQUIRED_##TYPE, self, 1); \
+    if (!claim)                                                \
+      return 0;                                                \
+    size_t spins = 0;                                          \
+    int r;                                                     \
+    while (!(r = MPMC_CLAIM_RECV_##TYPE (self, &claim->cell)) && block && \
+           BOTTLE_MPMC_BACKOFF_##TYPE (self, 0, &spins, 0))    \
+      /* retry */ ;                                            \
+    if (r > 0)                                                 \
+    {                                                          \
+      claim->bottle = self;                                    \
+      view->span[0].messages = &claim->cell->message;          \
+      view->span[0].size = 1;                                  \
+      return 1;                                                \
+    }                                                          \
+    if (r < 0)                                                 \
+      errno = ECONNABORTED;                                    \
+    return 0;                                                  \
+  }                                                            \
+\
+  /* The ticket is claimed: the message can't be left in the ring. Releasing none of it is refused (errno is set to EPERM) \
+     and the message stays acquired, to be released later. */  \
+  static void BOTTLE_MPMC_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    struct _mpmc_claim_##TYPE *claim = MPMC_HELD_##TYPE (MPMC_ACQUIRED_##TYPE, self, 0); \
+    if (!claim || !k) /* nothing acquired, or released */      \
+    {                                                          \
+      errno = EPERM;                                           \
+      return;                                                  \
+    }                                                          \
+    claim->bottle = 0;                                         \
+    MPMC_FREE_##TYPE (self, claim->cell);                      \
+    BOTTLE_WAKE_##TYPE (self, &self->not_full, &self->senders_waiting, 1); \
+  }                                                            \
+\
+  /* Two-lock engine (after M. Michael and M. Scott).          \
+     Senders serialise on the mutex (the tail lock) and receivers on head_lock, so that both sides \
+     do not contend with each other as long as the ring is neither empty nor full. \
+     The number of messages in the ring is atomic: as for the lock-free engines, a thread only takes the lock \
+     of the other side to wake up threads parked on it, and only if some are waiting. */ \
+  /* Returns the number of free slots of the ring (waiting for some if block is set), or 0 if none (errno is then set if closed or timed out). \
+     The mutex is locked. */                                   \
+  static size_t BOTTLE_TWO_LOCK_ROOM_##TYPE (BOTTLE_##TYPE *self, int block, const struct timespec *deadline) \
+  {                                                            \
+    size_t spins = 0;                                          \
+    for (;;)                                                   \
+    {                                                          \
+      if (self->closed)                                        \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        return 0;                                              \
+      }                                                        \
+      size_t size = atomic_load (&self->two_lock.size);        \
+      if (size < self->queue.capacity && !self->frozen)        \
+        return self->queue.capacity - size;                    \
+      if (!block)                                              \
+        return 0;                                              \
+      if (spins < self->spin) /* spin before parking, on the atomic state without the lock, then lock it again once */ \
+      {                                                        \
+        BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+        for ( ; spins < self->spin && !self->closed && (self->frozen || atomic_load_explicit (&self->two_lock.size, memory_order_relaxed) == self->queue.capacity) ; spins++) \
+          BOTTLE_PAUSE ();                                     \
+        spins = self->spin;                                    \
+        BOTTLE_LOCK (self, &self->mutex);                      \
+        continue;                                              \
+      }                                                        \
+      if (deadline && BOTTLE_DEADLINE_REACHED (deadline))      \
+      {                                                        \
+        errno = ETIMEDOUT;                                     \
+        return 0;                                              \
+      }                                                        \
+      /* The ring is full (or plugged): park */                \
+      atomic_fetch_add (&self->senders_waiting, 1);            \
+      BOTTLE_PARK (self, &self->mutex, &self->not_full, !self->closed && \
+                   (self->frozen || atomic_load (&self->two_lock.size) == self->queue.capacity), deadline); \
+      atomic_fetch_sub (&self->senders_waiting, 1);            \
+    }                                                          \
+  }                                                            \
+\
+  /* Publishes k messages written at the tail of the ring (the mutex being locked). */ \
+  static void BOTTLE_TWO_LOCK_WRITTEN_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    self->two_lock.tail_index = QUEUE_WRAP (self->queue, self->two_lock.tail_index + k); \
+    atomic_fetch_add (&self->two_lock.size, k);                \
+    BOTTLE_COUNT (self, 1, k, BOTTLE_SIZE_##TYPE (self));      \
+    if (atomic_load (&self->receivers_waiting)) /* the lock order is mutex, then head_lock */ \
+    {                                                          \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+      BOTTLE_LOCK (self, &self->two_lock.head_lock);           \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_empty, k);        \
+      BOTTLE_ASSERT (mtx_unlock (&self->two_lock.head_lock) == thrd_success); \
+    }                                                          \
+  }                                                            \
+\
+  static size_t BOTTLE_TWO_LOCK_PUSH_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n, int block, \
+                                            const struct timespec *deadline) \
+  {                                                            \
+    size_t done = 0;                                           \
+    size_t room;                                               \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    while (done < n && (room = BOTTLE_TWO_LOCK_ROOM_##TYPE (self, block, deadline))) \
+    {                                                          \
+      size_t k = (room < n - done ? room : n - done);          \
+      RING_WRITE_##TYPE (&self->queue, self->two_lock.tail_index, messages + done, k); \
+      BOTTLE_TWO_LOCK_WRITTEN_##TYPE (self, k);                \
+      done += k;                                               \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return done;                                               \
+  }                                                            \
+\
+  /* Returns the number of messages in the ring (waiting for some if block is set), or 0 if none (errno is then set if closed or timed out). \
+     The head_lock is locked. */                               \
+  static size_t BOTTLE_TWO_LOCK_AVAILABLE_##TYPE (BOTTLE_##TYPE *self, int block, const struct timespec *deadline) \
+  {                                                            \
+    size_t spins = 0;                                          \
+    for (;;)                                                   \
+    {                                                          \
+      size_t size = atomic_load (&self->two_lock.size);        \
+      if (size)                                                \
+        return size;                                           \
+      if (self->closed)                                        \
+      {                                                        \
+        /* A message might have been sent just before closing */ \
+        if (atomic_load (&self->two_lock.size))                \
+          continue;                                            \
+        errno = ECONNABORTED;                                  \
+        return 0;                                              \
+      }                                                        \
+      if (!block)                                              \
+        return 0;                                              \
+      if (spins < self->spin) /* spin before parking, on the atomic state without the lock, then lock it again once */ \
+      {                                                        \
+        BOTTLE_ASSERT (mtx_unlock (&self->two_lock.head_lock) == thrd_success); \
+        for ( ; spins < self->spin && !self->closed && !atomic_load_explicit (&self->two_lock.size, memory_order_relaxed) ; spins++) \
+          BOTTLE_PAUSE ();                                     \
+        spins = self->spin;                                    \
+        BOTTLE_LOCK (self, &self->two_lock.head_lock);         \
+        continue;                                              \
+      }                                                        \
+      if (deadline && BOTTLE_DEADLINE_REACHED (deadline))      \
+      {                                                        \
+        errno = ETIMEDOUT;                                     \
+        return 0;                                              \
+      }                                                        \
+      /* The ring is empty: park */                            \
+      atomic_fetch_add (&self->receivers_waiting, 1);          \
+      BOTTLE_PARK (self, &self->two_lock.head_lock, &self->not_empty, \
+                   !self->closed && !atomic_load (&self->two_lock.size), deadline); \
+      atomic_fetch_sub (&self->receivers_waiting, 1);          \
+    }                                                          \
+  }                                                            \
+\
+  /* Frees k messages read at the head of the ring (the head_lock being locked). */ \
+  static void BOTTLE_TWO_LOCK_READ_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    self->two_lock.head_index = QUEUE_WRAP (self->queue, self->two_lock.head_index + k); \
+    atomic_fetch_sub (&self->two_lock.size, k);                \
+    BOTTLE_COUNT (self, 0, k, BOTTLE_SIZE_##TYPE (self));      \
+  }                                                            \
+\
+  static size_t BOTTLE_TWO_LOCK_POP_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max, int block, \
+                                           const struct timespec *deadline) \
+  {                                                            \
+    size_t done = 0;                                           \
+    size_t available;                                          \
+    BOTTLE_LOCK (self, &self->two_lock.head_lock);             \
+    if (max && (available = BOTTLE_TWO_LOCK_AVAILABLE_##TYPE (self, block, deadline))) \
+    {                                                          \
+      done = (available < max ? available : max);              \
+      RING_READ_##TYPE (&self->queue, self->two_lock.head_index, messages, done); \
+      BOTTLE_TWO_LOCK_READ_##TYPE (self, done);                \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->two_lock.head_lock) == thrd_success); \
+    if (done)                                                  \
+      BOTTLE_WAKE_##TYPE (self, &self->not_full, &self->senders_waiting, done); \
+    return done;                                               \
+  }                                                            \
+\
+  static int BOTTLE_TWO_LOCK_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_TWO_LOCK_PUSH_##TYPE (self, &message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_TWO_LOCK_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_TWO_LOCK_PUSH_##TYPE (self, &message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_TWO_LOCK_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_TWO_LOCK_POP_##TYPE (self, message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_TWO_LOCK_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_TWO_LOCK_POP_##TYPE (self, message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_TWO_LOCK_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_TWO_LOCK_PUSH_##TYPE (self, &message, 1, 1, deadline); \
+  }                                                            \
+\
+  static int BOTTLE_TWO_LOCK_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_TWO_LOCK_POP_##TYPE (self, message, 1, 1, deadline); \
+  }                                                            \
+\
+  static size_t BOTTLE_TWO_LOCK_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_TWO_LOCK_PUSH_##TYPE (self, messages, n, 1, 0); \
+  }                                                            \
+\
+  static size_t BOTTLE_TWO_LOCK_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_TWO_LOCK_PUSH_##TYPE (self, messages, n, 0, 0); \
+  }                                                            \
+\
+  static size_t BOTTLE_TWO_LOCK_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_TWO_LOCK_POP_##TYPE (self, messages, max, 1, 0); \
+  }                                                            \
+\
+  static size_t BOTTLE_TWO_LOCK_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_TWO_LOCK_POP_##TYPE (self, messages, max, 0, 0); \
+  }                                                            \
+\
+  /* The mutex stays locked from a successful reservation until the message is committed: \
+     every other sender is blocked for as long as the message takes to be built (receivers are not). */ \
+  static TYPE *BOTTLE_TWO_LOCK_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block) \
+  {                                                            \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (BOTTLE_TWO_LOCK_ROOM_##TYPE (self, block, 0))          \
+      return self->queue.buffer + self->two_lock.tail_index;   \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return 0;                                                  \
+  }                                                            \
+\
+  static void BOTTLE_TWO_LOCK_COMMIT_##TYPE (BOTTLE_##TYPE *self) \
+  {                                                            \
+    BOTTLE_TWO_LOCK_WRITTEN_##TYPE (self, 1);                  \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+  }                                                            \
+\
+  /* The head_lock stays locked from a successful acquisition until the messages are released: \
+     every other receiver is blocked for as long as the messages take to be read (senders are not). */ \
+  static size_t BOTTLE_TWO_LOCK_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block) \
+  {                                                            \
+    *view = (BOTTLE_VIEW_##TYPE) { 0 };                        \
+    if (!max)                                                  \
+      return 0;                                                \
+    BOTTLE_LOCK (self, &self->two_lock.head_lock);             \
+    size_t available = BOTTLE_TWO_LOCK_AVAILABLE_##TYPE (self, block, 0); \
+    if (available)                                             \
+      return RING_VIEW_##TYPE (&self->queue, self->two_lock.head_index, available < max ? available : max, view); \
+    BOTTLE_ASSERT (mtx_unlock (&self->two_lock.head_lock) == thrd_success); \
+    return 0;                                                  \
+  }                                                            \
+\
+  static void BOTTLE_TWO_LOCK_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    if (k)                                                     \
+      BOTTLE_TWO_LOCK_READ_##TYPE (self, k);                   \
+    BOTTLE_ASSERT (mtx_unlock (&self->two_lock.head_lock) == thrd_success); \
+    if (k)                                                     \
+      BOTTLE_WAKE_##TYPE (self, &self->not_full, &self->senders_waiting, k); \
+  }                                                            \
+\
+  static void BOTTLE_TWO_LOCK_CLOSE_##TYPE (BOTTLE_##TYPE *self) \
+  {                                                            \
+    BOTTLE_CLOSE_##TYPE (self);                                \
+    /* Receivers check closed under head_lock */               \
+    BOTTLE_LOCK (self, &self->two_lock.head_lock);             \
+    if (atomic_load (&self->receivers_waiting))                \
+      BOTTLE_ASSERT (cnd_broadcast (&self->not_empty) == thrd_success); \
+    BOTTLE_ASSERT (mtx_unlock (&self->two_lock.head_lock) == thrd_success); \
+  }                                                            \
+\
+  /* Broadcast engine: every subscriber reads all the messages of a single ring, at its own cursor. */ \
+  /* The read counter of the queue follows the slowest subscriber, which alone gates the senders. */ \
+\
+  /* Moves the read counter of the queue to the cursor of the slowest subscriber (the mutex being locked). */ \
+  static void BOTTLE_BROADCAST_GATE_##TYPE (BOTTLE_##TYPE *self) \
+  {                                                            \
+    uint64_t slowest = self->queue.write; /* no subscriber: no message is kept */ \
+    for (BOTTLE_SUBSCRIBER_##TYPE *s = self->subscribers ; s ; s = s->next) \
+      if (s->cursor < slowest)                                 \
+        slowest = s->cursor;                                   \
+    if (slowest == self->queue.read)                           \
+      return;                                                  \
+    size_t k = (size_t) (slowest - self->queue.read);          \
+    self->queue.read = slowest;                                \
+    self->queue.head = QUEUE_WRAP (self->queue, self->queue.head + k); \
+    BOTTLE_SIGNAL_##TYPE (self, &self->not_full, k);           \
+    BOTTLE_NOTIFY_##TYPE (self);                               \
+  }                                                            \
+\
+  /* Makes the messages just written visible to all the subscribers (the mutex being locked). */ \
+  static void BOTTLE_BROADCAST_PUBLISHED_##TYPE (BOTTLE_##TYPE *self) \
+  {                                                            \
+    if (!self->subscribers) /* nobody to read them */          \
+    {                                                          \
+      self->queue.read = self->queue.write;                    \
+      self->queue.head = self->queue.tail;                     \
+    }                                                          \
+    else if (atomic_load_explicit (&self->receivers_waiting, memory_order_relaxed) && BOTTLE_BATCH_READY_##TYPE (self)) \
+      BOTTLE_ASSERT (cnd_broadcast (&self->not_empty) == thrd_success); /* every subscriber reads every message */ \
+    BOTTLE_NOTIFY_##TYPE (self);                               \
+  }                                                            \
+\
+  static size_t BOTTLE_BROADCAST_PUSH_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n, int block, \
+                                             const struct timespec *deadline) \
+  {                                                            \
+    size_t ret = 0;                                            \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    while (ret < n)                                            \
+    {                                                          \
+      if (block)                                               \
+        BOTTLE_WAIT (self, &self->not_full,                    \
+                     !self->closed && (self->frozen || QUEUE_IS_FULL (self->queue)), deadline); \
+      if (self->closed)                                        \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        break;                                                 \
+      }                                                        \
+      if (self->frozen || QUEUE_IS_FULL (self->queue))         \
+      {                                                        \
+        if (block) /* the deadline was reached */              \
+          errno = ETIMEDOUT;                                   \
+        break;                                                 \
+      }                                                        \
+      size_t k = QUEUE_PUSH_N_##TYPE (&self->queue, messages + ret, n - ret); \
+      ret += k;                                                \
+      BOTTLE_BROADCAST_PUBLISHED_##TYPE (self);                \
+      BOTTLE_COUNT (self, 1, k, QUEUE_SIZE (self->queue));     \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static int BOTTLE_BROADCAST_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_BROADCAST_PUSH_##TYPE (self, &message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_BROADCAST_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_BROADCAST_PUSH_##TYPE (self, &message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_BROADCAST_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_BROADCAST_PUSH_##TYPE (self, &message, 1, 1, deadline); \
+  }                                                            \
+\
+  static size_t BOTTLE_BROADCAST_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_BROADCAST_PUSH_##TYPE (self, messages, n, 1, 0); \
+  }                                                            \
+\
+  static size_t BOTTLE_BROADCAST_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_BROADCAST_PUSH_##TYPE (self, messages, n, 0, 0); \
+  }                                                            \
+\
+  /* The mutex stays locked from a successful reservation (BOTTLE_RESERVE) until the message is committed. */ \
+  static void BOTTLE_BROADCAST_COMMIT_##TYPE (BOTTLE_##TYPE *self) \
+  {                                                            \
+    QUEUE_WRITTEN_##TYPE (&self->queue);                       \
+    BOTTLE_BROADCAST_PUBLISHED_##TYPE (self);                  \
+    BOTTLE_COUNT (self, 1, 1, QUEUE_SIZE (self->queue));       \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+  }                                                            \
+\
+  /* The messages of a broadcast bottle are received by its subscribers only (see BOTTLE_READ). */ \
+  static int BOTTLE_BROADCAST_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    (void) self;                                               \
+    (void) message;                                            \
+    errno = EPERM;                                             \
+    return 0;                                                  \
+  }                                                            \
+\
+  static int BOTTLE_BROADCAST_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline) \
+  {                                                            \
+    (void) deadline;                                           \
+    return BOTTLE_BROADCAST_DRAIN_##TYPE (self, message);      \
+  }                                                            \
+\
+  static size_t BOTTLE_BROADCAST_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    (void) max;                                                \
+    return (size_t) BOTTLE_BROADCAST_DRAIN_##TYPE (self, messages); \
+  }                                                            \
+\
+  static size_t BOTTLE_BROADCAST_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block) \
+  {                                                            \
+    (void) max;                                                \
+    (void) block;                                              \
+    *view = (BOTTLE_VIEW_##TYPE) { 0 };                        \
+    return (size_t) BOTTLE_BROADCAST_DRAIN_##TYPE (self, 0);   \
+  }                                                            \
+\
+  static void BOTTLE_BROADCAST_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    (void) self;                                               \
+    (void) k;                                                  \
+  }                                                            \
+\
+  /* The subscriber joins a broadcast bottle: it will read all the messages sent from now on. */ \
+  static int BOTTLE_SUBSCRIBE_##TYPE (BOTTLE_##TYPE *self, BOTTLE_SUBSCRIBER_##TYPE *subscriber) \
+  {                                                            \
+    if (self->engine != BOTTLE_BROADCAST)                      \
+    {                                                          \
+      errno = EPERM;                                           \
+      return 0;                                                \
+    }                                                          \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    subscriber->bottle = self;                                 \
+    subscriber->cursor = self->queue.write;                    \
+    subscriber->next = self->subscribers;                      \
+    self->subscribers = subscriber;                            \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return 1;                                                  \
+  }                                                            \
+\
+  /* Removes the subscriber from the list of the bottle (the mutex being locked). */ \
+  static void BOTTLE_BROADCAST_LEAVE_##TYPE (BOTTLE_##TYPE *self, BOTTLE_SUBSCRIBER_##TYPE *subscriber) \
+  {                                                            \
+    for (BOTTLE_SUBSCRIBER_##TYPE **s = &self->subscribers ; *s ; s = &(*s)->next) \
+      if (*s == subscriber)                                    \
+      {                                                        \
+        *s = subscriber->next;                                 \
+        break;                                                 \
+      }                                                        \
+    subscriber->bottle = 0;                                    \
+    BOTTLE_BROADCAST_GATE_##TYPE (self);                       \
+  }                                                            \
+                                                               \
+  /* The subscriber leaves the bottle: the messages it did not read are freed for the senders (unless other subscribers lag behind). */ \
+  static void BOTTLE_UNSUBSCRIBE_##TYPE (BOTTLE_SUBSCRIBER_##TYPE *subscriber) \
+  {                                                            \
+    BOTTLE_##TYPE *self = subscriber->bottle;                  \
+    if (!self) /* already left */                              \
+      return;                                                  \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    BOTTLE_BROADCAST_LEAVE_##TYPE (self, subscriber);          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+  }                                                            \
+\
+  static int BOTTLE_READ_##TYPE (BOTTLE_SUBSCRIBER_##TYPE *subscriber, TYPE *message, int block, const struct timespec *deadline) \
+  {                                                            \
+    BOTTLE_##TYPE *self = subscriber->bottle;                  \
+    if (!self) /* the subscriber has left */                   \
+    {                                                          \
+      errno = ECONNABORTED;                                    \
+      return 0;                                                \
+    }                                                          \
+    int ret = 0;                                               \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (block)                                                 \
+      BOTTLE_WAIT (self, &self->not_empty, !self->closed && subscriber->cursor == self->queue.write, deadline); \
+    if (subscriber->cursor != self->queue.write)               \
+    {                                                          \
+      *message = self->queue.buffer[QUEUE_INDEX (self->queue, subscriber->cursor)]; /* copy */ \
+      if (subscriber->cursor++ == self->queue.read) /* the slowest subscriber moves on */ \
+        BOTTLE_BROADCAST_GATE_##TYPE (self);                   \
+      BOTTLE_COUNT (self, 0, 1, QUEUE_SIZE (self->queue));     \
+      ret = 1;                                                 \
+    }                                                          \
+    else if (self->closed) /* all read: the subscriber leaves the bottle */ \
+    {                                                          \
+      BOTTLE_BROADCAST_LEAVE_##TYPE (self, subscriber);        \
+      errno = ECONNABORTED;                                    \
+    }                                                          \
+    else if (block) /* the deadline was reached */             \
+      errno = ETIMEDOUT;                                       \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  /* Priority engine: the queue is a heap (with BOTTLE_HEAP_ARITY children per node) stored at the start of the array, */ \
+  /* read and head staying 0, write and tail being the number of messages. The most urgent message is at the root, buffer[0]. */ \
+  /* Messages which compare equal are ordered by rank of arrival: they are received first-in first-out. */ \
+\
+  /* Tells whether the message a, of rank ra, must be received before the message b, of rank rb. */ \
+  static int BOTTLE_PRIORITY_BEFORE_##TYPE (BOTTLE_##TYPE *self, const TYPE *a, uint64_t ra, const TYPE *b, uint64_t rb) \
+  {                                                            \
+    int c = self->priority.compare (a, b);                     \
+    return c < 0 || (c == 0 && ra < rb);                       \
+  }                                                            \
+\
+  /* Inserts the message just written after the last one into the heap (the mutex being locked). */ \
+  static void BOTTLE_PRIORITY_WRITTEN_##TYPE (BOTTLE_##TYPE *self) \
+  {                                                            \
+    TYPE *heap = self->queue.buffer;                           \
+    uint64_t *ranks = self->priority.ranks;                    \
+    size_t i = (size_t) self->queue.write++;                   \
+    self->queue.tail = i + 1; /* where the next message is reserved */ \
+    TYPE message = heap[i];                                    \
+    uint64_t rank = self->priority.next++;                     \
+    while (i > 0) /* sift up */                                \
+    {                                                          \
+      size_t parent = (i - 1) / BOTTLE_HEAP_ARITY;             \
+      if (!BOTTLE_PRIORITY_BEFORE_##TYPE (self, &message, rank, heap + parent, ranks[parent])) \
+        break;                                                 \
+      heap[i] = heap[parent];                                  \
+      ranks[i] = ranks[parent];                                \
+      i = parent;                                              \
+    }                                                          \
+    heap[i] = message;                                         \
+    ranks[i] = rank;                                           \
+    BOTTLE_COUNT (self, 1, 1, QUEUE_SIZE (self->queue));       \
+  }                                                            \
+\
+  /* Removes the message at the root of the heap (the mutex being locked). */ \
+  static void BOTTLE_PRIORITY_READ_##TYPE (BOTTLE_##TYPE *self) \
+  {                                                            \
+    TYPE *heap = self->queue.buffer;                           \
+    uint64_t *ranks = self->priority.ranks;                    \
+    size_t size = (size_t) --self->queue.write;                \
+    self->queue.tail = size;                                   \
+    BOTTLE_COUNT (self, 0, 1, size);                           \
+    if (!size)                                                 \
+      return;                                                  \
+    TYPE message = heap[size]; /* the last message replaces the root */ \
+    uint64_t rank = ranks[size];                               \
+    size_t i = 0;                                              \
+    for (size_t child ; (child = i * BOTTLE_HEAP_ARITY + 1) < size ; i = child) /* sift down */ \
+    {                                                          \
+      for (size_t c = child + 1 ; c < size && c <= i * BOTTLE_HEAP_ARITY + BOTTLE_HEAP_ARITY ; c++) \
+        if (BOTTLE_PRIORITY_BEFORE_##TYPE (self, heap + c, ranks[c], heap + child, ranks[child])) \
+          child = c;                                           \
+      if (!BOTTLE_PRIORITY_BEFORE_##TYPE (self, heap + child, ranks[child], &message, rank)) \
+        break;                                                 \
+      heap[i] = heap[child];                                   \
+      ranks[i] = ranks[child];                                 \
+    }                                                          \
+    heap[i] = message;                                         \
+    ranks[i] = rank;                                           \
+  }                                                            \
+\
+  static size_t BOTTLE_PRIORITY_PUSH_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n, int block, \
+                                            const struct timespec *deadline) \
+  {                                                            \
+    size_t ret = 0;                                            \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    while (ret < n)                                            \
+    {                                                          \
+      if (block)                                               \
+        BOTTLE_WAIT (self, &self->not_full,                    \
+                     !self->closed && (self->frozen || QUEUE_IS_FULL (self->queue)), deadline); \
+      if (self->closed)                                        \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        break;                                                 \
+      }                                                        \
+      if (self->frozen || QUEUE_IS_FULL (self->queue))         \
+      {                                                        \
+        if (block) /* the deadline was reached */              \
+          errno = ETIMEDOUT;                                   \
+        break;                                                 \
+      }                                                        \
+      size_t k = 0;                                            \
+      for ( ; ret < n && !QUEUE_IS_FULL (self->queue) ; ret++, k++) \
+      {                                                        \
+        self->queue.buffer[self->queue.write] = messages[ret]; /* copy */ \
+        BOTTLE_PRIORITY_WRITTEN_##TYPE (self);                 \
+      }                                                        \
+      /* One wakeup for the whole batch */                     \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_empty, k);        \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static size_t BOTTLE_PRIORITY_POP_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max, int block, \
+                                           const struct timespec *deadline) \
+  {                                                            \
+    size_t ret = 0;                                            \
+    if (!max)                                                  \
+      return ret;                                              \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (block)                                                 \
+      BOTTLE_WAIT (self, &self->not_empty, !self->closed && QUEUE_IS_EMPTY (self->queue), deadline); \
+    for ( ; ret < max && !QUEUE_IS_EMPTY (self->queue) ; ret++) \
+    {                                                          \
+      messages[ret] = self->queue.buffer[0]; /* copy */        \
+      BOTTLE_PRIORITY_READ_##TYPE (self);                      \
+    }                                                          \
+    if (ret)                                                   \
+    {                                                          \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_full, ret);       \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+    }                                                          \
+    else if (self->closed)                                     \
+      errno = ECONNABORTED;                                    \
+    else if (block) /* the deadline was reached */             \
+      errno = ETIMEDOUT;                                       \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  static int BOTTLE_PRIORITY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_PRIORITY_PUSH_##TYPE (self, &message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_PRIORITY_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_PRIORITY_PUSH_##TYPE (self, &message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_PRIORITY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_PRIORITY_POP_##TYPE (self, message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_PRIORITY_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_PRIORITY_POP_##TYPE (self, message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_PRIORITY_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_PRIORITY_PUSH_##TYPE (self, &message, 1, 1, deadline); \
+  }                                                            \
+\
+  static int BOTTLE_PRIORITY_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_PRIORITY_POP_##TYPE (self, message, 1, 1, deadline); \
+  }                                                            \
+\
+  static size_t BOTTLE_PRIORITY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_PRIORITY_PUSH_##TYPE (self, messages, n, 1, 0); \
+  }                                                            \
+\
+  static size_t BOTTLE_PRIORITY_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_PRIORITY_PUSH_##TYPE (self, messages, n, 0, 0); \
+  }                                                            \
+\
+  static size_t BOTTLE_PRIORITY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_PRIORITY_POP_##TYPE (self, messages, max, 1, 0); \
   }                                                            \
 \
-  static void BOTTLE_CLOSE_##TYPE (BOTTLE_##TYPE *self)        \
+  static size_t BOTTLE_PRIORITY_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_PRIORITY_POP_##TYPE (self, messages, max, 0, 0); \
+  }                                                            \
+\
+  /* The mutex stays locked from a successful reservation (BOTTLE_RESERVE, at the end of the heap) until the message is committed. */ \
+  static void BOTTLE_PRIORITY_COMMIT_##TYPE (BOTTLE_##TYPE *self) \
+  {                                                            \
+    BOTTLE_PRIORITY_WRITTEN_##TYPE (self);                     \
+    BOTTLE_SIGNAL_##TYPE (self, &self->not_empty, 1);          \
+    BOTTLE_NOTIFY_##TYPE (self);                               \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+  }                                                            \
+\
+  /* Only the most urgent message, at the root of the heap, can be viewed (the next ones are not in order). */ \
+  static size_t BOTTLE_PRIORITY_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block) \
+  {                                                            \
+    return BOTTLE_ACQUIRE_N_##TYPE (self, max < 1 ? max : 1, view, block); \
+  }                                                            \
+\
+  static void BOTTLE_PRIORITY_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    if (k)                                                     \
+    {                                                          \
+      BOTTLE_PRIORITY_READ_##TYPE (self);                      \
+      BOTTLE_SIGNAL_##TYPE (self, &self->not_full, 1);         \
+      BOTTLE_NOTIFY_##TYPE (self);                             \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+  }                                                            \
+\
+  /* Token engine: messages carry no payload (their content is ignored when sent, and left unchanged when received), */ \
+  /* so that the bottle is only an atomic count of messages, as a counting semaphore. */ \
+  /* Sending and receiving are a compare-and-swap on the count. The mutex and conditions are only used to park a thread */ \
+  /* on a full or empty bottle, as for the lock-free engines. The highest bit of the count is set once the bottle is closed. */ \
+\
+  /* Adds up to n messages to the count, as long as the bottle is neither full nor plugged. Sets closed if the bottle is closed. */ \
+  static size_t TOKEN_ADD_##TYPE (BOTTLE_##TYPE *self, size_t n, int *closed) \
+  {                                                            \
+    size_t count = atomic_load_explicit (&self->token.count, memory_order_relaxed); \
+    size_t k;                                                  \
+    do                                                         \
+    {                                                          \
+      if ((*closed = ((count & MPMC_CLOSED) != 0)) || self->frozen) \
+        return 0;                                              \
+      k = self->capacity - count;                              \
+      if (k > n)                                               \
+        k = n;                                                 \
+      if (!k)                                                  \
+        return 0;                                              \
+    }                                                          \
+    while (!atomic_compare_exchange_weak_explicit (&self->token.count, &count, count + k, \
+                                                   memory_order_acq_rel, memory_order_relaxed)); \
+    BOTTLE_COUNT (self, 1, k, count + k);                      \
+    return k;                                                  \
+  }                                                            \
+\
+  /* Removes up to max messages from the count. Sets closed if the bottle is empty and closed. */ \
+  static size_t TOKEN_REMOVE_##TYPE (BOTTLE_##TYPE *self, size_t max, int *closed) \
+  {                                                            \
+    size_t count = atomic_load_explicit (&self->token.count, memory_order_relaxed); \
+    size_t k;                                                  \
+    do                                                         \
+    {                                                          \
+      k = count & ~MPMC_CLOSED;                                \
+      if (k > max)                                             \
+        k = max;                                               \
+      if (!k)                                                  \
+      {                                                        \
+        *closed = ((count & MPMC_CLOSED) != 0);                \
+        return 0;                                              \
+      }                                                        \
+    }                                                          \
+    while (!atomic_compare_exchange_weak_explicit (&self->token.count, &count, count - k, \
+                                                   memory_order_acq_rel, memory_order_relaxed)); \
+    *closed = 0;                                               \
+    BOTTLE_COUNT (self, 0, k, (count & ~MPMC_CLOSED) - k);     \
+    return k;                                                  \
+  }                                                            \
+\
+  /* Spins, or parks until the bottle is no longer full (send) or empty (!send). Returns 0 if the deadline was reached. */ \
+  static int BOTTLE_TOKEN_BACKOFF_##TYPE (BOTTLE_##TYPE *self, int send, size_t *spins, const struct timespec *deadline) \
+  {                                                            \
+    if (*spins < self->spin) /* spin before parking */         \
+    {                                                          \
+      (*spins)++;                                              \
+      BOTTLE_PAUSE ();                                         \
+      return 1;                                                \
+    }                                                          \
+    if (deadline && BOTTLE_DEADLINE_REACHED (deadline))        \
+    {                                                          \
+      errno = ETIMEDOUT;                                       \
+      return 0;                                                \
+    }                                                          \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    if (send) /* the bottle is full (or plugged): park */      \
+    {                                                          \
+      atomic_fetch_add (&self->senders_waiting, 1);            \
+      atomic_thread_fence (memory_order_seq_cst);              \
+      BOTTLE_PARK (self, &self->mutex, &self->not_full, !self->closed && (self->frozen || BOTTLE_SIZE_##TYPE (self) == self->capacity), deadline); \
+      atomic_fetch_sub (&self->senders_waiting, 1);            \
+    }                                                          \
+    else /* the bottle is empty: park */                       \
+    {                                                          \
+      atomic_fetch_add (&self->receivers_waiting, 1);          \
+      atomic_thread_fence (memory_order_seq_cst);              \
+      BOTTLE_PARK (self, &self->mutex, &self->not_empty, !self->closed && !BOTTLE_SIZE_##TYPE (self), deadline); \
+      atomic_fetch_sub (&self->receivers_waiting, 1);          \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return 1;                                                  \
+  }                                                            \
+\
+  static size_t BOTTLE_TOKEN_PUSH_##TYPE (BOTTLE_##TYPE *self, size_t n, int block, const struct timespec *deadline) \
+  {                                                            \
+    size_t done = 0;                                           \
+    size_t spins = 0;                                          \
+    while (done < n)                                           \
+    {                                                          \
+      int closed;                                              \
+      size_t k = TOKEN_ADD_##TYPE (self, n - done, &closed);   \
+      done += k;                                               \
+      if (k)                                                   \
+        BOTTLE_WAKE_##TYPE (self, &self->not_empty, &self->receivers_waiting, k); \
+      if (closed)                                              \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        break;                                                 \
+      }                                                        \
+      if (done == n || !block || !BOTTLE_TOKEN_BACKOFF_##TYPE (self, 1, &spins, deadline)) \
+        break;                                                 \
+    }                                                          \
+    return done;                                               \
+  }                                                            \
+\
+  static size_t BOTTLE_TOKEN_POP_##TYPE (BOTTLE_##TYPE *self, size_t max, int block, const struct timespec *deadline) \
+  {                                                            \
+    size_t done = 0;                                           \
+    size_t spins = 0;                                          \
+    while (max)                                                \
+    {                                                          \
+      int closed;                                              \
+      if ((done = TOKEN_REMOVE_##TYPE (self, max, &closed)))   \
+      {                                                        \
+        BOTTLE_WAKE_##TYPE (self, &self->not_full, &self->senders_waiting, done); \
+        break;                                                 \
+      }                                                        \
+      if (closed)                                              \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        break;                                                 \
+      }                                                        \
+      if (!block || !BOTTLE_TOKEN_BACKOFF_##TYPE (self, 0, &spins, deadline)) \
+        break;                                                 \
+    }                                                          \
+    return done;                                               \
+  }                                                            \
+\
+  static int BOTTLE_TOKEN_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    (void) message;                                            \
+    return (int) BOTTLE_TOKEN_PUSH_##TYPE (self, 1, 1, 0);     \
+  }                                                            \
+\
+  static int BOTTLE_TOKEN_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
   {                                                            \
+    (void) message;                                            \
+    return (int) BOTTLE_TOKEN_PUSH_##TYPE (self, 1, 0, 0);     \
+  }                                                            \
+\
+  static int BOTTLE_TOKEN_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    (void) message;                                            \
+    return (int) BOTTLE_TOKEN_POP_##TYPE (self, 1, 1, 0);      \
+  }                                                            \
+\
+  static int BOTTLE_TOKEN_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    (void) message;                                            \
+    return (int) BOTTLE_TOKEN_POP_##TYPE (self, 1, 0, 0);      \
+  }                                                            \
+\
+  static int BOTTLE_TOKEN_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline) \
+  {                                                            \
+    (void) message;                                            \
+    return (int) BOTTLE_TOKEN_PUSH_##TYPE (self, 1, 1, deadline); \
+  }                                                            \
+\
+  static int BOTTLE_TOKEN_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline) \
+  {                                                            \
+    (void) message;                                            \
+    return (int) BOTTLE_TOKEN_POP_##TYPE (self, 1, 1, deadline); \
+  }                                                            \
+\
+  static size_t BOTTLE_TOKEN_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    (void) messages;                                           \
+    return BOTTLE_TOKEN_PUSH_##TYPE (self, n, 1, 0);           \
+  }                                                            \
+\
+  static size_t BOTTLE_TOKEN_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    (void) messages;                                           \
+    return BOTTLE_TOKEN_PUSH_##TYPE (self, n, 0, 0);           \
+  }                                                            \
+\
+  static size_t BOTTLE_TOKEN_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    (void) messages;                                           \
+    return BOTTLE_TOKEN_POP_##TYPE (self, max, 1, 0);          \
+  }                                                            \
+\
+  static size_t BOTTLE_TOKEN_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    (void) messages;                                           \
+    return BOTTLE_TOKEN_POP_##TYPE (self, max, 0, 0);          \
+  }                                                            \
+\
+  static void BOTTLE_TOKEN_CLOSE_##TYPE (BOTTLE_##TYPE *self)  \
+  {                                                            \
+    atomic_fetch_or (&self->token.count, MPMC_CLOSED);         \
+    BOTTLE_CLOSE_##TYPE (self);                                \
+  }                                                            \
+\
+  /* Messages without payload can't be accessed in place. */   \
+  static TYPE *BOTTLE_TOKEN_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block) \
+  {                                                            \
+    (void) self;                                               \
+    (void) block;                                              \
+    errno = EPERM;                                             \
+    return 0;                                                  \
+  }                                                            \
+\
+  /* Nothing can have been reserved (see above). */            \
+  static void BOTTLE_TOKEN_COMMIT_##TYPE (BOTTLE_##TYPE *self) \
+  {                                                            \
+    (void) self;                                               \
+    errno = EPERM;                                             \
+  }                                                            \
+\
+  static size_t BOTTLE_TOKEN_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block) \
+  {                                                            \
+    (void) self;                                               \
+    (void) max;                                                \
+    (void) block;                                              \
+    *view = (BOTTLE_VIEW_##TYPE) { 0 };                        \
+    errno = EPERM;                                             \
+    return 0;                                                  \
+  }                                                            \
+\
+  /* Nothing can have been acquired (see above). */            \
+  static void BOTTLE_TOKEN_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    (void) self;                                               \
+    (void) k;                                                  \
+    errno = EPERM;                                             \
+  }                                                            \
+\
+  static const TYPE *BOTTLE_ACQUIRE_##TYPE (BOTTLE_##TYPE *self, int block) \
+  {                                                            \
+    BOTTLE_VIEW_##TYPE view;                                   \
+    return self->vtable->AcquireN (self, 1, &view, block) ? view.span[0].messages : 0; \
+  }                                                            \
+\
+  /* Snapshot of the statistics of the bottle. Returns 0 (with errno set to EPERM) if they are not kept (BOTTLE_STATISTICS undefined). */ \
+  static int BOTTLE_STATS_##TYPE (BOTTLE_##TYPE *self, bottle_statistics *stats) \
+  {                                                            \
+    *stats = (bottle_statistics) { 0 };                        \
     BOTTLE_ASSERT (mtx_lock (&self->mutex) == thrd_success);   \
+    stats->size = BOTTLE_SIZE_##TYPE (self);                   \
+    stats->resizes = self->queue.resizes;                      \
+    int ret = BOTTLE_STATS_SNAPSHOT (self, stats);             \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    return ret;                                                \
+  }                                                            \
+\
+  /* Descriptor of readiness to receive (or send) of a pollable bottle. Returns -1 (with errno set to EPERM) if the bottle is not pollable. */ \
+  static int BOTTLE_FD_##TYPE (BOTTLE_##TYPE *self, int send)  \
+  {                                                            \
+    if (self->poll.fd[0] < 0)                                  \
+    {                                                          \
+      errno = EPERM;                                           \
+      return -1;                                               \
+    }                                                          \
+    return self->poll.fd[send ? 1 : 0];                        \
+  }                                                            \
+\
+  /* Type-independent operations of bottle_select. A case of an unbuffered bottle meets a peer at the meeting point, \
+     a case of any other bottle is claimed first (see BOTTLE_SELECT_CLAIM). */ \
+  static int BOTTLE_SELECT_FILL_##TYPE (bottle_case *c)        \
+  {                                                            \
+    BOTTLE_##TYPE *b = c->bottle;                              \
+    if (b->capacity == 0)                                      \
+      return RENDEZVOUS_FILL_##TYPE (b, c->message, 0, 0, c);  \
+    if (!BOTTLE_SELECT_CLAIM (c, 0))                           \
+      return 0;                                                \
+    int ret = b->vtable->TryFill (b, *(TYPE *) c->message);    \
+    if (!ret)                                                  \
+      BOTTLE_SELECT_UNCLAIM (c);                               \
+    return ret;                                                \
+  }                                                            \
+\
+  static int BOTTLE_SELECT_DRAIN_##TYPE (bottle_case *c)       \
+  {                                                            \
+    BOTTLE_##TYPE *b = c->bottle;                              \
+    if (!c->message)                                           \
+      c->message = &b->__dummy__;                              \
+    if (b->capacity == 0)                                      \
+      return RENDEZVOUS_DRAIN_##TYPE (b, c->message, 0, 0, c); \
+    if (!BOTTLE_SELECT_CLAIM (c, 0))                           \
+      return 0;                                                \
+    int ret = b->vtable->TryDrain (b, c->message);             \
+    if (!ret)                                                  \
+      BOTTLE_SELECT_UNCLAIM (c);                               \
+    return ret;                                                \
+  }                                                            \
+\
+  /* Starts (on) or stops watching the bottle for a case of bottle_select.
+     Counting the case as a parked thread makes the lock-free engines notify changes as well. */ \
+  static void BOTTLE_WATCH_##TYPE (void *self, bottle_case *c, int on) \
+  {                                                            \
+    BOTTLE_##TYPE *b = self;                                   \
+    BOTTLE_ASSERT (mtx_lock (&b->mutex) == thrd_success);      \
+    if (on)                                                    \
+    {                                                          \
+      c->next = b->watchers;                                   \
+      b->watchers = c;                                         \
+      atomic_fetch_add (c->send ? &b->senders_waiting : &b->receivers_waiting, 1); \
+    }                                                          \
+    else                                                       \
+    {                                                          \
+      for (bottle_case **w = &b->watchers ; *w ; w = &(*w)->next) \
+        if (*w == c)                                           \
+        {                                                      \
+          *w = c->next;                                        \
+          break;                                               \
+        }                                                      \
+      atomic_fetch_sub (c->send ? &b->senders_waiting : &b->receivers_waiting, 1); \
+    }                                                          \
+    BOTTLE_ASSERT (mtx_unlock (&b->mutex) == thrd_success);    \
+  }                                                            \
+\
+  static void BOTTLE_PLUG_##TYPE (BOTTLE_##TYPE *self)         \
+  {                                                            \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    self->frozen = 1;                                          \
+    BOTTLE_POLL_##TYPE (self);                                 \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+  }                                                            \
+\
+  static void BOTTLE_UNPLUG_##TYPE (BOTTLE_##TYPE *self)       \
+  {                                                            \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    self->frozen = 0;                                          \
+    BOTTLE_POLL_##TYPE (self);                                 \
+    /* Senders and receivers which met while the bottle was plugged can now exchange their messages */ \
+    while (self->rendezvous.senders.first && self->rendezvous.receivers.first) \
+    {                                                          \
+      TYPE *to = RENDEZVOUS_RELEASE_##TYPE (self, &self->rendezvous.receivers); \
+      *to = *RENDEZVOUS_RELEASE_##TYPE (self, &self->rendezvous.senders); /* copy */ \
+    }                                                          \
+    BOTTLE_NOTIFY_##TYPE (self);                               \
+    int senders = atomic_load (&self->senders_waiting); /* threads park under the mutex */ \
+    BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
+    if (senders)                                               \
+      BOTTLE_ASSERT (cnd_broadcast (&self->not_full) == thrd_success); \
+  }                                                            \
+\
+  static void BOTTLE_CLOSE_##TYPE (BOTTLE_##TYPE *self)        \
+  {                                                            \
+    BOTTLE_LOCK (self, &self->mutex);                          \
     self->closed = 1;                                          \
+    BOTTLE_POLL_##TYPE (self);                                 \
+    for (struct _waiter_##TYPE *w = self->rendezvous.senders.first ; w ; w = w->next) \
+      BOTTLE_ASSERT (cnd_signal (&w->cond) == thrd_success);   \
+    for (struct _waiter_##TYPE *w = self->rendezvous.receivers.first ; w ; w = w->next) \
+      BOTTLE_ASSERT (cnd_signal (&w->cond) == thrd_success);   \
+    BOTTLE_NOTIFY_##TYPE (self);                               \
+    int receivers = atomic_load (&self->receivers_waiting); /* threads park under the mutex (except receivers of a two-lock bottle) */ \
+    int senders = atomic_load (&self->senders_waiting);        \
     BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
-    BOTTLE_ASSERT (cnd_broadcast (&self->not_empty) == thrd_success);\
-    BOTTLE_ASSERT (cnd_broadcast (&self->not_full) == thrd_success); \
-    BOTTLE_ASSERT (cnd_broadcast (&self->reading) == thrd_success);  \
-    BOTTLE_ASSERT (cnd_broadcast (&self->writing) == thrd_success);  \
+    if (receivers)                                             \
+      BOTTLE_ASSERT (cnd_broadcast (&self->not_empty) == thrd_success); \
+    if (senders)                                               \
+      BOTTLE_ASSERT (cnd_broadcast (&self->not_full) == thrd_success); \
   }                                                            \
   \
   static void BOTTLE_CLEANUP_##TYPE (BOTTLE_##TYPE *self)      \
   {                                                            \
-    BOTTLE_ASSERT (mtx_lock (&self->mutex) == thrd_success);   \
-    BOTTLE_ASSERT3 (QUEUE_IS_EMPTY (self->queue),              \
+    BOTTLE_LOCK (self, &self->mutex);                          \
+    BOTTLE_ASSERT3 (!BOTTLE_SIZE_##TYPE (self),                \
                     "Some '" #TYPE "s' have been lost.\n", 0); \
     BOTTLE_ASSERT (mtx_unlock (&self->mutex) == thrd_success); \
     mtx_destroy (&self->mutex);                                \
     cnd_destroy (&self->not_empty);                            \
     cnd_destroy (&self->not_full);                             \
-    cnd_destroy (&self->reading);                              \
-    cnd_destroy (&self->writing);                              \
+    if (self->engine == BOTTLE_TWO_LOCK)                       \
+      mtx_destroy (&self->two_lock.head_lock);                 \
+    BOTTLE_POLL_CLOSE (self->poll.fd);                         \
+    if (self->engine == BOTTLE_PRIORITY && !self->queue.fixed) \
+      BOTTLE_FREE (&self->queue.allocator, self->priority.ranks, self->capacity * sizeof (*self->priority.ranks)); \
     QUEUE_DISPOSE_##TYPE (&self->queue);                       \
+    if (self->engine == BOTTLE_MPMC && !self->queue.fixed)     \
+      BOTTLE_FREE (&self->queue.allocator, self->mpmc.cells, self->capacity * self->mpmc.stride); \
   }                                                            \
 \
   static void BOTTLE_DESTROY_##TYPE (BOTTLE_##TYPE *self)      \
   {                                                            \
+    bottle_allocator allocator = self->queue.allocator;        \
     BOTTLE_CLEANUP_##TYPE (self);                              \
-    free (self);                                               \
+    if (!self->queue.fixed) /* a fixed bottle is not allocated by BOTTLE_CREATE */ \
+      BOTTLE_FREE (&allocator, self, sizeof (*self));          \
   }                                                            \
+  BOTTLE_SHM_DEFINE (TYPE)                                     \
   struct __useless_struct_to_allow_trailing_semicolon__
 
+/* Engine of bottles shared between processes (see BOTTLE_CREATE_SHARED), defined along with every type of bottle if BOTTLE_SHM is defined. */
+#  ifdef BOTTLE_SHM
+#    define BOTTLE_SHM_DEFINE( TYPE )                          \
+  /* Shared engine: the control block and the ring of messages lie in a shared memory object, mapped by every process */ \
+  /* using the bottle, and are protected by a process-shared mutex. Each process holds its own handle (BOTTLE_CREATE_SHARED). */ \
+  /* Messages are copied as they are: they must not point to memory private to a process. */ \
+  struct _shared_##TYPE                                        \
+  {                                                            \
+    atomic_int      ready;     /* Set once the block is initialised by its creator (first member, see BOTTLE_SHM_MAP) */ \
+    size_t          capacity;                                  \
+    size_t          mask;      /* capacity - 1 if the capacity is a power of two, 0 otherwise */ \
+    pthread_mutex_t mutex;                                     \
+    pthread_cond_t  not_empty;                                 \
+    pthread_cond_t  not_full;                                  \
+    uint64_t        read;      /* Number of messages read so far */ \
+    uint64_t        write;     /* Number of messages written so far */ \
+    int             closed;                                    \
+    int             frozen;                                    \
+    int             receivers_waiting; /* Number of receivers parked on an empty bottle */ \
+    int             senders_waiting;   /* Number of senders parked on a full (or plugged) bottle */ \
+    TYPE            messages[];                                \
+  };                                                           \
+\
+  static size_t BOTTLE_SHM_PUSH_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n, int block, \
+                                       const struct timespec *deadline) \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    size_t ret = 0;                                            \
+    BOTTLE_SHM_LOCK (&s->mutex);                               \
+    while (ret < n)                                            \
+    {                                                          \
+      if (block)                                               \
+        BOTTLE_SHM_WAIT (self, s, not_full, senders_waiting, !s->closed && (s->frozen || SHM_IS_FULL (s)), deadline); \
+      if (s->closed)                                           \
+      {                                                        \
+        errno = ECONNABORTED;                                  \
+        break;                                                 \
+      }                                                        \
+      if (s->frozen || SHM_IS_FULL (s))                        \
+      {                                                        \
+        if (block) /* the deadline was reached */              \
+          errno = ETIMEDOUT;                                   \
+        break;                                                 \
+      }                                                        \
+      size_t k = 0;                                            \
+      for ( ; ret < n && !SHM_IS_FULL (s) ; ret++, k++)        \
+      {                                                        \
+        s->messages[SHM_INDEX (s, s->write)] = messages[ret]; /* copy */ \
+        atomic_signal_fence (memory_order_release); /* the position only moves once the message is copied */ \
+        s->write++;                                            \
+      }                                                        \
+      BOTTLE_COUNT (self, 1, k, SHM_SIZE (s));                 \
+      BOTTLE_SHM_SIGNAL (&s->not_empty, s->receivers_waiting, k); \
+    }                                                          \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+    return ret;                                                \
+  }                                                            \
+\
+  static size_t BOTTLE_SHM_POP_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max, int block, \
+                                      const struct timespec *deadline) \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    size_t ret = 0;                                            \
+    if (!max)                                                  \
+      return ret;                                              \
+    BOTTLE_SHM_LOCK (&s->mutex);                               \
+    if (block)                                                 \
+      BOTTLE_SHM_WAIT (self, s, not_empty, receivers_waiting, !s->closed && SHM_IS_EMPTY (s), deadline); \
+    for ( ; ret < max && !SHM_IS_EMPTY (s) ; ret++)            \
+    {                                                          \
+      messages[ret] = s->messages[SHM_INDEX (s, s->read)]; /* copy */ \
+      atomic_signal_fence (memory_order_release); /* the position only moves once the message is copied */ \
+      s->read++;                                               \
+    }                                                          \
+    if (ret)                                                   \
+    {                                                          \
+      BOTTLE_COUNT (self, 0, ret, SHM_SIZE (s));               \
+      BOTTLE_SHM_SIGNAL (&s->not_full, s->senders_waiting, ret); \
+    }                                                          \
+    else if (s->closed)                                        \
+      errno = ECONNABORTED;                                    \
+    else if (block) /* the deadline was reached */             \
+      errno = ETIMEDOUT;                                       \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+    return ret;                                                \
+  }                                                            \
+\
+  static int BOTTLE_SHM_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_SHM_PUSH_##TYPE (self, &message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_SHM_TRY_FILL_##TYPE (BOTTLE_##TYPE *self, TYPE message) \
+  {                                                            \
+    return (int) BOTTLE_SHM_PUSH_##TYPE (self, &message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_SHM_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_SHM_POP_##TYPE (self, message, 1, 1, 0); \
+  }                                                            \
+\
+  static int BOTTLE_SHM_TRY_DRAIN_##TYPE (BOTTLE_##TYPE *self, TYPE *message) \
+  {                                                            \
+    return (int) BOTTLE_SHM_POP_##TYPE (self, message, 1, 0, 0); \
+  }                                                            \
+\
+  static int BOTTLE_SHM_FILL_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_SHM_PUSH_##TYPE (self, &message, 1, 1, deadline); \
+  }                                                            \
+\
+  static int BOTTLE_SHM_DRAIN_UNTIL_##TYPE (BOTTLE_##TYPE *self, TYPE *message, const struct timespec *deadline) \
+  {                                                            \
+    return (int) BOTTLE_SHM_POP_##TYPE (self, message, 1, 1, deadline); \
+  }                                                            \
+\
+  static size_t BOTTLE_SHM_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_SHM_PUSH_##TYPE (self, messages, n, 1, 0);   \
+  }                                                            \
+\
+  static size_t BOTTLE_SHM_TRY_FILL_N_##TYPE (BOTTLE_##TYPE *self, const TYPE *messages, size_t n) \
+  {                                                            \
+    return BOTTLE_SHM_PUSH_##TYPE (self, messages, n, 0, 0);   \
+  }                                                            \
+\
+  static size_t BOTTLE_SHM_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_SHM_POP_##TYPE (self, messages, max, 1, 0);  \
+  }                                                            \
+\
+  static size_t BOTTLE_SHM_TRY_DRAIN_N_##TYPE (BOTTLE_##TYPE *self, TYPE *messages, size_t max) \
+  {                                                            \
+    return BOTTLE_SHM_POP_##TYPE (self, messages, max, 0, 0);  \
+  }                                                            \
+\
+  /* Plugging and closing apply to the bottle in every process. */ \
+  static void BOTTLE_SHM_PLUG_##TYPE (BOTTLE_##TYPE *self)     \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    BOTTLE_SHM_LOCK (&s->mutex);                               \
+    s->frozen = 1;                                             \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+  }                                                            \
+\
+  static void BOTTLE_SHM_UNPLUG_##TYPE (BOTTLE_##TYPE *self)   \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    BOTTLE_SHM_LOCK (&s->mutex);                               \
+    s->frozen = 0;                                             \
+    if (s->senders_waiting)                                    \
+      BOTTLE_ASSERT (pthread_cond_broadcast (&s->not_full) == 0); \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+  }                                                            \
+\
+  static void BOTTLE_SHM_CLOSE_##TYPE (BOTTLE_##TYPE *self)    \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    BOTTLE_SHM_LOCK (&s->mutex);                               \
+    s->closed = 1;                                             \
+    if (s->receivers_waiting)                                  \
+      BOTTLE_ASSERT (pthread_cond_broadcast (&s->not_empty) == 0); \
+    if (s->senders_waiting)                                    \
+      BOTTLE_ASSERT (pthread_cond_broadcast (&s->not_full) == 0); \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+  }                                                            \
+\
+  /* Unmaps the bottle from the process. The shared memory object is unlinked if this process created it: */ \
+  /* other processes which mapped it can still use it, until they destroy their own handle. */ \
+  static void BOTTLE_SHM_DESTROY_##TYPE (BOTTLE_##TYPE *self)  \
+  {                                                            \
+    munmap (self->shared.block, self->shared.size);            \
+    if (self->shared.name)                                     \
+      shm_unlink (self->shared.name);                          \
+    free (self->shared.name);                                  \
+    BOTTLE_DESTROY_##TYPE (self); /* the handle */             \
+  }                                                            \
+\
+  /* The mutex stays locked from a successful reservation until the message is committed. */ \
+  static TYPE *BOTTLE_SHM_RESERVE_##TYPE (BOTTLE_##TYPE *self, int block) \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    BOTTLE_SHM_LOCK (&s->mutex);                               \
+    if (block)                                                 \
+      BOTTLE_SHM_WAIT (self, s, not_full, senders_waiting, !s->closed && (s->frozen || SHM_IS_FULL (s)), 0); \
+    if (s->closed)                                             \
+      errno = ECONNABORTED;                                    \
+    else if (!s->frozen && !SHM_IS_FULL (s))                   \
+      return s->messages + SHM_INDEX (s, s->write);            \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+    return 0;                                                  \
+  }                                                            \
+\
+  static void BOTTLE_SHM_COMMIT_##TYPE (BOTTLE_##TYPE *self)   \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    atomic_signal_fence (memory_order_release); /* the position only moves once the message is written in place */ \
+    s->write++;                                                \
+    BOTTLE_COUNT (self, 1, 1, SHM_SIZE (s));                   \
+    BOTTLE_SHM_SIGNAL (&s->not_empty, s->receivers_waiting, 1); \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+  }                                                            \
+\
+  /* The mutex stays locked from a successful acquisition until the messages are released. */ \
+  static size_t BOTTLE_SHM_ACQUIRE_N_##TYPE (BOTTLE_##TYPE *self, size_t max, BOTTLE_VIEW_##TYPE *view, int block) \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    *view = (BOTTLE_VIEW_##TYPE) { 0 };                        \
+    if (!max)                                                  \
+      return 0;                                                \
+    BOTTLE_SHM_LOCK (&s->mutex);                               \
+    if (block)                                                 \
+      BOTTLE_SHM_WAIT (self, s, not_empty, receivers_waiting, !s->closed && SHM_IS_EMPTY (s), 0); \
+    size_t n = SHM_SIZE (s);                                   \
+    if (n)                                                     \
+    {                                                          \
+      size_t index = SHM_INDEX (s, s->read);                   \
+      size_t first = s->capacity - index;                      \
+      if (n > max)                                             \
+        n = max;                                               \
+      if (first > n)                                           \
+        first = n;                                             \
+      view->span[0].messages = s->messages + index;            \
+      view->span[0].size = first;                              \
+      view->span[1].messages = s->messages;                    \
+      view->span[1].size = n - first;                          \
+      return n;                                                \
+    }                                                          \
+    if (s->closed)                                             \
+      errno = ECONNABORTED;                                    \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+    return 0;                                                  \
+  }                                                            \
+\
+  static void BOTTLE_SHM_RELEASE_##TYPE (BOTTLE_##TYPE *self, size_t k) \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    if (k)                                                     \
+    {                                                          \
+      atomic_signal_fence (memory_order_release); /* nor once the messages are read in place */ \
+      s->read += k;                                            \
+      BOTTLE_COUNT (self, 0, k, SHM_SIZE (s));                 \
+      BOTTLE_SHM_SIGNAL (&s->not_full, s->senders_waiting, k); \
+    }                                                          \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+  }                                                            \
+\
+  /* The counters of a shared bottle are those of the process only (the size is the one of the shared ring). */ \
+  static int BOTTLE_SHM_STATS_##TYPE (BOTTLE_##TYPE *self, bottle_statistics *stats) \
+  {                                                            \
+    struct _shared_##TYPE *s = self->shared.block;             \
+    *stats = (bottle_statistics) { 0 };                        \
+    BOTTLE_SHM_LOCK (&s->mutex);                               \
+    stats->size = SHM_SIZE (s);                                \
+    BOTTLE_ASSERT (pthread_mutex_unlock (&s->mutex) == 0);     \
+    return BOTTLE_STATS_SNAPSHOT (self, stats);                \
+  }                                                            \
+\
+  /* Other processes can't notify a thread waiting in bottle_select: it checks the bottle periodically instead (every BOTTLE_SELECT_POLL ns). */ \
+  static void BOTTLE_SHM_WATCH_##TYPE (void *self, bottle_case *c, int on) \
+  {                                                            \
+    (void) self;                                               \
+    if (on)                                                    \
+      c->selector->polling = 1;                                \
+  }                                                            \
+\
+  static const _BOTTLE_VTABLE_##TYPE BOTTLE_SHM_VTABLE_##TYPE = \
+  {                                                            \
+    BOTTLE_SHM_FILL_##TYPE,                                    \
+    BOTTLE_SHM_TRY_FILL_##TYPE,                                \
+    BOTTLE_SHM_DRAIN_##TYPE,                                   \
+    BOTTLE_SHM_TRY_DRAIN_##TYPE,                               \
+    BOTTLE_SHM_FILL_UNTIL_##TYPE,                              \
+    BOTTLE_SHM_DRAIN_UNTIL_##TYPE,                             \
+    BOTTLE_SHM_FILL_N_##TYPE,                                  \
+    BOTTLE_SHM_TRY_FILL_N_##TYPE,                              \
+    BOTTLE_SHM_DRAIN_N_##TYPE,                                 \
+    BOTTLE_SHM_TRY_DRAIN_N_##TYPE,                             \
+    BOTTLE_SHM_PLUG_##TYPE,                                    \
+    BOTTLE_SHM_UNPLUG_##TYPE,                                  \
+    BOTTLE_SHM_CLOSE_##TYPE,                                   \
+    BOTTLE_SHM_DESTROY_##TYPE,                                 \
+    BOTTLE_SELECT_FILL_##TYPE,                                 \
+    BOTTLE_SELECT_DRAIN_##TYPE,                                \
+    BOTTLE_SHM_WATCH_##TYPE,                                   \
+    BOTTLE_SHM_RESERVE_##TYPE,                                 \
+    BOTTLE_SHM_COMMIT_##TYPE,                                  \
+    BOTTLE_ACQUIRE_##TYPE,                                     \
+    BOTTLE_SHM_ACQUIRE_N_##TYPE,                               \
+    BOTTLE_SHM_RELEASE_##TYPE,                                 \
+    BOTTLE_SUBSCRIBE_##TYPE,                                   \
+    BOTTLE_UNSUBSCRIBE_##TYPE,                                 \
+    BOTTLE_READ_##TYPE,                                        \
+    BOTTLE_SHM_STATS_##TYPE,                                   \
+    BOTTLE_FD_##TYPE,                                          \
+  };                                                           \
+\
+  /* Creates the bottle named name (as for shm_open, "/somename") of capacity messages, shared between processes, */ \
+  /* or opens it if another process already created it (with the same type and capacity). */ \
+  /* Returns 0 (with errno set) if the shared memory object can't be created or mapped. */ \
+  BOTTLE_##TYPE *BOTTLE_CREATE_SHARED_##TYPE (const char *name, size_t capacity) \
+  {                                                            \
+    BOTTLE_ASSERT3 (capacity != 0 && capacity != (size_t) -1, "A shared bottle requires a limited buffered capacity.\n", 1); \
+    BOTTLE_ASSERT3 (capacity <= (SIZE_MAX - sizeof (struct _shared_##TYPE)) / sizeof (TYPE), "Capacity too large.\n", 1); \
+    size_t size = sizeof (struct _shared_##TYPE) + capacity * sizeof (TYPE); \
+    int owner;                                                 \
+    struct _shared_##TYPE *s = BOTTLE_SHM_MAP (name, size, &owner); \
+    if (!s)                                                    \
+      return 0;                                                \
+    if (owner)                                                 \
+    {                                                          \
+      s->capacity = capacity;                                  \
+      s->mask = QUEUE_MASK (capacity);                         \
+      BOTTLE_SHM_SYNC_INIT (&s->mutex, &s->not_empty, &s->not_full); \
+      s->read = s->write = 0;                                  \
+      s->closed = s->frozen = 0;                               \
+      s->receivers_waiting = s->senders_waiting = 0;           \
+      atomic_store (&s->ready, 1);                             \
+    }                                                          \
+    else if (s->capacity != capacity)                          \
+    {                                                          \
+      munmap (s, size);                                        \
+      errno = EINVAL;                                          \
+      return 0;                                                \
+    }                                                          \
+    BOTTLE_##TYPE *b = BOTTLE_ALLOC (0, sizeof (*b), _Alignof (BOTTLE_##TYPE)); \
+    BOTTLE_ASSERT (b);                                         \
+    BOTTLE_INIT_##TYPE (b, UNBUFFERED, 0); /* the handle holds no message */ \
+    b->vtable = &BOTTLE_SHM_VTABLE_##TYPE;                     \
+    b->engine = BOTTLE_SHARED;                                 \
+    b->capacity = capacity;                                    \
+    b->shared.block = s;                                       \
+    b->shared.size = size;                                     \
+    b->shared.name = 0;                                        \
+    if (owner)                                                 \
+    {                                                          \
+      BOTTLE_ASSERT (b->shared.name = malloc (strlen (name) + 1)); \
+      strcpy (b->shared.name, name);                           \
+    }                                                          \
+    return b;                                                  \
+  }
+#  else
+#    define BOTTLE_SHM_DEFINE( TYPE )
+#  endif
+
 #endif
@@ -0,0 +1,419 @@
+// Throughput and latency benchmark of bottles.
+//
+// Compile with:
+// gcc -O2 -pthread bottle_bench.c -o bottle_bench
+//
+// Sweeps engines, numbers of producers and consumers, capacities, message sizes, blocking or non-blocking (try) exchanges
+// and thread pinning, and prints one CSV line per run on the standard output:
+// wall clock throughput and end-to-end latency percentiles (from the send by a producer to the receipt by a consumer.)
+//
+// Usage: bottle_bench [-n messages] [-t threads] [-e engines] [-c capacities] [-s sizes] [-m modes] [-a affinities]
+//   -n  number of messages per run (default 100000)
+//   -t  maximum number of producers and of consumers, swept by powers of two (default 4)
+//   -e  comma separated engines among mutex, spsc, mpmc, two_lock (default all)
+//   -c  comma separated capacities, 0 (unbuffered), a number, or unlimited (default 0,1,64,4096,unlimited)
+//   -s  comma separated message sizes in bytes, among 4, 64, 512, 4096 (default all)
+//   -m  comma separated modes among block, try (default both)
+//   -a  comma separated thread pinning, 0 or 1 (default both)
+//
+// Example: ./bottle_bench -t 2 -s 64 -a 0 > bench.csv
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "bottle_impl.h"
+
+// Latency histogram, HDR-style: values are recorded with a relative precision of 1/32 (about 3%),
+// in buckets of equal width within each power of two.
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define NB_BUCKETS ((32 - SUB_BITS + 1) * SUB_COUNT)    // enough for 32 bit values
+
+typedef struct
+{
+  uint64_t count[NB_BUCKETS];
+  uint64_t total, sum;
+  uint32_t max;
+} histogram;
+
+static size_t
+bucket_of (uint32_t v)
+{
+  if (v < 2 * SUB_COUNT)
+    return v;
+  int msb = 31 - __builtin_clz (v);
+  int shift = msb - SUB_BITS;
+  return (size_t) (shift + 1) * SUB_COUNT + (v >> shift) - SUB_COUNT;
+}
+
+static uint32_t
+value_of (size_t bucket)        // Highest value of the bucket
+{
+  if (bucket < 2 * SUB_COUNT)
+    return (uint32_t) bucket;
+  int shift = (int) (bucket / SUB_COUNT) - 1;
+  uint64_t low = (uint64_t) (bucket % SUB_COUNT + SUB_COUNT) << shift;
+  return (uint32_t) (low + ((uint64_t) 1 << shift) - 1);
+}
+
+static void
+histogram_record (histogram *h, uint32_t v)
+{
+  h->count[bucket_of (v)]++;
+  h->total++;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+}
+
+static void
+histogram_merge (histogram *to, const histogram *from)
+{
+  for (size_t i = 0; i < NB_BUCKETS; i++)
+    to->count[i] += from->count[i];
+  to->total += from->total;
+  to->sum += from->sum;
+  if (from->max > to->max)
+    to->max = from->max;
+}
+
+static uint32_t
+histogram_percentile (const histogram *h, double p)
+{
+  uint64_t rank = (uint64_t) (p / 100. * (double) h->total + .5);
+  uint64_t n = 0;
+  for (size_t i = 0; i < NB_BUCKETS; i++)
+    if ((n += h->count[i]) >= rank && n)
+      return value_of (i) < h->max ? value_of (i) : h->max;
+  return h->max;
+}
+
+// Nanoseconds, truncated to 32 bits: latencies are computed modulo 2^32 ns (about 4 seconds.)
+static uint32_t
+stamp (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint32_t) ((uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec);
+}
+
+static double
+seconds (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// A run of the benchmark, shared by its threads.
+typedef struct
+{
+  void *bottle;
+  int try;
+  pthread_barrier_t start;
+} run;
+
+typedef struct
+{
+  run *run;
+  size_t count;                 // Number of messages to send (producers)
+  int cpu;                      // CPU to pin the thread on, or -1
+  double start, end;            // Wall clock time when the thread started and ended exchanging messages
+  histogram latency;            // Latencies of received messages (consumers)
+} worker;
+
+static void
+pin (const worker *w)
+{
+  if (w->cpu < 0)
+    return;
+  cpu_set_t set;
+  CPU_ZERO (&set);
+  CPU_SET (w->cpu, &set);
+  pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+}
+
+// Messages carry the time they were sent, padded to the requested size.
+typedef struct
+{
+  uint32_t stamp;
+} message4;
+#define MESSAGE(SIZE)                                        \
+  typedef struct                                             \
+  {                                                          \
+    uint32_t stamp;                                          \
+    unsigned char payload[SIZE - sizeof (uint32_t)];         \
+  } message##SIZE
+MESSAGE (64);
+MESSAGE (512);
+MESSAGE (4096);
+
+// Type-independent operations on bottles of messages of a given size.
+typedef struct
+{
+  size_t size;
+  void *(*create) (size_t capacity, const bottle_options *options);
+  void (*close) (void *bottle);
+  void (*destroy) (void *bottle);
+  void *(*produce) (void *worker);
+  void *(*consume) (void *worker);
+} message_type;
+
+#define BENCH(SIZE)                                          \
+  DECLARE_BOTTLE (message##SIZE);                            \
+  DEFINE_BOTTLE (message##SIZE);                             \
+                                                             \
+  static void *                                              \
+  create##SIZE (size_t capacity, const bottle_options *options) \
+  {                                                          \
+    return bottle_create (message##SIZE, capacity, options); \
+  }                                                          \
+                                                             \
+  static void                                                \
+  close##SIZE (void *bottle)                                 \
+  {                                                          \
+    bottle_close ((bottle_t (message##SIZE) *) bottle);      \
+  }                                                          \
+                                                             \
+  static void                                                \
+  destroy##SIZE (void *bottle)                               \
+  {                                                          \
+    bottle_destroy ((bottle_t (message##SIZE) *) bottle);    \
+  }                                                          \
+                                                             \
+  static void *                                              \
+  produce##SIZE (void *arg)                                  \
+  {                                                          \
+    worker *w = arg;                                         \
+    bottle_t (message##SIZE) *bottle = w->run->bottle;       \
+    message##SIZE m;                                         \
+    memset (&m, 0, sizeof (m));                              \
+    pin (w);                                                 \
+    pthread_barrier_wait (&w->run->start);                   \
+    w->start = seconds ();                                   \
+    for (size_t i = 0; i < w->count; i++)                    \
+    {                                                        \
+      m.stamp = stamp ();                                    \
+      if (!w->run->try)                                      \
+        bottle_send (bottle, m);                             \
+      else                                                   \
+        while (!bottle_try_send (bottle, m))                 \
+          sched_yield ();                                    \
+    }                                                        \
+    w->end = seconds ();                                     \
+    return 0;                                                \
+  }                                                          \
+                                                             \
+  static void *                                              \
+  consume##SIZE (void *arg)                                  \
+  {                                                          \
+    worker *w = arg;                                         \
+    bottle_t (message##SIZE) *bottle = w->run->bottle;       \
+    message##SIZE m;                                         \
+    pin (w);                                                 \
+    pthread_barrier_wait (&w->run->start);                   \
+    w->start = seconds ();                                   \
+    if (!w->run->try)                                        \
+      while (bottle_recv (bottle, &m))                       \
+        histogram_record (&w->latency, stamp () - m.stamp);  \
+    else                                                     \
+      for (;;)                                               \
+      {                                                      \
+        errno = 0;                                           \
+        if (bottle_try_recv (bottle, &m))                    \
+          histogram_record (&w->latency, stamp () - m.stamp); \
+        else if (errno == ECONNABORTED)                      \
+          break;                                             \
+        else                                                 \
+          sched_yield ();                                    \
+      }                                                      \
+    w->end = seconds ();                                     \
+    return 0;                                                \
+  }                                                          \
+                                                             \
+  static const message_type type##SIZE = { SIZE, create##SIZE, close##SIZE, destroy##SIZE, produce##SIZE, consume##SIZE }
+
+BENCH (4);
+BENCH (64);
+BENCH (512);
+BENCH (4096);
+
+static const message_type *const TYPES[] = { &type4, &type64, &type512, &type4096 };
+
+static const struct
+{
+  const char *name;
+  bottle_engine engine;
+} ENGINES[] = { {"mutex", BOTTLE_MUTEX}, {"spsc", BOTTLE_SPSC}, {"mpmc", BOTTLE_MPMC}, {"two_lock", BOTTLE_TWO_LOCK} };
+
+#define NB_ELEMS(a) (sizeof (a) / sizeof (*(a)))
+
+// Sets of values to sweep, as selected on the command line.
+static size_t nb_messages = 100000;
+static size_t max_threads = 4;
+static int engines[NB_ELEMS (ENGINES)] = { 1, 1, 1, 1 };
+static int sizes[NB_ELEMS (TYPES)] = { 1, 1, 1, 1 };
+static size_t capacities[16] = { UNBUFFERED, 1, 64, 4096, UNLIMITED };
+static size_t nb_capacities = 5;
+static int modes[2] = { 1, 1 };         // block, try
+static int affinities[2] = { 1, 1 };    // not pinned, pinned
+static int nb_cpus;
+
+static void
+bench (const message_type *type, size_t e, size_t capacity, size_t nb_producers, size_t nb_consumers, int try, int pinned)
+{
+  bottle_options options = { .engine = ENGINES[e].engine };
+  run r = { .bottle = type->create (capacity, &options), .try = try };
+  size_t nb_workers = nb_producers + nb_consumers;
+  worker *workers = calloc (nb_workers, sizeof (*workers));
+  pthread_t *threads = calloc (nb_workers, sizeof (*threads));
+  if (!r.bottle || !workers || !threads)
+  {
+    perror ("bottle_bench");
+    exit (EXIT_FAILURE);
+  }
+  pthread_barrier_init (&r.start, 0, (unsigned) nb_workers + 1);
+
+  for (size_t i = 0; i < nb_workers; i++)
+  {
+    workers[i].run = &r;
+    workers[i].cpu = pinned ? (int) (i % (size_t) nb_cpus) : -1;
+    workers[i].count = i < nb_producers ? nb_messages / nb_producers + (i < nb_messages % nb_producers) : 0;
+    pthread_create (&threads[i], 0, i < nb_producers ? type->produce : type->consume, &workers[i]);
+  }
+  pthread_barrier_wait (&r.start);
+  for (size_t i = 0; i < nb_producers; i++)
+    pthread_join (threads[i], 0);
+  type->close (r.bottle);
+  histogram latency = { 0 };
+  double start = workers[0].start, end = workers[0].end;
+  for (size_t i = 0; i < nb_workers; i++)
+  {
+    if (i >= nb_producers)
+    {
+      pthread_join (threads[i], 0);
+      histogram_merge (&latency, &workers[i].latency);
+    }
+    if (workers[i].start < start)
+      start = workers[i].start;
+    if (workers[i].end > end)
+      end = workers[i].end;
+  }
+  double duration = end - start;
+  type->destroy (r.bottle);
+  pthread_barrier_destroy (&r.start);
+  free (threads);
+  free (workers);
+
+  char cap[32];
+  if (capacity == UNLIMITED)
+    snprintf (cap, sizeof (cap), "unlimited");
+  else
+    snprintf (cap, sizeof (cap), "%zu", capacity);
+  printf ("%s,%zu,%zu,%s,%zu,%s,%d,%zu,%f,%.0f,%.1f,%u,%u,%u,%.0f,%u\n",
+          ENGINES[e].name, nb_producers, nb_consumers, cap, type->size, try ? "try" : "block", pinned, (size_t) latency.total,
+          duration, (double) latency.total / duration, (double) latency.total * (double) type->size / duration / 1e6,
+          histogram_percentile (&latency, 50.), histogram_percentile (&latency, 99.), histogram_percentile (&latency, 99.9),
+          latency.total ? (double) latency.sum / (double) latency.total : 0., latency.max);
+  fflush (stdout);
+}
+
+static void
+sweep (void)
+{
+  printf ("engine,producers,consumers,capacity,size,mode,pinned,messages,seconds,messages_per_s,MB_per_s,"
+          "p50_ns,p99_ns,p999_ns,mean_ns,max_ns\n");
+  for (size_t e = 0; e < NB_ELEMS (ENGINES); e++)
+    for (size_t c = 0; engines[e] && c < nb_capacities; c++)
+      // Engines other than the mutex one fall back to it if the bottle is unbuffered or unlimited.
+      if (ENGINES[e].engine == BOTTLE_MUTEX || (capacities[c] != UNBUFFERED && capacities[c] != UNLIMITED))
+        for (size_t p = 1; p <= max_threads; p = p < max_threads && 2 * p > max_threads ? max_threads : 2 * p)
+          for (size_t q = 1; q <= max_threads; q = q < max_threads && 2 * q > max_threads ? max_threads : 2 * q)
+            if (ENGINES[e].engine != BOTTLE_SPSC || (p == 1 && q == 1))
+              for (size_t s = 0; s < NB_ELEMS (TYPES); s++)
+                for (int m = 0; sizes[s] && m < 2; m++)
+                  // Non-blocking senders and receivers can not meet in an unbuffered bottle.
+                  if (modes[m] && (!m || capacities[c] != UNBUFFERED))
+                    for (int a = 0; a < 2; a++)
+                      if (affinities[a])
+                        bench (TYPES[s], e, capacities[c], p, q, m, a);
+}
+
+static void
+usage (const char *program)
+{
+  fprintf (stderr, "Usage: %s [-n messages] [-t threads] [-e engines] [-c capacities] [-s sizes] [-m modes] [-a affinities]\n",
+           program);
+  exit (EXIT_FAILURE);
+}
+
+// Selects the items of list (among names) in selected.
+static void
+select_names (char *list, const char *const *names, size_t nb_names, int *selected, const char *program)
+{
+  memset (selected, 0, nb_names * sizeof (*selected));
+  for (char *item = strtok (list, ","); item; item = strtok (0, ","))
+  {
+    size_t i;
+    for (i = 0; i < nb_names && strcmp (item, names[i]); i++)
+      /**/;
+    if (i == nb_names)
+      usage (program);
+    selected[i] = 1;
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *const ENGINE_NAMES[] = { "mutex", "spsc", "mpmc", "two_lock" };
+  static const char *const SIZE_NAMES[] = { "4", "64", "512", "4096" };
+  static const char *const MODE_NAMES[] = { "block", "try" };
+  static const char *const AFFINITY_NAMES[] = { "0", "1" };
+  nb_cpus = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  if (nb_cpus < 1)
+    nb_cpus = 1;
+
+  for (int opt; (opt = getopt (argc, argv, "n:t:e:c:s:m:a:")) != -1;)
+    switch (opt)
+    {
+      case 'n':
+        nb_messages = strtoul (optarg, 0, 10);
+        break;
+      case 't':
+        if (!(max_threads = strtoul (optarg, 0, 10)))
+          usage (argv[0]);
+        break;
+      case 'e':
+        select_names (optarg, ENGINE_NAMES, NB_ELEMS (ENGINE_NAMES), engines, argv[0]);
+        break;
+      case 's':
+        select_names (optarg, SIZE_NAMES, NB_ELEMS (SIZE_NAMES), sizes, argv[0]);
+        break;
+      case 'm':
+        select_names (optarg, MODE_NAMES, NB_ELEMS (MODE_NAMES), modes, argv[0]);
+        break;
+      case 'a':
+        select_names (optarg, AFFINITY_NAMES, NB_ELEMS (AFFINITY_NAMES), affinities, argv[0]);
+        break;
+      case 'c':
+        nb_capacities = 0;
+        for (char *item = strtok (optarg, ","); item && nb_capacities < NB_ELEMS (capacities); item = strtok (0, ","))
+          capacities[nb_capacities++] = strcmp (item, "unlimited") ? strtoul (item, 0, 10) : UNLIMITED;
+        break;
+      default:
+        usage (argv[0]);
+    }
+  if (optind < argc)
+    usage (argv[0]);
+
+  sweep ();
+  return EXIT_SUCCESS;
+}
@@ -4,6 +4,7 @@
 // gcc -pthread bottle_example.c -o bottle_example
 
 #define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE         // For BOTTLE_MMAP
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
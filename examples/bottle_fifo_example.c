@@ -7,7 +7,7 @@ bottle_type_declare (int);
 bottle_type_define (int);
 
 static void
-write (bottle_t (int) *fifo)
+produce (bottle_t (int) *fifo)
 {
   errno = 0;
   for (int i = 1; i <= 3 && !errno; i++)
@@ -17,7 +17,7 @@ write (bottle_t (int) *fifo)
 }
 
 static int
-read (void *arg)
+consume (void *arg)
 {
   bottle_t (int) * fifo = arg;
   int i;
@@ -39,11 +39,11 @@ main (void)
   fifo = bottle_create (int, BOTTLE_CAPACITY);
   printf ("Declared Capacity %zu\n", BOTTLE_CAPACITY);
   printf ("Effective capacity %zu\n", QUEUE_CAPACITY (fifo->queue));
-  write (fifo);
+  produce (fifo);
   bottle_close (fifo);          // Close to indicate writing is done.
   printf ("Declared Capacity %zu\n", BOTTLE_CAPACITY);
   printf ("Effective capacity %zu\n", QUEUE_CAPACITY (fifo->queue));
-  thrd_create (&thread_id, read, fifo);
+  thrd_create (&thread_id, consume, fifo);
   thrd_join (thread_id, 0);
   printf ("Declared Capacity %zu\n", BOTTLE_CAPACITY);
   printf ("Effective capacity %zu\n", QUEUE_CAPACITY (fifo->queue));
@@ -52,11 +52,11 @@ main (void)
   fifo = bottle_create (int, UNLIMITED);
   printf ("Declared Capacity %zu\n", UNLIMITED);
   printf ("Effective capacity %zu\n", QUEUE_CAPACITY (fifo->queue));
-  write (fifo);
+  produce (fifo);
   bottle_close (fifo);          // Close to indicate writing is done.
   printf ("Declared Capacity %zu\n", UNLIMITED);
   printf ("Effective capacity %zu\n", QUEUE_CAPACITY (fifo->queue));    // The capacity adapts to the number of transmitted messages.
-  thrd_create (&thread_id, read, fifo);
+  thrd_create (&thread_id, consume, fifo);
   thrd_join (thread_id, 0);
   printf ("Declared Capacity %zu\n", UNLIMITED);
   printf ("Effective capacity %zu\n", QUEUE_CAPACITY (fifo->queue));    // The capacity adapts to the number of transmitted messages.
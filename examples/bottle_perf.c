@@ -1,22 +1,53 @@
+#define _DEFAULT_SOURCE         // For BOTTLE_MMAP
 #include <time.h>
+#include <stdio.h>
 #include <pthread.h>
 #include <assert.h>
 #include "bottle_impl.h"
 bottle_type_declare (int);
 bottle_type_define (int);
+bottle_fixed_type_declare (int, 8);
+typedef struct
+{
+  size_t seq;
+  char payload[2048];
+} Frame;
+bottle_type_declare (Frame);
+bottle_type_define (Frame);
+typedef struct
+{
+  size_t seq;
+  char payload[120];
+} Record;
+bottle_type_declare (Record);
+bottle_type_define (Record);
 #define NB_MESSAGES (2 * 1000 * 1000)
 
-static size_t LEVEL[2 * NB_MESSAGES];
 static size_t nb_p, nb_c;
 static size_t test_number;
 
+static struct timespec
+now (void)
+{
+  struct timespec ts;
+  timespec_get (&ts, TIME_UTC);
+  return ts;
+}
+
+static double
+elapsed (struct timespec start)
+{
+  struct timespec end = now ();
+  return (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
 static void *
 eat (void *arg)
 {
   bottle_t (int) * bottle = arg;
   // Consumer
   while (bottle_recv (bottle))
-    LEVEL[nb_c++ + nb_p] = QUEUE_SIZE (bottle->queue);
+    nb_c++;
   return 0;
 }
 
@@ -27,7 +58,7 @@ test1 (void)
   for (size_t t = 0; t < sizeof (test) / sizeof (*test); t++)
   {
     printf ("*** TEST %lu ***\n", ++test_number);
-    clock_t start = clock ();
+    struct timespec start = now ();
     nb_p = nb_c = 0;
     bottle_t (int) * bottle = bottle_create (int, test[t]);
     printf ("Declared capacity: %zu\n", test[t]);
@@ -36,17 +67,20 @@ test1 (void)
 
     // Producer
     for (size_t i = 0; i < NB_MESSAGES && bottle_send (bottle); i++)
-      LEVEL[nb_c + nb_p++] = QUEUE_SIZE (bottle->queue);
+      nb_p++;
 
     bottle_close (bottle);
     pthread_join (eater, 0);
-    bottle_destroy (bottle);
 
-    printf ("%zu messages produced, %zu messages consumed in %f seconds.\n", nb_p, nb_c, (double) (clock () - start) / (double) CLOCKS_PER_SEC);
-    size_t avg = 0;
-    for (size_t i = 0; i < sizeof (LEVEL) / sizeof (*LEVEL); i++)
-      avg += LEVEL[i];
-    printf ("Average buffer size : %f\n\n", ((double) avg) * sizeof (*LEVEL) / sizeof (LEVEL));
+    printf ("%zu messages produced, %zu messages consumed in %f seconds (wall clock).\n", nb_p, nb_c, elapsed (start));
+    bottle_statistics stats;
+    if (bottle_stats (bottle, &stats))   // Compiled with BOTTLE_STATISTICS defined
+      printf ("Blocked sends: %zu (%f s), blocked receives: %zu (%f s), lock contentions: %zu.\n"
+              "Average buffer size: %f, maximum buffer size: %zu.\n",
+              (size_t) stats.blocked_sends, (double) stats.send_wait / 1e9, (size_t) stats.blocked_receives,
+              (double) stats.receive_wait / 1e9, (size_t) stats.contentions, stats.mean_size, stats.max_size);
+    printf ("\n");
+    bottle_destroy (bottle);
   }
 }
 
@@ -121,9 +155,520 @@ test2 (void)
     }
 }
 
+#define BATCH 64
+static void *
+eat_n (void *arg)
+{
+  int v[BATCH];
+  size_t n;
+  bottle_t (int) * bottle = arg;
+  // Consumer
+  while ((n = bottle_recv_n (bottle, v, BATCH)))
+    nb_c += n;
+  return 0;
+}
+
+static void
+test3 (void)
+{
+  size_t test[] = { 1000, UNLIMITED };
+  for (size_t t = 0; t < sizeof (test) / sizeof (*test); t++)
+  {
+    printf ("*** TEST %lu ***\n", ++test_number);
+    struct timespec start = now ();
+    nb_p = nb_c = 0;
+    bottle_t (int) * bottle = bottle_create (int, test[t]);
+    printf ("Declared capacity: %zu\n", test[t]);
+    printf ("Batches of %i messages\n", BATCH);
+    pthread_t eater;
+    pthread_create (&eater, 0, eat_n, bottle);
+
+    // Producer
+    int v[BATCH] = { 0 };
+    for (size_t n = BATCH; nb_p < NB_MESSAGES && n == BATCH; nb_p += n)
+      n = bottle_send_n (bottle, v, BATCH);
+
+    bottle_close (bottle);
+    pthread_join (eater, 0);
+    bottle_destroy (bottle);
+
+    printf ("%zu messages produced, %zu messages consumed in %f seconds (wall clock).\n\n", nb_p, nb_c, elapsed (start));
+  }
+}
+
+static void *
+eat_only (void *arg)
+{
+  bottle_t (int) * bottle = arg;
+  while (bottle_recv (bottle))
+    nb_c++;
+  return 0;
+}
+
+static void
+test4 (void)
+{
+  // Spin-then-park versus immediate parking, measured in wall clock time (spinning is only meaningful on several cores).
+  size_t capacity[] = { 1, 1000 };
+  bottle_engine engine[] = { BOTTLE_MUTEX, BOTTLE_SPSC };
+  size_t spin[] = { 0, 100 };
+  for (size_t e = 0; e < sizeof (engine) / sizeof (*engine); e++)
+    for (size_t t = 0; t < sizeof (capacity) / sizeof (*capacity); t++)
+      for (size_t s = 0; s < sizeof (spin) / sizeof (*spin); s++)
+      {
+        printf ("*** TEST %lu ***\n", ++test_number);
+        nb_p = nb_c = 0;
+        struct timespec start = now ();
+        bottle_options options = {.engine = engine[e],.spin = spin[s] };
+        bottle_t (int) * bottle = bottle_create (int, capacity[t], &options);
+        printf ("Declared capacity: %zu, %s engine, %zu spinning iterations before parking\n", capacity[t], engine[e] == BOTTLE_SPSC ? "SPSC" : "mutex", spin[s]);
+        pthread_t eater;
+        pthread_create (&eater, 0, eat_only, bottle);
+
+        // Producer
+        for (size_t i = 0; i < NB_MESSAGES && bottle_send (bottle); i++)
+          nb_p++;
+
+        bottle_close (bottle);
+        pthread_join (eater, 0);
+        bottle_destroy (bottle);
+
+        printf ("%zu messages produced, %zu messages consumed in %f seconds (wall clock).\n\n", nb_p, nb_c, elapsed (start));
+      }
+}
+
+#define NB_THREADS 4
+static void *
+produce_share (void *arg)
+{
+  bottle_t (int) * bottle = arg;
+  for (size_t i = 0; i < NB_MESSAGES / NB_THREADS && bottle_send (bottle); i++)
+    /**/;
+  return 0;
+}
+
+static void *
+consume_share (void *arg)
+{
+  bottle_t (int) * bottle = arg;
+  while (bottle_recv (bottle))
+    /**/;
+  return 0;
+}
+
+static void
+test5 (void)
+{
+  // Several senders and receivers on a shared bottle, measured in wall clock time.
+  bottle_engine engine[] = { BOTTLE_MUTEX, BOTTLE_TWO_LOCK, BOTTLE_MPMC };
+  const char *name[] = { "mutex", "two-lock", "MPMC" };
+  for (size_t e = 0; e < sizeof (engine) / sizeof (*engine); e++)
+  {
+    printf ("*** TEST %lu ***\n", ++test_number);
+    struct timespec start = now ();
+    bottle_options options = {.engine = engine[e] };
+    bottle_t (int) * bottle = bottle_create (int, 1000, &options);
+    printf ("Declared capacity: %i, %s engine, %i senders and %i receivers\n", 1000, name[e], NB_THREADS, NB_THREADS);
+    pthread_t producers[NB_THREADS], consumers[NB_THREADS];
+    for (size_t i = 0; i < NB_THREADS; i++)
+    {
+      pthread_create (&producers[i], 0, produce_share, bottle);
+      pthread_create (&consumers[i], 0, consume_share, bottle);
+    }
+    for (size_t i = 0; i < NB_THREADS; i++)
+      pthread_join (producers[i], 0);
+    bottle_close (bottle);
+    for (size_t i = 0; i < NB_THREADS; i++)
+      pthread_join (consumers[i], 0);
+    bottle_destroy (bottle);
+
+    printf ("%i messages exchanged in %f seconds (wall clock).\n\n", NB_MESSAGES, elapsed (start));
+  }
+}
+
+static void
+test6 (void)
+{
+  // False sharing: adjacent slots of the ring written by different threads on different cores, with and without padding.
+  int padded[] = { 0, 1 };
+  for (size_t p = 0; p < sizeof (padded) / sizeof (*padded); p++)
+  {
+    printf ("*** TEST %lu ***\n", ++test_number);
+    struct timespec start = now ();
+    bottle_options options = {.engine = BOTTLE_MPMC,.padded_slots = padded[p] };
+    bottle_t (int) * bottle = bottle_create (int, 1000, &options);
+    printf ("Declared capacity: %i, MPMC engine, %s slots, %i senders and %i receivers\n", 1000, padded[p] ? "padded" : "packed", NB_THREADS,
+            NB_THREADS);
+    pthread_t producers[NB_THREADS], consumers[NB_THREADS];
+    for (size_t i = 0; i < NB_THREADS; i++)
+    {
+      pthread_create (&producers[i], 0, produce_share, bottle);
+      pthread_create (&consumers[i], 0, consume_share, bottle);
+    }
+    for (size_t i = 0; i < NB_THREADS; i++)
+      pthread_join (producers[i], 0);
+    bottle_close (bottle);
+    for (size_t i = 0; i < NB_THREADS; i++)
+      pthread_join (consumers[i], 0);
+    bottle_destroy (bottle);
+
+    printf ("%i messages exchanged in %f seconds (wall clock).\n\n", NB_MESSAGES, elapsed (start));
+  }
+}
+
+static void
+test7 (void)
+{
+  // Burst in an UNLIMITED bottle: the whole burst is queued before being received, stored contiguously or as linked blocks.
+  size_t segment[] = { 0, 1024 };
+  for (size_t s = 0; s < sizeof (segment) / sizeof (*segment); s++)
+  {
+    printf ("*** TEST %lu ***\n", ++test_number);
+    struct timespec start = now ();
+    bottle_options options = {.segment = segment[s] };
+    bottle_t (int) * bottle = bottle_create (int, UNLIMITED, &options);
+    printf ("Declared capacity: UNLIMITED, %zu messages per block\n", segment[s]);
+    double worst = 0;
+    for (int i = 0; i < NB_MESSAGES; i++)
+    {
+      struct timespec t = now ();
+      bottle_send (bottle, i);
+      double e = elapsed (t);
+      if (e > worst)
+        worst = e;
+    }
+    for (int i = 0, j; i < NB_MESSAGES; i++)
+    {
+      struct timespec t = now ();
+      bottle_recv (bottle, &j);
+      double e = elapsed (t);
+      if (e > worst)
+        worst = e;
+    }
+    bottle_destroy (bottle);
+
+    printf ("%i messages exchanged in %f seconds (wall clock), longest operation %f seconds.\n\n", NB_MESSAGES, elapsed (start), worst);
+  }
+}
+
+#define NB_FRAMES (NB_MESSAGES / 10)
+static void *
+eat_frames (void *arg)
+{
+  bottle_t (Frame) * bottle = arg;
+  Frame frame;
+  size_t sum = 0;
+  while (bottle_recv (bottle, &frame))
+    sum += frame.seq + (size_t) frame.payload[0];
+  return (void *) sum;
+}
+
+static void *
+eat_frames_in_place (void *arg)
+{
+  bottle_t (Frame) * bottle = arg;
+  const Frame *frame;
+  size_t sum = 0;
+  while ((frame = bottle_acquire (bottle)))
+  {
+    sum += frame->seq + (size_t) frame->payload[0];
+    bottle_release (bottle);
+  }
+  return (void *) sum;
+}
+
+static void
+test8 (void)
+{
+  // Large messages (2 KB frames): copied in and out of the bottle, or built and read in place.
+  bottle_engine engine[] = { BOTTLE_MUTEX, BOTTLE_SPSC };
+  for (size_t e = 0; e < sizeof (engine) / sizeof (*engine); e++)
+    for (int in_place = 0; in_place < 2; in_place++)
+    {
+      printf ("*** TEST %lu ***\n", ++test_number);
+      struct timespec start = now ();
+      bottle_options options = {.engine = engine[e] };
+      bottle_t (Frame) * bottle = bottle_create (Frame, 64, &options);
+      printf ("Declared capacity: %i, %s engine, frames of %zu bytes %s\n", 64, engine[e] == BOTTLE_SPSC ? "SPSC" : "mutex", sizeof (Frame),
+              in_place ? "built and read in place" : "copied");
+      pthread_t eater;
+      pthread_create (&eater, 0, in_place ? eat_frames_in_place : eat_frames, bottle);
+
+      // Producer
+      if (in_place)
+        for (size_t i = 0; i < NB_FRAMES; i++)
+        {
+          Frame *frame = bottle_reserve (bottle);
+          frame->seq = i;
+          memset (frame->payload, (int) i, sizeof (frame->payload));
+          bottle_commit (bottle);
+        }
+      else
+        for (size_t i = 0; i < NB_FRAMES; i++)
+        {
+          Frame frame = {.seq = i };
+          memset (frame.payload, (int) i, sizeof (frame.payload));
+          bottle_send (bottle, frame);
+        }
+
+      bottle_close (bottle);
+      void *sum;
+      pthread_join (eater, &sum);
+      bottle_destroy (bottle);
+
+      printf ("%i frames exchanged in %f seconds (wall clock), checksum %zu.\n\n", NB_FRAMES, elapsed (start), (size_t) sum);
+    }
+}
+
+#define NB_BOTTLES (NB_MESSAGES / 10)
+static void
+test9 (void)
+{
+  // Many short-lived bottles: allocated, or fixed with their messages stored inline (on the stack here).
+  for (int fixed = 0; fixed < 2; fixed++)
+  {
+    printf ("*** TEST %lu ***\n", ++test_number);
+    struct timespec start = now ();
+    printf ("Declared capacity: %i, %s bottles\n", 8, fixed ? "fixed" : "allocated");
+    size_t sum = 0;
+    for (size_t i = 0; i < NB_BOTTLES; i++)
+    {
+      bottle_fixed_t (int, 8) storage;
+      bottle_t (int) * bottle = fixed ? bottle_fixed_init (int, 8, &storage) : bottle_create (int, 8);
+      for (int j = 0; j < 8; j++)
+        bottle_send (bottle, j);
+      for (int j = 0, k; j < 8; j++)
+        if (bottle_recv (bottle, &k))
+          sum += (size_t) k;
+      bottle_destroy (bottle);
+    }
+
+    printf ("%i bottles used in %f seconds (wall clock), checksum %zu.\n\n", NB_BOTTLES, elapsed (start), sum);
+  }
+}
+
+#define NB_SUBSCRIBERS 4
+static void *
+read_frames (void *arg)
+{
+  bottle_subscriber_t (Frame) * subscriber = arg;
+  Frame frame;
+  size_t sum = 0;
+  while (bottle_read (subscriber, &frame))
+    sum += frame.seq + (size_t) frame.payload[0];
+  return (void *) sum;
+}
+
+static void
+test10 (void)
+{
+  // Fan-out of large messages to several receivers: one bottle per receiver, or one broadcast bottle read by all the subscribers.
+  for (int broadcast = 0; broadcast < 2; broadcast++)
+  {
+    printf ("*** TEST %lu ***\n", ++test_number);
+    struct timespec start = now ();
+    printf ("Declared capacity: %i, %i receivers, frames of %zu bytes %s\n", 64, NB_SUBSCRIBERS, sizeof (Frame),
+            broadcast ? "broadcast" : "copied to each bottle");
+    bottle_t (Frame) * bottles[NB_SUBSCRIBERS];
+    bottle_subscriber_t (Frame) subscribers[NB_SUBSCRIBERS];
+    pthread_t eaters[NB_SUBSCRIBERS];
+    if (broadcast)
+      bottles[0] = bottle_create_broadcast (Frame, 64);
+    for (size_t i = 0; i < NB_SUBSCRIBERS; i++)
+      if (broadcast)
+      {
+        bottle_subscribe (bottles[0], &subscribers[i]);
+        pthread_create (&eaters[i], 0, read_frames, &subscribers[i]);
+      }
+      else
+      {
+        bottles[i] = bottle_create (Frame, 64);
+        pthread_create (&eaters[i], 0, eat_frames, bottles[i]);
+      }
+
+    // Producer
+    for (size_t i = 0; i < NB_FRAMES; i++)
+    {
+      Frame frame = {.seq = i };
+      memset (frame.payload, (int) i, sizeof (frame.payload));
+      for (size_t j = 0; j < (broadcast ? 1 : NB_SUBSCRIBERS); j++)
+        bottle_send (bottles[j], frame);
+    }
+
+    size_t sum = 0;
+    for (size_t i = 0; i < (broadcast ? 1 : NB_SUBSCRIBERS); i++)
+      bottle_close (bottles[i]);
+    for (size_t i = 0; i < NB_SUBSCRIBERS; i++)
+    {
+      void *s;
+      pthread_join (eaters[i], &s);
+      sum += (size_t) s;
+    }
+    for (size_t i = 0; i < (broadcast ? 1 : NB_SUBSCRIBERS); i++)
+      bottle_destroy (bottles[i]);
+
+    printf ("%i frames delivered to %i receivers in %f seconds (wall clock), checksum %zu.\n\n", NB_FRAMES, NB_SUBSCRIBERS, elapsed (start),
+            sum);
+  }
+}
+
+static int
+lowest_first (const void *a, const void *b)
+{
+  return (*(const int *) a > *(const int *) b) - (*(const int *) a < *(const int *) b);
+}
+
+static void *
+send_late (void *arg)           // Sends a message after 10 milliseconds
+{
+  nanosleep (&(struct timespec){ 0, 10 * 1000 * 1000 }, 0);
+  bottle_send ((bottle_t (int) *) arg, 1);
+  return 0;
+}
+
+static void
+test12 (void)
+{
+  // Timed exchanges, for each engine: work is shed once a deadline is reached, and a message arriving before it is not missed.
+  struct
+  {
+    const char *name;
+    size_t capacity;
+    bottle_options options;
+  } cases[] = {
+    {"mutex (unbuffered)", 0, {0}},
+    {"mutex", 4, {0}},
+    {"SPSC", 4, {.engine = BOTTLE_SPSC}},
+    {"MPMC", 4, {.engine = BOTTLE_MPMC}},
+    {"two-lock", 4, {.engine = BOTTLE_TWO_LOCK}},
+    {"priority", 4, {.engine = BOTTLE_PRIORITY,.compare = lowest_first}},
+    {"token", 4, {.engine = BOTTLE_TOKEN}},
+  };
+  for (size_t c = 0; c < sizeof (cases) / sizeof (*cases); c++)
+  {
+    printf ("*** TEST %lu ***\n", ++test_number);
+    struct timespec start = now ();
+    printf ("Declared capacity: %zu, %s engine, timed exchanges\n", cases[c].capacity, cases[c].name);
+    bottle_t (int) * bottle = bottle_create (int, cases[c].capacity, &cases[c].options);
+    struct timespec timeout = { 0, 10 * 1000 * 1000 }, long_timeout = { 1, 0 };
+
+    // Nothing to receive: the receiver gives up after the timeout.
+    int m, ret;
+    struct timespec t = now ();
+    errno = 0;
+    ret = bottle_recv_for (bottle, &m, &timeout);
+    assert (!ret && errno == ETIMEDOUT && elapsed (t) >= 0.01);
+
+    // No room (or no receiver at the meeting point): the sender gives up at the deadline.
+    for (size_t i = 0; i < cases[c].capacity; i++)
+      bottle_send (bottle, (int) i);
+    struct timespec deadline;
+    timespec_get (&deadline, TIME_UTC);
+    deadline.tv_nsec += 10 * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000)
+      deadline.tv_sec++, deadline.tv_nsec -= 1000 * 1000 * 1000;
+    errno = 0;
+    ret = bottle_send_until (bottle, 0, &deadline);
+    assert (!ret && errno == ETIMEDOUT);
+    for (size_t i = 0; i < cases[c].capacity; i++)
+      bottle_recv (bottle);
+
+    // A message sent before the deadline is received.
+    pthread_t sender;
+    pthread_create (&sender, 0, send_late, bottle);
+    t = now ();
+    ret = bottle_recv_for (bottle, &m, &long_timeout);
+    assert (ret && elapsed (t) < 1);
+    pthread_join (sender, 0);
+
+    // A closed bottle is reported as such rather than as a timeout.
+    bottle_close (bottle);
+    errno = 0;
+    ret = bottle_recv_for (bottle, &m, &timeout);
+    assert (!ret && errno == ECONNABORTED);
+    bottle_destroy (bottle);
+
+    printf ("Timed exchanges checked in %f seconds (wall clock).\n\n", elapsed (start));
+  }
+}
+
+#ifdef BOTTLE_MMAP
+#  define NB_RECORDS (200 * 1000)
+#  define SPILL_WATERMARK (NB_RECORDS / 10)
+
+// Counts the blocks of the process spilled to disk, mapped from their (deleted) segment files.
+static size_t
+spilled_blocks (void)
+{
+  FILE *maps = fopen ("/proc/self/maps", "r");
+  char line[4096];
+  size_t n = 0;
+  while (maps && fgets (line, sizeof (line), maps))
+    if (strstr (line, "/bottle-") && strstr (line, "(deleted)"))
+      n++;
+  if (maps)
+    fclose (maps);
+  return n;
+}
+
+static void
+test11 (void)
+{
+  // Backlog of an UNLIMITED bottle spilled to disk past its watermark, then read back in order.
+  printf ("*** TEST %lu ***\n", ++test_number);
+  struct timespec start = now ();
+  bottle_options options = {.segment = 1024,.spill_directory = P_tmpdir,.spill_watermark = SPILL_WATERMARK };
+  bottle_t (Record) * bottle = bottle_create (Record, UNLIMITED, &options);
+  printf ("Declared capacity: UNLIMITED, %zu messages per block, records of %zu bytes spilled to %s past %i messages\n", options.segment,
+          sizeof (Record), P_tmpdir, SPILL_WATERMARK);
+  for (size_t i = 0; i < NB_RECORDS; i++)
+  {
+    Record record = {.seq = i };
+    memset (record.payload, (int) i, sizeof (record.payload));
+    bottle_send (bottle, record);
+  }
+  size_t spilled = spilled_blocks ();
+  assert (spilled > 0);
+  bottle_statistics stats;
+  bottle_stats (bottle, &stats);
+  assert (stats.size == NB_RECORDS);
+  assert (stats.resizes > 0);
+
+  for (size_t i = 0; i < NB_RECORDS; i++)
+  {
+    Record record = {.seq = (size_t) -1 };
+    bottle_recv (bottle, &record);
+    assert (record.seq == i);   // First in, first out, across blocks in memory and on disk
+    assert (record.payload[0] == (char) i && record.payload[sizeof (record.payload) - 1] == (char) i);
+  }
+  bottle_stats (bottle, &stats);
+  assert (stats.size == 0);
+#  ifdef BOTTLE_STATISTICS
+  assert (stats.sent == NB_RECORDS && stats.received == NB_RECORDS);
+  assert (stats.max_size == NB_RECORDS);
+#  endif
+  bottle_destroy (bottle);
+  assert (spilled_blocks () == 0);
+
+  printf ("%i messages exchanged in %f seconds (wall clock), %zu blocks spilled to disk.\n\n", NB_RECORDS, elapsed (start), spilled);
+}
+#endif
+
 int
 main (void)
 {
   test2 ();
   test1 ();
+  test3 ();
+  test4 ();
+  test5 ();
+  test6 ();
+  test7 ();
+  test8 ();
+  test9 ();
+  test10 ();
+  test12 ();
+#ifdef BOTTLE_MMAP
+  test11 ();
+#endif
 }
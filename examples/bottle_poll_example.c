@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+#define BOTTLE_POLL             // Pollable bottles (Linux)
+#include <stdio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bottle_impl.h"
+typedef const char *Message;
+bottle_type_declare (int);
+bottle_type_define (int);
+bottle_type_declare (Message);
+bottle_type_define (Message);
+
+static void *
+count (void *arg)               // Sends numbers
+{
+  bottle_t (int) * bottle = arg;
+  for (int i = 1; i <= 1000; i++)
+    bottle_send (bottle, i);
+  bottle_close (bottle);
+  return 0;
+}
+
+static void *
+talk (void *arg)                // Sends words
+{
+  bottle_t (Message) * bottle = arg;
+  Message words[] = { "Just", "a", "castaway", "An", "island", "lost", "at", "sea" };
+  for (Message * w = words; w < words + sizeof (words) / sizeof (*words); w++)
+  {
+    bottle_send (bottle, *w);
+    usleep (10000);
+  }
+  bottle_close (bottle);
+  return 0;
+}
+
+int
+main (void)
+{
+  bottle_options options = { .pollable = 1 };
+  bottle_t (int) * numbers = bottle_create (int, 16, &options);
+  bottle_t (Message) * words = bottle_create (Message, 1, &options);
+  pthread_t counter, talker;
+  pthread_create (&counter, 0, count, numbers);
+  pthread_create (&talker, 0, talk, words);
+
+  // The event loop waits on the bottles with poll, as it would on sockets, without any thread blocked on a bottle.
+  struct pollfd fds[] = { {.fd = bottle_recv_fd (numbers), .events = POLLIN}, {.fd = bottle_recv_fd (words), .events = POLLIN} };
+  int sum = 0;
+  int n;
+  Message m;
+  while ((fds[0].fd >= 0 || fds[1].fd >= 0) && poll (fds, 2, -1) > 0)
+  {
+    // The descriptors are only polled, never read: messages are received without blocking until the bottle is empty.
+    if (fds[0].revents & POLLIN)
+    {
+      errno = 0;
+      while (bottle_try_recv (numbers, &n))
+        sum += n;
+      if (errno == ECONNABORTED)        // Closed and empty
+        fds[0].fd = -1;
+    }
+    if (fds[1].revents & POLLIN)
+    {
+      errno = 0;
+      while (bottle_try_recv (words, &m))
+        printf ("%s\n", m);
+      if (errno == ECONNABORTED)
+        fds[1].fd = -1;
+    }
+  }
+  printf ("Sum of numbers: %i\n", sum);
+
+  pthread_join (counter, 0);
+  pthread_join (talker, 0);
+  bottle_destroy (numbers);
+  bottle_destroy (words);
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bottle_impl.h"
+typedef struct
+{
+  int priority;                 // Lowest value first
+  int rank;                     // Order of sending
+} Job;
+bottle_type_declare (Job);
+bottle_type_define (Job);
+bottle_fixed_type_declare (Job, 16);
+
+static int
+urgent_first (const void *a, const void *b)
+{
+  const Job *x = a, *y = b;
+  return (x->priority > y->priority) - (x->priority < y->priority);
+}
+
+// Receives all the jobs of the bottle, and checks that they come out by priority, and in the order of sending for equal priorities.
+static int
+drain (bottle_t (Job) * jobs, size_t expected, int verbose)
+{
+  Job job, previous = { -1, -1 };
+  size_t received = 0;
+  int ok = 1;
+  while (bottle_try_recv (jobs, &job))
+  {
+    if (verbose)
+      printf ("Job %2i of priority %i\n", job.rank, job.priority);
+    if (job.priority < previous.priority || (job.priority == previous.priority && job.rank < previous.rank))
+      ok = 0;
+    previous = job;
+    received++;
+  }
+  return ok && received == expected;
+}
+
+static void *
+wait_for_job (void *arg)        // Blocks on the empty bottle until it is closed
+{
+  bottle_t (Job) * jobs = arg;
+  Job job;
+  static int closed;
+  closed = !bottle_recv (jobs, &job) && errno == ECONNABORTED;
+  return &closed;
+}
+
+int
+main (void)
+{
+  int ok = 1;
+
+  // Bulk jobs (priority 2) are overtaken by urgent ones (priority 0) and normal ones (priority 1), sent later.
+  bottle_options options = {.engine = BOTTLE_PRIORITY,.compare = urgent_first };
+  bottle_fixed_t (Job, 16) inline_jobs;         // The messages and their ranks are stored inline, without heap allocation
+  bottle_t (Job) * jobs = bottle_fixed_init (Job, 16, &inline_jobs, &options);
+  int priorities[] = { 2, 2, 2, 1, 2, 0, 1, 2, 0, 2, 1, 0 };
+  for (int i = 0; i < (int) (sizeof (priorities) / sizeof (*priorities)); i++)
+    bottle_send (jobs, ((Job) { priorities[i], i }));
+  if (!drain (jobs, sizeof (priorities) / sizeof (*priorities), 1))
+    ok = 0, printf ("FAILED: the jobs of the fixed bottle are not in order.\n");
+
+  // A receiver blocked on the empty bottle is woken up when it is closed.
+  pthread_t waiter;
+  pthread_create (&waiter, 0, wait_for_job, jobs);
+  sleep (1);
+  bottle_close (jobs);
+  int *closed;
+  pthread_join (waiter, (void **) &closed);
+  if (!*closed)
+    ok = 0, printf ("FAILED: the blocked receiver was not woken up by closing the bottle.\n");
+  bottle_destroy (jobs);
+
+  // Many jobs of a few priorities, in the heap of a bottle allocated dynamically.
+  jobs = bottle_create_priority (Job, 1000, urgent_first);
+  srand (1);
+  for (int i = 0; i < 1000; i++)
+    bottle_send (jobs, ((Job) { rand () % 8, i }));
+  if (!drain (jobs, 1000, 0))
+    ok = 0, printf ("FAILED: the jobs of the allocated bottle are not in order.\n");
+  bottle_destroy (jobs);
+
+  printf ("%s\n", ok ? "Jobs received by priority, in the order of sending for equal priorities." : "FAILED");
+  return !ok;
+}
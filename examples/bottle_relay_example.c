@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include "bottle_impl.h"
+
+// Frames are relayed in place, from one input bottle to two output bottles of the same type, by a tee.
+typedef struct
+{
+  size_t number;
+  char payload[1000];
+} Frame;
+
+DECLARE_BOTTLE (Frame);
+DEFINE_BOTTLE (Frame);
+
+static const bottle_options options = {.engine = BOTTLE_MPMC };
+static const size_t FRAMES = 10000;
+
+static int
+produce (void *arg)
+{
+  BOTTLE (Frame) * input = arg;
+  for (size_t i = 1; i <= FRAMES; i++)
+  {
+    Frame *frame = bottle_reserve (input);
+    frame->number = i;
+    snprintf (frame->payload, sizeof (frame->payload), "Frame #%zu", i);
+    bottle_commit (input);
+  }
+  bottle_close (input);
+  return 0;
+}
+
+static BOTTLE (Frame) * left, *right;
+
+static int
+tee (void *arg)
+{
+  BOTTLE (Frame) * input = arg;
+  const Frame *frame;
+  while ((frame = bottle_acquire (input)))
+  {
+    // Both reservations are held together, and committed in any order.
+    Frame *l = bottle_reserve (left);
+    Frame *r = bottle_reserve (right);
+    *l = *r = *frame;
+    bottle_commit (left);
+    bottle_commit (right);
+    bottle_release (input);
+  }
+  bottle_close (left);
+  bottle_close (right);
+  return 0;
+}
+
+static int
+consume (void *arg)
+{
+  BOTTLE (Frame) * output = arg;
+  size_t sum = 0, expected = 1;
+  const Frame *frame;
+  while ((frame = bottle_acquire (output)))
+  {
+    if (frame->number != expected++)
+      printf ("Frame #%zu received out of order.\n", frame->number);
+    sum += frame->number;
+    bottle_release (output);
+  }
+  return sum != FRAMES * (FRAMES + 1) / 2;
+}
+
+int
+main (void)
+{
+  BOTTLE (Frame) * input = bottle_create (Frame, 16, &options);
+  left = bottle_create (Frame, 16, &options);
+  right = bottle_create (Frame, 16, &options);
+
+  thrd_t producer, relay, consumers[2];
+  thrd_create (&producer, produce, input);
+  thrd_create (&relay, tee, input);
+  thrd_create (&consumers[0], consume, left);
+  thrd_create (&consumers[1], consume, right);
+
+  int res[2];
+  thrd_join (producer, 0);
+  thrd_join (relay, 0);
+  thrd_join (consumers[0], &res[0]);
+  thrd_join (consumers[1], &res[1]);
+  printf ("%zu frames relayed in place to both bottles: %s.\n", FRAMES, res[0] || res[1] ? "NOK" : "OK");
+
+  bottle_destroy (input);
+  bottle_destroy (left);
+  bottle_destroy (right);
+  return res[0] || res[1];
+}
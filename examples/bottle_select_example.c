@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "bottle_impl.h"
+typedef const char *Message;
+bottle_type_declare (int);
+bottle_type_define (int);
+bottle_type_declare (Message);
+bottle_type_define (Message);
+
+#define NB_COUNTERS 4
+
+static void *
+count (void *arg)               // Sends numbers
+{
+  bottle_t (int) * bottle = arg;
+  for (int i = 1; i <= 5; i++)
+    bottle_send (bottle, i);
+  bottle_close (bottle);
+  return 0;
+}
+
+static void *
+talk (void *arg)                // Sends words
+{
+  bottle_t (Message) * bottle = arg;
+  Message words[] = { "Just", "a", "castaway", "An", "island", "lost", "at", "sea" };
+  for (Message * w = words; w < words + sizeof (words) / sizeof (*words); w++)
+    bottle_send (bottle, *w);
+  bottle_close (bottle);
+  return 0;
+}
+
+int
+main (void)
+{
+  bottle_t (int) * numbers[NB_COUNTERS];
+  pthread_t counters[NB_COUNTERS];
+  for (size_t i = 0; i < NB_COUNTERS; i++)
+  {
+    numbers[i] = bottle_create (int, 1);
+    pthread_create (&counters[i], 0, count, numbers[i]);
+  }
+  bottle_t (Message) * words = bottle_create (Message);
+  pthread_t talker;
+  pthread_create (&talker, 0, talk, words);
+
+  // The router waits on all the bottles at once, whatever their type.
+  int n;
+  Message m;
+  bottle_case cases[NB_COUNTERS + 1];
+  for (size_t i = 0; i < NB_COUNTERS; i++)
+    cases[i] = bottle_case_recv (numbers[i], &n);
+  cases[NB_COUNTERS] = bottle_case_recv (words, &m);
+
+  int sum = 0;
+  int i;
+  while ((i = bottle_select_n (cases, NB_COUNTERS + 1)) >= 0)   // Returns -1 once all the bottles are closed and empty.
+    if (i == NB_COUNTERS)
+      printf ("%s\n", m);
+    else
+      sum += n;
+  printf ("Sum of numbers: %i\n", sum);
+
+  for (size_t i = 0; i < NB_COUNTERS; i++)
+  {
+    pthread_join (counters[i], 0);
+    bottle_destroy (numbers[i]);
+  }
+  pthread_join (talker, 0);
+  bottle_destroy (words);
+}
@@ -0,0 +1,69 @@
+#define _GNU_SOURCE
+#define BOTTLE_SHM              // Bottles shared between processes (POSIX)
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bottle_impl.h"
+typedef struct
+{
+  int id;
+  double value;                 // Messages are copied between processes: they hold no pointer
+} Sample;
+bottle_type_declare (Sample);
+bottle_type_define (Sample);
+
+#define NAME "/bottle_shm_example"
+#define SAMPLES 100000
+
+static int
+compute (void)                  // Receives samples in a separate process
+{
+  // The receiver opens the bottle by its name, as an unrelated program would.
+  bottle_t (Sample) * samples = bottle_create_shared (Sample, NAME, 64);
+  if (!samples)
+  {
+    perror (NAME);
+    return 1;
+  }
+  Sample s;
+  double sum = 0;
+  int n = 0;
+  while (bottle_recv (samples, &s))
+  {
+    sum += s.value;
+    n++;
+  }
+  printf ("%i samples received by process %i, mean %g.\n", n, getpid (), sum / n);
+  bottle_destroy (samples);
+  return 0;
+}
+
+int
+main (void)
+{
+  // The sender creates the bottle before the receiver is started, and unlinks its name when destroying it.
+  bottle_t (Sample) * samples = bottle_create_shared (Sample, NAME, 64);
+  if (!samples)
+  {
+    perror (NAME);
+    return 1;
+  }
+  pid_t receiver = fork ();
+  if (receiver == 0)
+  {
+    int ret = compute ();
+    fflush (stdout);
+    _exit (ret);
+  }
+
+  for (int i = 0; i < SAMPLES; i++)
+    bottle_send (samples, ((Sample) {.id = i,.value = i % 100 }));
+  bottle_close (samples);       // The receiver gets the remaining samples, then stops
+  printf ("%i samples sent by process %i.\n", SAMPLES, getpid ());
+
+  int status;
+  waitpid (receiver, &status, 0);
+  bottle_destroy (samples);
+  return WIFEXITED (status) ? WEXITSTATUS (status) : 1;
+}
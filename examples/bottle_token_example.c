@@ -4,7 +4,15 @@ typedef int Token;
 DECLARE_BOTTLE (Token);
 DEFINE_BOTTLE (Token);
 
-#define PRINT_TOKEN printf (" (%lu/%lu).\n", QUEUE_SIZE((tokens_in_use).queue), BOTTLE_CAPACITY)
+static size_t
+tokens (BOTTLE (Token) * bottle)        // Number of tokens in use
+{
+  bottle_statistics stats;
+  bottle_stats (bottle, &stats);        // The size is set even if statistics are not kept
+  return stats.size;
+}
+
+#define PRINT_TOKEN printf (" (%lu/%lu).\n", tokens (&tokens_in_use), BOTTLE_CAPACITY)
 #define GET_TOKEN   printf ("Token requested: %s", BOTTLE_TRY_FILL (&tokens_in_use) ? "OK" : "NOK")
 #define LET_TOKEN   printf ("Token released:  %s", BOTTLE_TRY_DRAIN (&tokens_in_use) ? "OK" : "NOK")
 #define GET_AND_PRINT do { GET_TOKEN; PRINT_TOKEN; } while (0)
@@ -14,7 +22,8 @@ int
 main (void)
 {
   const size_t BOTTLE_CAPACITY = 3;
-  BOTTLE_DECL (tokens_in_use, Token, BOTTLE_CAPACITY);
+  const bottle_options options = {.engine = BOTTLE_TOKEN };     // Tokens carry no payload: the bottle is only a count
+  BOTTLE_DECL (tokens_in_use, Token, BOTTLE_CAPACITY, &options);
 
   GET_AND_PRINT;
   GET_AND_PRINT;
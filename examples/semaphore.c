@@ -4,7 +4,7 @@
 #define semaphore_declare bottle_type_declare (char)
 #define semaphore_define bottle_type_define (char)
 #define sem_t bottle_t (char)
-#define semaphore_create(size) bottle_create (char, (size))
+#define semaphore_create(size) bottle_create_token (char, (size))
 #define semaphore_init(sem) do { while (bottle_try_send (sem)); } while (0)
 #define semaphore_capacity(sem) bottle_capacity(sem)
 #define semaphore_request(sem) bottle_recv (sem)